@@ -0,0 +1,68 @@
+class DataSeries {
+	private long[] times;
+	private double[] values;
+	private double[] mins;
+	private double[] maxs;
+	private int size;
+
+	public DataSeries() {
+		this(1024);
+	}
+
+	public DataSeries(int capacity) {
+		if (capacity < 1) capacity = 1;
+		times = new long[capacity];
+		values = new double[capacity];
+		mins = new double[capacity];
+		maxs = new double[capacity];
+		size = 0;
+	}
+
+	/* make room for at least n more points */
+	public void ensureCapacity(int n) {
+		if (size + n <= times.length) return;
+		int len = Math.max(times.length * 2, size + n);
+		long[] t = new long[len];
+		double[] v = new double[len];
+		double[] mn = new double[len];
+		double[] mx = new double[len];
+		System.arraycopy(times, 0, t, 0, size);
+		System.arraycopy(values, 0, v, 0, size);
+		System.arraycopy(mins, 0, mn, 0, size);
+		System.arraycopy(maxs, 0, mx, 0, size);
+		times = t;
+		values = v;
+		mins = mn;
+		maxs = mx;
+	}
+
+	public void add(long time, double value, double min, double max) {
+		ensureCapacity(1);
+		times[size] = time;
+		values[size] = value;
+		mins[size] = min;
+		maxs[size] = max;
+		size++;
+	}
+
+	public int size() {
+		return size;
+	}
+	/* used after filling the arrays directly, see ensureCapacity() */
+	public void setSize(int size) {
+		this.size = size;
+	}
+	/* times are in milliseconds since Jan 1, 1970 GMT, like java.util.Date */
+	public long[] getTimes() {
+		return times;
+	}
+	public double[] getValues() {
+		return values;
+	}
+	public double[] getMins() {
+		return mins;
+	}
+	public double[] getMaxs() {
+		return maxs;
+	}
+}
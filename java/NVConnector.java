@@ -1,8 +1,9 @@
 import java.net.Socket;
 import java.io.OutputStreamWriter;
-import java.io.BufferedReader;
-import java.io.InputStreamReader;
+import java.io.BufferedInputStream;
+import java.io.DataInputStream;
 import java.io.BufferedWriter;
+import java.io.ByteArrayOutputStream;
 import java.io.IOException;
 import java.util.Date;
 import java.text.DateFormat;
@@ -14,8 +15,9 @@ class NVConnector {
 	private String host;
 	private int port = 12346;
 	private Socket sock;
-	private BufferedReader br;
+	private DataInputStream in;
 	private BufferedWriter bw;
+	private int proto = 1;
 
 	private NVConnector() { }
 
@@ -38,17 +40,23 @@ class NVConnector {
 		this.port = port;
 	}
 
+	/* negotiated protocol version, 2 when FETCH data arrives in frames */
+	public int getProtocol() {
+		return proto;
+	}
+
 	private void connect() throws IOException {
 		String line;
 		String[] words;
 
 		sock = new Socket(host, port);
-		br = new BufferedReader(new InputStreamReader(sock.getInputStream()));
+		in = new DataInputStream(new BufferedInputStream(
+				sock.getInputStream()));
 		bw = new BufferedWriter(new OutputStreamWriter(sock.getOutputStream()));
 
 		/* wait for proto version */
 		for (;;) {
-			line = br.readLine();
+			line = readLine();
 			if (line == null) {
 				throw new IOException("Remote end disconnected.");
 			}
@@ -60,14 +68,44 @@ class NVConnector {
 				throw new IOException("Invalid server header.");
 			}
 		}
+
+		/* ask for binary FETCH responses, older servers will refuse */
+		String cmd = "PROTO 2.0\r\n";
+		bw.write(cmd, 0, cmd.length());
+		bw.flush();
+		line = readLine();
+		if (line == null) {
+			throw new IOException("Remote end disconnected.");
+		}
+		if ("101 proto_2.0".equals(line)) {
+			proto = 2;
+		} else if (!line.startsWith("200")) {
+			throw new IOException("Invalid server response for PROTO " +
+								  "command.");
+		}
 	}
 
-	public ArrayList getData(String system, String dset, Date start,
-							 Date end, int resolution)
-			throws IOException {
-		String line;
-		String[] words;
+	/* read a text line, the binary frames share the same stream */
+	private String readLine() throws IOException {
+		ByteArrayOutputStream buf = new ByteArrayOutputStream(128);
+		int c;
+
+		for (;;) {
+			c = in.read();
+			if (c == -1) {
+				if (buf.size() == 0) return null;
+				break;
+			}
+			if (c == '\n') break;
+			buf.write(c);
+		}
+		String line = buf.toString("US-ASCII");
+		if (line.endsWith("\r")) line = line.substring(0, line.length()-1);
+		return line;
+	}
 
+	private void sendFetch(String system, String dset, Date start, Date end,
+						   int resolution) throws IOException {
 		/* get UNIX times - seconds since Jan 1, 1970 GMT */
 		long start_secs = start.getTime() / 1000;
 		long end_secs = end.getTime() / 1000;
@@ -78,33 +116,62 @@ class NVConnector {
 				 String.valueOf(end_secs) + " " + resolution + "\r\n";
 		bw.write(cmd, 0, cmd.length());
 		bw.flush();
+	}
+
+	/* read proto_2.0 frames straight into the series arrays */
+	private void readFrames(DataSeries series) throws IOException {
+		for (;;) {
+			int num = in.readInt();
+			if (num == 0) break;
+			if (num < 0) {
+				throw new IOException("Invalid server frame for FETCH " +
+									  "command.");
+			}
+			series.ensureCapacity(num);
+			int base = series.size();
+			long[] times = series.getTimes();
+			double[] values = series.getValues();
+			double[] mins = series.getMins();
+			double[] maxs = series.getMaxs();
+			for (int i = base; i < base+num; i++) {
+				times[i] = in.readLong() * 1000;
+			}
+			for (int i = base; i < base+num; i++) values[i] = in.readDouble();
+			for (int i = base; i < base+num; i++) mins[i] = in.readDouble();
+			for (int i = base; i < base+num; i++) maxs[i] = in.readDouble();
+			series.setSize(base+num);
+		}
+	}
+
+	public DataSeries getSeries(String system, String dset, Date start,
+								Date end, int resolution)
+			throws IOException {
+		String line;
+		String[] words;
+		DataSeries series = new DataSeries();
+
+		sendFetch(system, dset, start, end, resolution);
 
 		/* read back data */
-		ArrayList list = new ArrayList();
 		for (;;) {
-			line = br.readLine();
+			line = readLine();
 			if (line == null) {
 				throw new IOException("Remote end disconnected.");
 			}
 			words = line.split(" ");
-			if ("103".equals(words[0])) {
+			if ("108".equals(words[0])) {
+				readFrames(series);
+			} else if ("103".equals(words[0])) {
 				if (words.length != 5) {
 					throw new IOException("Invalid server response for " +
 										  "FETCH command.");
 				}
-				/* add to collection*/
-				long utime = Long.parseLong(words[1]) * 1000;
-				Date time = new Date(utime);
-				double value = Double.parseDouble(words[2]);
-				double min = Double.parseDouble(words[3]);
-				double max = Double.parseDouble(words[4]);
-				DataPoint dp = new DataPoint(time, value, min, max);
-				list.add(dp);
-
+				series.add(Long.parseLong(words[1]) * 1000,
+						   Double.parseDouble(words[2]),
+						   Double.parseDouble(words[3]),
+						   Double.parseDouble(words[4]));
 			} else if ("104".equals(words[0])) {
 				/* we're finished */
-				cmd = "quit\r\n";
-				bw.write(cmd, 0, cmd.length());
 				break;
 			} else if ("200".equals(words[0])) {
 				throw new IOException("Server claims 'Invalid request.'");
@@ -113,6 +180,28 @@ class NVConnector {
 									  "command.");
 			}
 		}
+		return series;
+	}
+
+	public ArrayList getData(String system, String dset, Date start,
+							 Date end, int resolution)
+			throws IOException {
+		DataSeries series = getSeries(system, dset, start, end, resolution);
+		long[] times = series.getTimes();
+		double[] values = series.getValues();
+		double[] mins = series.getMins();
+		double[] maxs = series.getMaxs();
+
+		/* add to collection*/
+		ArrayList list = new ArrayList(series.size());
+		for (int i = 0; i < series.size(); i++) {
+			DataPoint dp = new DataPoint(new Date(times[i]), values[i],
+										 mins[i], maxs[i]);
+			list.add(dp);
+		}
+
+		String cmd = "quit\r\n";
+		bw.write(cmd, 0, cmd.length());
 		return list;
 	}
 
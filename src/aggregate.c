@@ -0,0 +1,189 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by Robert Timothy Stewart                          *
+ *   tims@cc.gatech.edu                                                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+#include <netvizd.h>
+#include <nvconfig.h>
+#include <aggregate.h>
+
+static int nv_agg_bucket(struct nv_agg *a, time_t t);
+
+/*
+ * Set up an empty aggregation with buckets 'res' minutes wide.  A
+ * resolution of zero or less keeps every distinct second, which passes
+ * the samples through untouched.
+ */
+void nv_agg_init(struct nv_agg *a, int res) {
+	memset(a, 0, sizeof(*a));
+	a->step = res > 0 ? (time_t)res*60 : 1;
+}
+
+/* release the bucket arrays */
+void nv_agg_free(struct nv_agg *a) {
+	nv_free(a->time);
+	nv_free(a->count);
+	nv_free(a->sum);
+	nv_free(a->min);
+	nv_free(a->max);
+	nv_free(a->last);
+	nv_free(a->ltime);
+	a->num = 0;
+	a->size = 0;
+}
+
+/*
+ * Fold 'n' samples into the buckets in a single pass.  This may be called
+ * any number of times as more samples arrive.  Samples are expected in
+ * time order, which is cheap; out of order samples still land in the
+ * right bucket, just more slowly.  NaN values (unknown) are ignored.
+ */
+void nv_agg_add(struct nv_agg *a, const time_t *time, const double *value,
+				int n) {
+	int i;
+	int b = a->num - 1;
+
+	for (i = 0; i < n; i++) {
+		time_t t = time[i];
+		double v = value[i];
+		time_t start = t - ((t % a->step) + a->step) % a->step;
+
+		if (isnan(v)) continue;
+
+		/* find the bucket, usually the one we just used */
+		if (b < 0 || a->time[b] != start) b = nv_agg_bucket(a, start);
+
+		if (a->count[b] == 0) {
+			a->min[b] = v;
+			a->max[b] = v;
+			a->last[b] = v;
+			a->ltime[b] = t;
+		} else {
+			if (v < a->min[b]) a->min[b] = v;
+			if (v > a->max[b]) a->max[b] = v;
+			if (t >= a->ltime[b]) {
+				a->last[b] = v;
+				a->ltime[b] = t;
+			}
+		}
+		a->count[b]++;
+		a->sum[b] += v;
+	}
+}
+
+/*
+ * Fold in a bucket that was already consolidated elsewhere (e.g. by the
+ * database).  'start' must be aligned to our step.
+ */
+void nv_agg_merge(struct nv_agg *a, time_t start, int count, double sum,
+				  double min, double max, double last, time_t ltime) {
+	int b;
+
+	if (count <= 0) return;
+
+	b = nv_agg_bucket(a, start);
+	if (a->count[b] == 0) {
+		a->min[b] = min;
+		a->max[b] = max;
+		a->last[b] = last;
+		a->ltime[b] = ltime;
+	} else {
+		if (min < a->min[b]) a->min[b] = min;
+		if (max > a->max[b]) a->max[b] = max;
+		if (ltime >= a->ltime[b]) {
+			a->last[b] = last;
+			a->ltime[b] = ltime;
+		}
+	}
+	a->count[b] += count;
+	a->sum[b] += sum;
+}
+
+/*
+ * Return the index of the bucket starting at 't', creating it if needed.
+ */
+int nv_agg_bucket(struct nv_agg *a, time_t t) {
+	int lo = 0;
+	int hi = a->num;
+	int mid;
+
+	/* binary search, except in the common case of a new latest bucket */
+	if (a->num > 0 && a->time[a->num-1] < t) {
+		lo = a->num;
+	} else {
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (a->time[mid] < t) lo = mid + 1;
+			else hi = mid;
+		}
+		if (lo < a->num && a->time[lo] == t) return lo;
+	}
+
+	/* grow the arrays */
+	if (a->num == a->size) {
+		a->size = a->size ? a->size*2 : 64;
+		a->time = nv_realloc(time_t, a->time, a->size);
+		a->count = nv_realloc(int, a->count, a->size);
+		a->sum = nv_realloc(double, a->sum, a->size);
+		a->min = nv_realloc(double, a->min, a->size);
+		a->max = nv_realloc(double, a->max, a->size);
+		a->last = nv_realloc(double, a->last, a->size);
+		a->ltime = nv_realloc(time_t, a->ltime, a->size);
+	}
+
+	/* open a slot at 'lo' */
+	if (lo < a->num) {
+		int m = a->num - lo;
+		memmove(&a->time[lo+1], &a->time[lo], m*sizeof(time_t));
+		memmove(&a->count[lo+1], &a->count[lo], m*sizeof(int));
+		memmove(&a->sum[lo+1], &a->sum[lo], m*sizeof(double));
+		memmove(&a->min[lo+1], &a->min[lo], m*sizeof(double));
+		memmove(&a->max[lo+1], &a->max[lo], m*sizeof(double));
+		memmove(&a->last[lo+1], &a->last[lo], m*sizeof(double));
+		memmove(&a->ltime[lo+1], &a->ltime[lo], m*sizeof(time_t));
+	}
+	a->time[lo] = t;
+	a->count[lo] = 0;
+	a->sum[lo] = 0.0;
+	a->num++;
+	return lo;
+}
+
+/*
+ * The value of bucket 'i' under the given consolidation function.
+ */
+double nv_agg_value(struct nv_agg *a, int i, enum nv_ds_cf cf) {
+	switch (cf) {
+		case ds_cf_min:
+			return a->min[i];
+		case ds_cf_max:
+			return a->max[i];
+		case ds_cf_last:
+			return a->last[i];
+		case ds_cf_average:
+		default:
+			return a->sum[i] / a->count[i];
+	}
+}
+
+/* vim: set ts=4 sw=4: */
@@ -0,0 +1,57 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by Robert Timothy Stewart                          *
+ *   tims@cc.gatech.edu                                                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef _AGGREGATE_H_
+#define _AGGREGATE_H_
+
+#include <netvizd.h>
+#include <nvconfig.h>
+
+/*
+ * Time series samples consolidated into fixed-width buckets aligned to the
+ * epoch (and so to wall-clock minutes, hours, etc.).  Only buckets holding
+ * at least one sample exist; they are kept sorted by time.  Each field is
+ * its own array, indexed by bucket.
+ */
+struct nv_agg {
+	time_t				step;		/* bucket width in seconds */
+	int					num;		/* buckets in use */
+	int					size;		/* buckets allocated */
+
+	time_t *			time;		/* start of each bucket */
+	int *				count;
+	double *			sum;
+	double *			min;
+	double *			max;
+	double *			last;		/* value of the latest sample */
+	time_t *			ltime;		/* time of the latest sample */
+};
+
+void nv_agg_init(struct nv_agg *a, int res);
+void nv_agg_free(struct nv_agg *a);
+void nv_agg_add(struct nv_agg *a, const time_t *time, const double *value,
+				int n);
+void nv_agg_merge(struct nv_agg *a, time_t start, int count, double sum,
+				  double min, double max, double last, time_t ltime);
+double nv_agg_value(struct nv_agg *a, int i, enum nv_ds_cf cf);
+
+#endif
+
+/* vim: set ts=4 sw=4: */
@@ -28,6 +28,7 @@
 #endif
 
 #include <netvizd.h>
+#include <io.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -37,19 +38,8 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-
-static pthread_key_t rl_key;
-static pthread_once_t rl_once = PTHREAD_ONCE_INIT;
-
-typedef struct {
-	int   rl_cnt;           /* initialize to 0 */
-	char *rl_bufptr;        /* initialize to rl_buf */
-	char  rl_buf[BUF_LEN];
-} rline_t;
-
-static void readline_destructor(void *ptr);
-static void readline_once(void);
-static ssize_t my_read(rline_t *tsd, int fd, char *ptr);
+#include <strings.h>
+#include <ctype.h>
 
 /* read n bytes from a descriptor */
 ssize_t readn(int fd, void *vptr, size_t n) {
@@ -95,76 +85,141 @@ ssize_t writen(int fd, const void *vptr, size_t n) {
 	return n;
 }
 
-/* read a text line from a descriptor, 1 byte at a time */
-ssize_t readline(int fd, void *vptr, size_t maxlen) {
-	ssize_t  n, rc;
-	char     c, *ptr;
-	rline_t *tsd;
-	int      s;
-	
-	s = pthread_once(&rl_once, readline_once);
-	if (s != 0) {
-		nv_log(NVLOG_ERROR, "pthread_once: %s", strerror(s));
-		n = s;
-		goto cleanup;
+/* set up an input buffer for a descriptor */
+void nv_rbuf_init(struct nv_rbuf *rb, int fd) {
+	rb->fd = fd;
+	rb->start = 0;
+	rb->end = 0;
+}
+
+/* read whatever the descriptor has for us into the buffer, moving any
+ * partial line to the front first if we're out of room at the end */
+ssize_t nv_rbuf_fill(struct nv_rbuf *rb) {
+	ssize_t n;
+
+	if (rb->end == BUF_LEN-1 && rb->start > 0) {
+		memmove(rb->buf, rb->buf + rb->start, rb->end - rb->start);
+		rb->end -= rb->start;
+		rb->start = 0;
 	}
-	if ((tsd = pthread_getspecific(rl_key)) == NULL) {
-		tsd = nv_calloc(rline_t, 1);
-		s = pthread_setspecific(rl_key, tsd);
-		if (s != 0) {
-			nv_log(NVLOG_ERROR, "pthread_setspecific: %s", strerror(s));
-			n = s;
-			goto cleanup;
-		}
+	if (rb->end == BUF_LEN-1) {
+		errno = ENOBUFS;
+		return -1;
 	}
-	ptr = vptr;
-	for (n = 1; n < maxlen; n++) {
 again:
-		if ((rc = my_read(tsd, fd, &c)) == 1) {
-			*ptr++ = c;
-			if (c == '\n')
-				break;          /* newline is stored, like fgets() */
-		} else if (rc == 0) {
-			if (n == 1)
-				return 0;       /* EOF, no data read */
-			else
-				break;          /* EOF, some data read */
-		} else {
-			if (errno == EINTR)
-				goto again;
-			return -1;          /* error, errno set by read() */
-		}
+	if ((n = read(rb->fd, rb->buf + rb->end, BUF_LEN-1 - rb->end)) < 0) {
+		if (errno == EINTR)
+			goto again;
+		return -1;      /* error, errno set by read() */
 	}
-	
-cleanup:
-	*ptr = 0;
+	rb->end += n;
 	return n;
 }
 
-static void readline_destructor(void *ptr) {
-	free(ptr);
+/* hand out the next complete line in the buffer, if there is one.  The
+ * line ending is replaced with a NUL and not counted in the length. */
+ssize_t nv_rbuf_line(struct nv_rbuf *rb, char **line) {
+	char *ptr;
+	char *eol;
+	ssize_t len;
+
+	ptr = rb->buf + rb->start;
+	eol = memchr(ptr, '\n', rb->end - rb->start);
+	if (eol == NULL)
+		return -1;
+
+	rb->start = eol - rb->buf + 1;
+	if (rb->start == rb->end)
+		rb->start = rb->end = 0;    /* empty, rewind for free */
+
+	len = eol - ptr;
+	if (len > 0 && ptr[len-1] == '\r')
+		len--;
+	ptr[len] = '\0';
+	*line = ptr;
+	return len;
 }
 
-static void readline_once(void) {
-	int s = 0;
-	s = pthread_key_create(&rl_key, readline_destructor);
-	if (s != 0) {
-		nv_log(NVLOG_ERROR, "pthread_key_create: %s", strerror(s));
+/* throw away everything in the buffer */
+void nv_rbuf_clear(struct nv_rbuf *rb) {
+	rb->start = 0;
+	rb->end = 0;
+}
+
+/* read a text line from a blocking descriptor.  Returns the length of the
+ * line, or -1 at EOF or on error.  A final line without a newline is still
+ * returned, as is the start of a line too long for the buffer. */
+ssize_t nv_readline(struct nv_rbuf *rb, char **line) {
+	ssize_t len;
+	ssize_t n;
+
+	for (;;) {
+		if ((len = nv_rbuf_line(rb, line)) >= 0)
+			return len;
+		if (nv_rbuf_full(rb))
+			break;
+		if ((n = nv_rbuf_fill(rb)) < 0)
+			return -1;
+		if (n == 0)
+			break;      /* EOF */
 	}
+
+	/* whatever is left is the whole line */
+	if (rb->start == rb->end)
+		return -1;
+	len = rb->end - rb->start;
+	*line = rb->buf + rb->start;
+	(*line)[len] = '\0';
+	rb->start = rb->end = 0;
+	return len;
 }
 
-static ssize_t my_read(rline_t *tsd, int fd, char *ptr) {
-	if (tsd->rl_cnt <= 0) {
-again:
-		if ((tsd->rl_cnt = read(fd, tsd->rl_buf, BUF_LEN)) < 0) {
-			if (errno == EINTR)
-				goto again;
+/* split a line into whitespace separated words without copying it */
+int nv_tokenize(const char *line, size_t len, struct nv_token *tok, int max) {
+	const char *ptr = line;
+	const char *end = line + len;
+	int n = 0;
+
+	for (;;) {
+		while (ptr < end && isspace((unsigned char)*ptr))
+			ptr++;
+		if (ptr == end)
+			break;
+		if (n == max)
+			return -1;  /* too many words */
+		tok[n].ptr = ptr;
+		while (ptr < end && !isspace((unsigned char)*ptr))
+			ptr++;
+		tok[n].len = ptr - tok[n].ptr;
+		n++;
+	}
+	return n;
+}
+
+/* case-insensitive comparison of a token with a word */
+int nv_token_eq(const struct nv_token *tok, const char *word) {
+	return strlen(word) == tok->len &&
+		   strncasecmp(tok->ptr, word, tok->len) == 0;
+}
+
+/* parse a token as a decimal integer, returns -1 if it isn't one */
+int nv_token_long(const struct nv_token *tok, long *val) {
+	const char *ptr = tok->ptr;
+	const char *end = tok->ptr + tok->len;
+	int neg = 0;
+	long v = 0;
+
+	if (ptr < end && (*ptr == '-' || *ptr == '+')) {
+		neg = (*ptr == '-');
+		ptr++;
+	}
+	if (ptr == end)
+		return -1;
+	for (; ptr < end; ptr++) {
+		if (*ptr < '0' || *ptr > '9')
 			return -1;
-		} else if (tsd->rl_cnt == 0)
-			return 0;
-		tsd->rl_bufptr = tsd->rl_buf;
+		v = v * 10 + (*ptr - '0');
 	}
-	tsd->rl_cnt--;
-	*ptr = *tsd->rl_bufptr++;
-	return 1;
+	*val = neg ? -v : v;
+	return 0;
 }
@@ -25,10 +25,40 @@
 #include <config.h>
 #endif
 
+#include <netvizd.h>
 #include <pthread.h>
 
+/*
+ * Buffered line input for a single descriptor.  Lines are handed out as
+ * pointers into the buffer, so they're only good until the next fill.  The
+ * last byte is kept free so a line can always be NUL-terminated in place.
+ */
+struct nv_rbuf {
+	int			fd;
+	size_t		start;      /* first byte not yet handed out */
+	size_t		end;        /* one past the last byte read */
+	char		buf[BUF_LEN];
+};
+
+/* a word within a line, not NUL-terminated */
+struct nv_token {
+	const char *	ptr;
+	size_t			len;
+};
+
+/* is the buffer full without holding a complete line? */
+#define nv_rbuf_full(rb) \
+	((rb)->start == 0 && (rb)->end == BUF_LEN-1)
+
 ssize_t readn(int filedes, void *buf, size_t nbytes);
 ssize_t writen(int filedes, const void *buf, size_t nbytes);
-ssize_t readline(int filedes, void *buf, size_t maxlen);
+void nv_rbuf_init(struct nv_rbuf *rb, int fd);
+ssize_t nv_rbuf_fill(struct nv_rbuf *rb);
+ssize_t nv_rbuf_line(struct nv_rbuf *rb, char **line);
+void nv_rbuf_clear(struct nv_rbuf *rb);
+ssize_t nv_readline(struct nv_rbuf *rb, char **line);
+int nv_tokenize(const char *line, size_t len, struct nv_token *tok, int max);
+int nv_token_eq(const struct nv_token *tok, const char *word);
+int nv_token_long(const struct nv_token *tok, long *val);
 
 #endif
@@ -68,6 +68,7 @@ int main(int argc, char *argv[]) {
 	nv_node i;
 	pthread_attr_t attr;
 	sigset_t newmask, oldmask;
+	int sig = 0;
 	int foreground = 0;
 	pid_t pid = 0;
 
@@ -132,6 +133,10 @@ int main(int argc, char *argv[]) {
 	 * a SIGPIPE to be delivered, screwing things up for us. */
     sigemptyset(&newmask);
     sigaddset(&newmask, SIGPIPE);
+	/* Also block the shutdown signals, which every thread inherits; the
+	 * main thread waits for them below so we can shut down cleanly. */
+    sigaddset(&newmask, SIGTERM);
+    sigaddset(&newmask, SIGINT);
     if (sigprocmask(SIG_BLOCK, &newmask, &oldmask) < 0) {
 		nv_perror(NVLOG_ERROR, "sigaddset()", errno);
 		stat = EXIT_FAILURE;
@@ -176,9 +181,15 @@ int main(int argc, char *argv[]) {
 		goto cleanup;
 	}
 
-	/* init storage instances */
+	/* init storage instances, each with its ingest queue */
 	list_for_each(i, &nv_stor_list) {
 		struct nv_stor *s = node_data(struct nv_stor, i);
+		if (stor_queue_init(s) != 0) {
+			nv_log(NVLOG_ERROR, "storage queue initialization failed, "
+				   "aborting");
+			stat = EXIT_FAILURE;
+			goto cleanup;
+		}
 		if (s->plug->inst_init == NULL) continue;
 		if (s->plug->inst_init(s) != 0) {
 			nv_log(NVLOG_ERROR, "storage instance initialization failed, "
@@ -188,6 +199,13 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	/* hand the data sets to their storage instances */
+	if (stor_open_series() != 0) {
+		nv_log(NVLOG_ERROR, "storage series initialization failed, aborting");
+		stat = EXIT_FAILURE;
+		goto cleanup;
+	}
+
 	/* init sensor instances */
 	list_for_each(i, &nv_sens_list) {
 		struct nv_sens *s = node_data(struct nv_sens, i);
@@ -208,7 +226,7 @@ int main(int argc, char *argv[]) {
 		int ret = 0;
 		struct nv_stor *s = node_data(struct nv_stor, i);
 
-		if (s->beat == 0 && s->beatfunc == NULL) continue;
+		if (s->beat == 0 && s->beatfunc == NULL && s->queue == NULL) continue;
 		s->thread = nv_calloc(pthread_t, 1);
 		ret = pthread_create(s->thread, &attr, stor_thread, s);
 		if (ret != 0) {
@@ -264,16 +282,39 @@ int main(int argc, char *argv[]) {
 		forked = 1;
 	}
 
-	/* wait on all the threads */
-	list_for_each(i, &nv_stor_list) {
-		struct nv_stor *s = node_data(struct nv_stor, i);
-		if (s->beat == 0 && s->beatfunc == NULL) continue;
-		pthread_join(*s->thread, NULL);
+	/* wait for a shutdown signal */
+	sigemptyset(&newmask);
+	sigaddset(&newmask, SIGTERM);
+	sigaddset(&newmask, SIGINT);
+	sigwait(&newmask, &sig);
+	nv_log(NVLOG_INFO, "caught signal %i, shutting down", sig);
+
+	/* stop the sensors, then let storage write out anything buffered;
+	 * each instance's thread is stopped and joined before it is freed */
+	list_for_each(i, &nv_sens_list) {
+		struct nv_sens *s = node_data(struct nv_sens, i);
+		s->quit = 1;
 	}
 	list_for_each(i, &nv_sens_list) {
 		struct nv_sens *s = node_data(struct nv_sens, i);
-		if (s->beat == 0 && s->beatfunc == NULL) continue;
-		pthread_join(*s->thread, NULL);
+		if (s->thread != NULL) pthread_join(*s->thread, NULL);
+		if (s->plug->inst_free == NULL) continue;
+		s->plug->inst_free(s);
+	}
+	list_for_each(i, &nv_stor_list) {
+		struct nv_stor *s = node_data(struct nv_stor, i);
+		s->quit = 1;
+	}
+	list_for_each(i, &nv_stor_list) {
+		struct nv_stor *s = node_data(struct nv_stor, i);
+		if (s->thread != NULL) pthread_join(*s->thread, NULL);
+		stor_queue_flush(s);
+		if (s->plug->inst_free == NULL) continue;
+		if (s->plug->inst_free(s) != 0) {
+			nv_log(NVLOG_ERROR, "storage instance %s failed to shut down "
+				   "cleanly", s->name);
+			stat = EXIT_FAILURE;
+		}
 	}
 
 	/* shut down */
@@ -27,6 +27,8 @@
 #include <netvizd.h>
 #include <nvconfig.h>
 #include <nvlist.h>
+#include <ctype.h>
+#include <strings.h>
 
 /* Loaded configuration plugin */
 struct nv_config_p *nv_config_p = NULL;
@@ -40,7 +42,14 @@ nv_list(nv_sens_list);
 nv_list(nv_sys_list);
 nv_list(nv_dsts_list);
 
+/* Hash index of data sets by system and data set name */
+static struct nv_dsts **nv_dsts_hash = NULL;
+static size_t nv_dsts_hash_mask = 0;
+
 static int nv_validate_conf();
+static int nv_index_conf();
+static unsigned int nv_dsts_hashfn(const char *sys, size_t slen,
+								   const char *name, size_t nlen);
 
 /*
  * Initialize our configuration, loading the plugin specified on the
@@ -107,7 +116,102 @@ int nv_validate_conf() {
 		stat = -1;
 	}
 
+	/* index the data sets for lookups */
+	if (stat == 0) stat = nv_index_conf();
+
 	return stat;
 }
 
+/*
+ * Build the lookup structures for the data sets: a hash table keyed on
+ * (system, data set) for nv_dsts_find(), and an array of data sets on each
+ * system so they can be listed without walking every data set.
+ */
+int nv_index_conf() {
+	nv_node i = NULL;
+	size_t num = 0;
+	size_t size = 0;
+
+	/* size the hash table to keep the chains short */
+	list_for_each(i, &nv_dsts_list) num++;
+	for (size = 64; size < num*2; size <<= 1);
+	nv_dsts_hash = nv_calloc(struct nv_dsts *, size);
+	nv_dsts_hash_mask = size - 1;
+
+	/* count data sets on each system */
+	list_for_each(i, &nv_dsts_list) {
+		struct nv_dsts *d = node_data(struct nv_dsts, i);
+		d->sys->num_dsets++;
+	}
+	list_for_each(i, &nv_sys_list) {
+		struct nv_sys *s = node_data(struct nv_sys, i);
+		if (s->num_dsets > 0)
+			s->dsets = nv_calloc(struct nv_dsts *, s->num_dsets);
+		s->num_dsets = 0;
+	}
+
+	/* fill them in */
+	list_for_each(i, &nv_dsts_list) {
+		struct nv_dsts *d = node_data(struct nv_dsts, i);
+		unsigned int h = 0;
+
+		d->sys->dsets[d->sys->num_dsets++] = d;
+
+		/* the first definition wins, as it always has */
+		if (nv_dsts_find(d->sys->name, strlen(d->sys->name),
+						 d->name, strlen(d->name)) != NULL) {
+			nv_log(NVLOG_WARN, "data set %s defined more than once for "
+				   "system %s", d->name, d->sys->name);
+			continue;
+		}
+		h = nv_dsts_hashfn(d->sys->name, strlen(d->sys->name),
+						   d->name, strlen(d->name));
+		d->hnext = nv_dsts_hash[h & nv_dsts_hash_mask];
+		nv_dsts_hash[h & nv_dsts_hash_mask] = d;
+	}
+
+	return 0;
+}
+
+/* FNV-1a over the lowercased system and data set names */
+unsigned int nv_dsts_hashfn(const char *sys, size_t slen,
+							const char *name, size_t nlen) {
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < slen; i++) {
+		h ^= (unsigned char)tolower((unsigned char)sys[i]);
+		h *= 16777619u;
+	}
+	h ^= '/';
+	h *= 16777619u;
+	for (i = 0; i < nlen; i++) {
+		h ^= (unsigned char)tolower((unsigned char)name[i]);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Find a data set given its system and name.  Neither string needs to be
+ * NUL-terminated.  Names are compared without regard to case.  Returns
+ * NULL if there is no such data set.
+ */
+struct nv_dsts *nv_dsts_find(const char *sys, size_t slen,
+							 const char *name, size_t nlen) {
+	struct nv_dsts *d = NULL;
+	unsigned int h = 0;
+
+	if (nv_dsts_hash == NULL) return NULL;
+
+	h = nv_dsts_hashfn(sys, slen, name, nlen);
+	for (d = nv_dsts_hash[h & nv_dsts_hash_mask]; d; d = d->hnext) {
+		if (strlen(d->name) == nlen &&
+			strncasecmp(d->name, name, nlen) == 0 &&
+			strlen(d->sys->name) == slen &&
+			strncasecmp(d->sys->name, sys, slen) == 0) break;
+	}
+	return d;
+}
+
 /* vim: set ts=4 sw=4: */
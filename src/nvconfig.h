@@ -24,6 +24,11 @@
 #include <netvizd.h>
 #include <nvlist.h>
 
+struct nv_agg;
+struct nv_ts_buf;
+struct nv_ts_block;
+struct nv_stor_q;
+
 
 /* struct for a linked list of the configuration options for a plugin
  * instance */
@@ -39,9 +44,11 @@ struct nv_stor {
 	nv_list *			dsets;
 	nv_list *			conf;
 	pthread_t *			thread;
+	int					quit;		/* set to stop the thread */
 
 	int					beat;
 	int					(*beatfunc)(struct nv_stor *);
+	struct nv_stor_q *	queue;		/* ingest queue, NULL if disabled */
 
 	void *				data;
 };
@@ -53,6 +60,7 @@ struct nv_sens {
 	nv_list *			dsets;
 	nv_list *			conf;
 	pthread_t *			thread;
+	int					quit;		/* set to stop the thread */
 
 	int					beat;
 	int					(*beatfunc)(struct nv_sens *);
@@ -64,6 +72,9 @@ struct nv_sens {
 struct nv_sys {
 	char				name[NAME_LEN];
 	char				desc[NAME_LEN];
+
+	struct nv_dsts **	dsets;		/* this system's data sets, in order */
+	int					num_dsets;
 };
 
 /* time series-based data sets */
@@ -88,6 +99,9 @@ struct nv_dsts {
 	struct nv_sens *	sens;
 	struct nv_stor *	stor;
 	struct nv_sys *		sys;
+	void *				series;		/* stor's handle, from open_series */
+
+	struct nv_dsts *	hnext;		/* next in nv_dsts_find() hash chain */
 };
 
 /* a loaded config plugin */
@@ -107,13 +121,29 @@ struct nv_stor_p {
 	int					(*inst_init)(struct nv_stor *);
 	int					(*inst_free)(struct nv_stor *);
 
-	int					(*stor_ts_data)(struct nv_stor *, char *, char *,
-										time_t, double);
-	nv_list *			(*get_ts_data)(struct nv_stor *, char *, char *,
-									   time_t, time_t, int);
-	int					(*stor_ts_utime)(struct nv_stor *, char *, char *,
-										time_t);
-	time_t				(*get_ts_utime)(struct nv_stor *, char *, char *);
+	/* required: called once for each data set (system and name) kept in
+	 * an instance, before any samples; the handle it returns is what the
+	 * data calls below are given to name the series */
+	void *				(*open_series)(struct nv_stor *, char *, char *);
+
+	int					(*stor_ts_data)(struct nv_stor *, void *, time_t,
+										double);
+	/* optional: store a run of samples for one data set at once */
+	int					(*stor_ts_data_batch)(struct nv_stor *, void *,
+											  time_t *, double *, int);
+	nv_list *			(*get_ts_data)(struct nv_stor *, void *, time_t,
+									   time_t, int);
+	int					(*stor_ts_utime)(struct nv_stor *, void *, time_t);
+	time_t				(*get_ts_utime)(struct nv_stor *, void *);
+
+	/* optional: read a range a block at a time (see stor_ts_open()), which
+	 * the buffer and aggregate reads go through too; the handle from
+	 * ts_open is passed to the other two */
+	void *				(*ts_open)(struct nv_stor *, void *, time_t, time_t,
+								   int, enum nv_ds_cf);
+	int					(*ts_next_block)(struct nv_stor *, void *,
+										 struct nv_ts_block *);
+	void				(*ts_close)(struct nv_stor *, void *);
 };
 	
 /* a loaded sensor plugin */
@@ -143,6 +173,10 @@ struct nv_auth_p {
 };
 
 
+/* look up a data set by system and data set name (case-insensitive) */
+struct nv_dsts *nv_dsts_find(const char *sys, size_t slen,
+							 const char *name, size_t nlen);
+
 #ifndef NV_GLOBAL_CONFIG
 extern struct nv_config_p *nv_config_p;
 extern nv_list nv_stor_p_list;
@@ -163,6 +163,15 @@ int stor_p_init() {
 			stat = ret;
 			continue;
 		}
+
+		/* every data set is opened before it is used; see
+		 * stor_open_series() */
+		if (p->open_series == NULL) {
+			nv_log(NVLOG_ERROR, "storage plugin %s has no open_series",
+				   p->file);
+			stat = -1;
+			continue;
+		}
 	}
 
 	return stat;
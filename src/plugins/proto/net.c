@@ -24,17 +24,110 @@
 
 #include <netvizd.h>
 #include <nvconfig.h>
+#include <nvlist.h>
+#include <io.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <netinet/in.h> 
 #include <arpa/inet.h>
 #include <pthread.h>
-#include <ctype.h>
 #include <stdio.h>
+#include <time.h>
+#include <stdint.h>
+#include <endian.h>
 #include <storage.h>
 
+#define NET_PORT		12346
+#define NET_BACKLOG		SOMAXCONN	/* listen() backlog */
+#define NET_WORKERS		4			/* number of I/O worker threads */
+#define NET_MAX_CONN	1024		/* connection limit for the plugin */
+#define NET_IDLE		300			/* seconds before idle clients are reaped */
+#define NET_EVENTS		64			/* events returned per epoll_wait() */
+#define NET_MAX_TOKENS	8			/* most words in a command line */
+#define NET_CHUNK_LEN	16384		/* size of one output buffer chunk */
+#define NET_CHUNKS		16			/* most chunks a connection may hold */
+#define NET_HIWAT		(8 * NET_CHUNK_LEN)	/* output high-water mark */
+
+/* a piece of a connection's output buffer */
+struct net_chunk {
+	int					len;
+	char				data[NET_CHUNK_LEN];
+};
+
+/* a single client connection, owned by exactly one worker */
+struct net_conn {
+	int					fd;
+	time_t				last;       /* time of last client activity */
+	nv_node				node;       /* our node in the worker's conn list */
+	struct nv_rbuf		in;         /* input buffer */
+	int					discard;    /* dropping an overlong line */
+	int					proto;      /* negotiated protocol version */
+	int					events;     /* epoll events we're waiting for */
+	int					quit;       /* close once the output drains */
+	int					error;      /* output overflowed, drop the client */
+
+	/* output buffer: a ring of chunks flushed with writev() */
+	struct net_chunk *	out[NET_CHUNKS];
+	int					out_head;   /* index of the oldest chunk */
+	int					out_num;    /* number of chunks in use */
+	int					out_off;    /* bytes of the oldest chunk sent */
+	int					out_len;    /* total bytes waiting to be sent */
+
+	/* a command paused until the client reads its output; returns
+	 * -1 on error, 0 when complete, or 1 if it has to wait again */
+	int					(*pending)(struct net_conn *);
+
+	/* FETCH state */
+	struct nv_dsts *	dset;       /* what is being read */
+	time_t				next;       /* where the rest of it starts */
+	time_t				end;
+	long				res;
+	struct nv_ts_cursor *	cur;    /* the read, NULL while paused */
+	struct nv_ts_block *	blk;    /* the block being sent */
+	int					blk_pos;    /* next entry of blk to send */
+
+	/* ENUM state */
+	nv_node				sys_pos;    /* system being listed */
+	int					dsts_pos;   /* next data set, -1 before header */
+};
+
+/* an I/O worker multiplexing a share of the client sockets */
+struct net_worker {
+	int					id;
+	int					epfd;       /* epoll instance for our sockets */
+	pthread_t *			thread;
+	pthread_mutex_t *	lock;       /* protects conns and num */
+	nv_list *			conns;      /* list of (struct net_conn *) */
+	int					num;        /* number of connections */
+};
+
+static struct net_worker net_workers[NET_WORKERS];
+static pthread_mutex_t net_conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static int net_conn_num = 0;
+
 static int net_listen();
-static void *client_thread(void *);
+static void *net_worker_thread(void *arg);
+static int net_conn_add(struct net_worker *w, int fd);
+static void net_conn_close(struct net_worker *w, struct net_conn *c);
+static void net_conn_reap(struct net_worker *w);
+static int net_conn_read(struct net_conn *c);
+static int net_conn_write(struct net_conn *c);
+static int net_conn_input(struct net_conn *c);
+static int net_conn_update(struct net_worker *w, struct net_conn *c);
+static int net_out(struct net_conn *c, const char *buf, int len);
+static int net_out_wait(struct net_conn *c);
+static int net_flush(struct net_conn *c);
+static int net_command(struct net_conn *c, char *line, int len);
+static int net_cmd_quit(struct net_conn *c, struct nv_token *arg, int n);
+static int net_cmd_fetch(struct net_conn *c, struct nv_token *arg, int n);
+static int net_cmd_enum(struct net_conn *c, struct nv_token *arg, int n);
+static int net_cmd_proto(struct net_conn *c, struct nv_token *arg, int n);
+static int net_fetch_resume(struct net_conn *c);
+static int net_enum_resume(struct net_conn *c);
+static void net_frame_send(struct net_conn *c, struct nv_ts_block *b);
 
 #define proto_init		net_LTX_proto_init
 
@@ -46,7 +139,6 @@ int proto_init(struct nv_proto_p *p) {
 	return stat;
 }
 
-#define NET_PORT	12346
 int net_listen(struct nv_proto_p *p) {
 	int stat = 0;
 	int ret = 0;
@@ -56,13 +148,36 @@ int net_listen(struct nv_proto_p *p) {
 	int c_sockfd = 0;
 	socklen_t c_len = 0;
 	struct sockaddr_in c_addr;
-	pthread_t *t = NULL;
 	pthread_attr_t attr;
-	int *fd = NULL;
+	int i = 0;
+	int next = 0;
 
 	/* init pthreads */
 	pthread_attr_init(&attr);
 
+	/* start up our I/O workers */
+	for (i = 0; i < NET_WORKERS; i++) {
+		struct net_worker *w = &net_workers[i];
+
+		w->id = i;
+		w->epfd = epoll_create(NET_EVENTS);
+		if (0 > w->epfd) {
+			nv_perror(NVLOG_ERROR, "epoll_create", errno);
+			stat = -1;
+			goto cleanup;
+		}
+		w->lock = nv_calloc(pthread_mutex_t, 1);
+		pthread_mutex_init(w->lock, NULL);
+		nv_list_new(w->conns);
+		w->thread = nv_calloc(pthread_t, 1);
+		ret = pthread_create(w->thread, &attr, net_worker_thread, w);
+		if (ret != 0) {
+			nv_perror(NVLOG_ERROR, "pthread_create", ret);
+			stat = -1;
+			goto cleanup;
+		}
+	}
+
     /* get a socket */
     sockfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (0 > sockfd) {
@@ -91,262 +206,728 @@ int net_listen(struct nv_proto_p *p) {
 		goto cleanup;
     }   
     /* set socket to listen */
-	nv_log(NVLOG_INFO, "%s: listening for connections on port %i", p->name,
-		   NET_PORT);
-    ret = listen(sockfd, 5);
+	nv_log(NVLOG_INFO, "%s: listening for connections on port %i with %i "
+		   "workers", p->name, NET_PORT, NET_WORKERS);
+    ret = listen(sockfd, NET_BACKLOG);
     if (0 > ret) {
         nv_perror(NVLOG_ERROR, "listen", errno);
         stat = -1;
 		goto cleanup;
     }
 
-    /* accept incoming connections */
+    /* accept incoming connections and hand them to the workers */
     for (;;) {
         c_len = sizeof(c_addr);
         c_sockfd = accept(sockfd, (struct sockaddr *)&c_addr, &c_len);
+		if (0 > c_sockfd) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				nv_perror(NVLOG_WARN, "accept", errno);
+				usleep(THREAD_SLEEP);
+			}
+			continue;
+		}
 
-		t = nv_calloc(pthread_t, 1);
-		fd = nv_calloc(int, 1);
-		*fd = c_sockfd;
-		ret = pthread_create(t, &attr, client_thread, (void *)fd);
-		if (ret != 0) {
-			nv_perror(NVLOG_ERROR, "pthread_create", ret);
-			stat = -1;
-			nv_free(t);
+		/* refuse clients past our connection limit */
+		nv_lock(&net_conn_lock);
+		if (net_conn_num >= NET_MAX_CONN) {
+			nv_unlock(&net_conn_lock);
+			nv_log(NVLOG_WARN, "%s: connection limit of %i reached, "
+				   "refusing client", p->name, NET_MAX_CONN);
+			close(c_sockfd);
+			continue;
 		}
+		net_conn_num++;
+		nv_unlock(&net_conn_lock);
+
+		/* round-robin the new connection to a worker */
+		if (net_conn_add(&net_workers[next], c_sockfd) != 0) {
+			nv_lock(&net_conn_lock);
+			net_conn_num--;
+			nv_unlock(&net_conn_lock);
+			close(c_sockfd);
+		}
+		next = (next + 1) % NET_WORKERS;
 	}
 
 cleanup:
+	pthread_attr_destroy(&attr);
 	return stat;
 }
 
 #define MSG_100		"100 netvizd v0.1 Copyright (c) Robert Timothy Stewart\r\n"
 #define MSG_101		"101 proto_1.0\r\n"
+#define MSG_101_2	"101 proto_2.0\r\n"
 #define MSG_102		"102 Goodbye.\r\n"
 #define MSG_103		"103 %i %f %f %f\r\n"
 #define MSG_104		"104 FETCH command complete.\r\n"
 #define MSG_105		"105 %s %s\r\n"
 #define MSG_106		"106 %s\r\n"
 #define MSG_107		"107 ENUM command complete.\r\n"
+#define MSG_108		"108 FETCH binary data follows.\r\n"
 
 #define MSG_200		"200 Invalid request.\r\n"
+#define MSG_201		"201 FETCH failed, result incomplete.\r\n"
 
 #define WORD_FETCH		"fetch"
 #define WORD_QUIT		"quit"
 #define WORD_EXIT		"exit"
 #define WORD_ENUM		"enum"
+#define WORD_PROTO		"proto"
+
+#define PROTO_1			"1.0"
+#define PROTO_2			"2.0"
 
-#define invalid_query(fd)	writen((fd), MSG_200, strlen(MSG_200))
+#define invalid_query(c)	net_out((c), MSG_200, strlen(MSG_200))
 
 /*
- * This function is AWFUL.  We need to refactor it.
+ * Register a newly accepted client socket with a worker and greet it.
  */
-void *client_thread(void *arg) {
-	int *fd = NULL;
-	int c = 0;
-	char buf[BUF_LEN];
-	char sep[] = " \t\r\n";
-	char *word = NULL;
-	char *brk = NULL;
-	int skip = 0;
-	int skipt = 0;
-	int skip_cnt = 0;
-	double tally = 0;
-	time_t midtime = 0;
-
-	/* get our file desciptor */
-	fd = (int *)arg;
+int net_conn_add(struct net_worker *w, int fd) {
+	struct net_conn *c = NULL;
+	struct epoll_event ev;
+	int stat = 0;
+	int ret = 0;
+
+	/* we never want to block on a single client */
+	ret = fcntl(fd, F_GETFL, 0);
+	if (0 > ret || 0 > fcntl(fd, F_SETFL, ret | O_NONBLOCK)) {
+		nv_perror(NVLOG_ERROR, "fcntl", errno);
+		return -1;
+	}
+
+	c = nv_calloc(struct net_conn, 1);
+	c->fd = fd;
+	c->last = time(NULL);
+	c->proto = 1;
+	nv_rbuf_init(&c->in, fd);
 
 	/* send intro msg and protocol version */
-	writen(*fd, MSG_100, strlen(MSG_100));
-	writen(*fd, MSG_101, strlen(MSG_101));
+	net_out(c, MSG_100, strlen(MSG_100));
+	net_out(c, MSG_101, strlen(MSG_101));
+	net_flush(c);
+
+	/* add to the worker's connection list before it can see any events */
+	nv_lock(w->lock);
+	nv_node_new(c->node);
+	set_node_data(c->node, c);
+	list_append(w->conns, c->node);
+	w->num++;
+	nv_unlock(w->lock);
+
+	memset(&ev, 0, sizeof(ev));
+	c->events = EPOLLIN;
+	if (c->out_len > 0) c->events |= EPOLLOUT;
+	ev.events = c->events;
+	ev.data.ptr = c;
+	ret = epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (0 > ret) {
+		nv_perror(NVLOG_ERROR, "epoll_ctl", errno);
+		nv_lock(w->lock);
+		list_del(c->node);
+		w->num--;
+		nv_unlock(w->lock);
+		for (ret = 0; ret < c->out_num; ret++) {
+			nv_free(c->out[(c->out_head + ret) % NET_CHUNKS]);
+		}
+		nv_free(c);
+		stat = -1;
+	}
 
-	/* main loop */
-	for (;;) {
-		int i = 0;
+	return stat;
+}
+
+/*
+ * Tear down a connection.  The worker lock must be held by the caller.
+ */
+static void net_conn_free(struct net_worker *w, struct net_conn *c) {
+	int i = 0;
+
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	list_del(c->node);
+	w->num--;
+
+	/* drop anything a paused command was still holding */
+	stor_ts_close(c->cur);
+	nv_free(c->blk);
+	for (i = 0; i < c->out_num; i++) {
+		nv_free(c->out[(c->out_head + i) % NET_CHUNKS]);
+	}
+	nv_free(c);
+
+	nv_lock(&net_conn_lock);
+	net_conn_num--;
+	nv_unlock(&net_conn_lock);
+}
 
-		/* read a line of input and check for disconnect */
-		c = readline(*fd, buf, BUF_LEN-1);
-		buf[BUF_LEN-1] = '\0';
-		if (c == 0) break;
+void net_conn_close(struct net_worker *w, struct net_conn *c) {
+	nv_lock(w->lock);
+	net_conn_free(w, c);
+	nv_unlock(w->lock);
+}
 
-		/* convert everything to lowercase */
-		for (i = 0; i < c; i++) {
-			buf[i] = tolower(buf[i]);
+/*
+ * Drop every connection that has been quiet for longer than NET_IDLE.
+ */
+void net_conn_reap(struct net_worker *w) {
+	nv_node i;
+	nv_node next;
+	time_t now = time(NULL);
+
+	nv_lock(w->lock);
+	for (i = w->conns->next; i != w->conns && i != NULL; i = next) {
+		struct net_conn *c = node_data(struct net_conn, i);
+
+		next = i->next;
+		if (now - c->last > NET_IDLE) {
+			nv_log(NVLOG_DEBUG, "worker %i: reaping idle client on fd %i",
+				   w->id, c->fd);
+			net_conn_free(w, c);
 		}
+	}
+	nv_unlock(w->lock);
+}
 
-		/* parse incoming request */
-		word = strtok_r(buf, sep, &brk);
-		if (word == NULL) continue;
+/*
+ * The I/O worker main loop.  Each worker waits on its own epoll set and
+ * services whichever of its clients are readable or writable.
+ */
+void *net_worker_thread(void *arg) {
+	struct net_worker *w = (struct net_worker *)arg;
+	struct epoll_event events[NET_EVENTS];
+	time_t reaped = time(NULL);
+	int n = 0;
+	int i = 0;
+	int ret = 0;
 
-		if (strncmp(word, WORD_QUIT, strlen(WORD_QUIT)) == 0 ||
-			strncmp(word, WORD_EXIT, strlen(WORD_EXIT)) == 0) {
-			/* they want to leave :( */
-			writen(*fd, MSG_102, strlen(MSG_102));
+	nv_log(NVLOG_DEBUG, "worker %i: starting", w->id);
+
+	for (;;) {
+		n = epoll_wait(w->epfd, events, NET_EVENTS, 1000);
+		if (0 > n) {
+			if (errno == EINTR) continue;
+			nv_perror(NVLOG_ERROR, "epoll_wait", errno);
 			break;
-		} else if (strncmp(word, WORD_FETCH, strlen(WORD_FETCH)) == 0) {
-			char *system = NULL;
-			char *dsname = NULL;
-			time_t start;
-			time_t end;
-			int res;
-			nv_list *result;
-			nv_node i;
-			nv_node t;
-			struct nv_dsts *dset = NULL;
-			
-			/* we have a fetch request... format:
-			 *     fetch <system> <dataset> <start> <end> <resolution> */
-			system = strtok_r(NULL, sep, &brk);
-			if (system == NULL) {
-				invalid_query(*fd);
-				continue;
-			}
-			dsname = strtok_r(NULL, sep, &brk);
-			if (dsname == NULL) {
-				invalid_query(*fd);
-				continue;
-			}
-			word = strtok_r(NULL, sep, &brk);
-			if (word == NULL) {
-				invalid_query(*fd);
-				continue;
-			}
-			start = atoi(word);
-			word = strtok_r(NULL, sep, &brk);
-			if (word == NULL) {
-				invalid_query(*fd);
-				continue;
-			}
-			end = atoi(word);
-			word = strtok_r(NULL, sep, &brk);
-			if (word == NULL) {
-				invalid_query(*fd);
-				continue;
-			}
-			res = atoi(word);
-			word = strtok_r(NULL, sep, &brk);
-			if (word != NULL) {
-				invalid_query(*fd);
-				continue;
-			}
+		}
 
-			/* find the dataset */
-			list_for_each(i, &nv_dsts_list) {
-				struct nv_dsts *d = NULL;
-				d = node_data(struct nv_dsts, i);
-				if (strcmp(d->name, dsname) == 0 &&
-					strcmp(d->sys->name, system) == 0) {
-					dset = d;
-					break;
+		for (i = 0; i < n; i++) {
+			struct net_conn *c = (struct net_conn *)events[i].data.ptr;
+
+			ret = 0;
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				ret = -1;
+			} else {
+				if (events[i].events & EPOLLOUT) ret = net_conn_write(c);
+				if (ret == 0 && (events[i].events & EPOLLIN)) {
+					ret = net_conn_read(c);
 				}
+				if (ret == 0) ret = net_conn_update(w, c);
 			}
-			if (dset == NULL) {
-				invalid_query(*fd);
-				continue;
-			}
+			if (ret != 0) net_conn_close(w, c);
+		}
 
-			/* pull the data and figure out how to achieve given
-			 * resolution */
-			result = stor_get_ts_data(dset, start, end, res);
-			if (result->next != NULL && result->next->next != result) {
-				/* OK, we have at least 2 elements */
-				int diff = 0;
-				struct nv_ts_data *d1 = NULL;
-				struct nv_ts_data *d2 = NULL;
-				
-				/* find time offset between elements in seconds */
-				d1 = node_data(struct nv_ts_data, result->next);
-				d2 = node_data(struct nv_ts_data, result->next->next);
-				diff = d2->time-d1->time;
-				
-				/* find the frequency of rows to accept (skip):
-				 *     1 = take every row
-				 *     2 = take every other row
-				 *     3 = take every third row
-				 * etc.  Note that this is an estimate - when inexact, you
-				 * will get the next highest resolution possible, given
-				 * the colleted data.  Finally, get skipt, which is half of
-				 * skip - this is the time value we pick for submission */
-				if (res*60 <= diff) skip = 1;
-				else skip = res*60/diff;
-				nv_log(NVLOG_DEBUG, "Calculated skip of %i", skip);
-				if (skip == 1) skipt = 1;
-				else if (skip == 2) skipt = 1;
-				else skipt = skip/2+1;
-			}
+		/* look for idle clients about once a second */
+		if (time(NULL) != reaped) {
+			reaped = time(NULL);
+			net_conn_reap(w);
+		}
+	}
 
-			/* send data to the client */
-			t = NULL;
-			skip_cnt = 1;
-			list_for_each(i, result) {
-				struct nv_ts_data *d = NULL;
-				d = node_data(struct nv_ts_data, i);
+	nv_log(NVLOG_DEBUG, "worker %i: stopping", w->id);
+	return (void *)NULL;
+}
 
-				/* add this value to tally */
-				tally += d->value;
+/*
+ * Wait for input only while we're able to answer it, and for writability
+ * only while output is queued.  A client that doesn't read its responses
+ * stops being read from, which is what keeps its output buffer bounded.
+ */
+int net_conn_update(struct net_worker *w, struct net_conn *c) {
+	struct epoll_event ev;
+	int events = 0;
 
-				/* do we report this time? */
-				if (skip_cnt == skipt) {
-					midtime = d->time;
-				}
-				
-				/* is it time to report? */
-				if (skip_cnt == skip) {
-					snprintf(buf, BUF_LEN, MSG_103, midtime, tally,
-							 d->min, d->max);
-					writen(*fd, buf, strlen(buf));
-					skip_cnt = 1;
-					tally = 0.0L;
-				} else {
-					skip_cnt++;
-				}
+	if (c->error) return -1;
+	if (c->pending == NULL && !c->quit && c->out_len < NET_HIWAT) {
+		events |= EPOLLIN;
+	}
+	if (c->out_len > 0) events |= EPOLLOUT;
+	if (events == c->events) return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = c;
+	if (0 > epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev)) {
+		nv_perror(NVLOG_ERROR, "epoll_ctl", errno);
+		return -1;
+	}
+	c->events = events;
+	return 0;
+}
+
+/*
+ * Pull whatever input the client has sent and run it.  Returns non-zero
+ * when the connection should be closed.
+ */
+int net_conn_read(struct net_conn *c) {
+	int ret = 0;
+
+	ret = nv_rbuf_fill(&c->in);
+	if (0 > ret) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		return -1;
+	} else if (ret == 0) {
+		/* client disconnected */
+		return -1;
+	}
+	c->last = time(NULL);
+
+	return net_conn_input(c);
+}
+
+/*
+ * The client can take more output: send it, and pick a paused command back
+ * up once we're under the high-water mark again.
+ */
+int net_conn_write(struct net_conn *c) {
+	int ret = 0;
+
+	if (0 > net_flush(c)) return -1;
+
+	if (c->pending != NULL && c->out_len < NET_HIWAT) {
+		ret = c->pending(c);
+		if (0 > ret) return -1;
+		/* the command finished, carry on with any queued input */
+		if (ret == 0) return net_conn_input(c);
+		return 0;
+	}
+
+	if (c->quit && c->out_len == 0) return -1;
+	return 0;
+}
+
+/*
+ * Run each complete line in the input buffer as a command, stopping early
+ * if a command has to wait on the client.  Lines longer than our buffer are
+ * rejected rather than grown, so memory per connection stays fixed.  Output
+ * is flushed at the end.  Returns non-zero when the connection should be
+ * closed.
+ */
+int net_conn_input(struct net_conn *c) {
+	char *line = NULL;
+	ssize_t len = 0;
+
+	/* run each complete line */
+	while (c->pending == NULL && !c->quit && c->out_len < NET_HIWAT &&
+		   (len = nv_rbuf_line(&c->in, &line)) >= 0) {
+		if (c->discard) {
+			/* tail of an overlong line */
+			c->discard = 0;
+			continue;
+		}
+		if (net_command(c, line, len) != 0) return -1;
+	}
+
+	/* reject a line that won't fit */
+	if (nv_rbuf_full(&c->in) &&
+		memchr(c->in.buf, '\n', c->in.end) == NULL) {
+		if (!c->discard) invalid_query(c);
+		c->discard = 1;
+		nv_rbuf_clear(&c->in);
+	}
+
+	/* end of command(s), send what we've got */
+	if (0 > net_flush(c)) return -1;
+	if (c->quit && c->out_len == 0) return -1;
+	return 0;
+}
+
+/*
+ * Queue output for a client.  Nothing is written until net_flush().
+ * Commands producing a lot of output are expected to check net_out_wait()
+ * as they go, so the chunk ring only overflows on a bug.
+ */
+int net_out(struct net_conn *c, const char *buf, int len) {
+	struct net_chunk *ch = NULL;
+	int n = 0;
 
-				/* clean this entry and previous node */
-				nv_free(d);
-				if (t != NULL) list_del(i->prev);
-				t = i;
+	while (len > 0) {
+		if (c->out_num > 0) {
+			ch = c->out[(c->out_head + c->out_num - 1) % NET_CHUNKS];
+		}
+		if (c->out_num == 0 || ch->len == NET_CHUNK_LEN) {
+			if (c->out_num == NET_CHUNKS) {
+				nv_log(NVLOG_ERROR, "output buffer overflow on fd %i, "
+					   "dropping client", c->fd);
+				c->error = 1;
+				return -1;
 			}
-			list_del(t);
-			nv_free(result);
-			writen(*fd, MSG_104, strlen(MSG_104));
-		} else if (strncmp(word, WORD_ENUM, strlen(WORD_ENUM)) == 0) {
-			nv_node i;
-			nv_node j;
-			struct nv_sys *sys;
-			struct nv_dsts *dsts;
-			
-			/* make sure there are no arguments */
-			word = strtok_r(NULL, sep, &brk);
-			if (word != NULL) {
-				invalid_query(*fd);
-				continue;
+			ch = nv_malloc(struct net_chunk, 1);
+			ch->len = 0;
+			c->out[(c->out_head + c->out_num) % NET_CHUNKS] = ch;
+			c->out_num++;
+		}
+
+		n = NET_CHUNK_LEN - ch->len;
+		if (n > len) n = len;
+		memcpy(ch->data + ch->len, buf, n);
+		ch->len += n;
+		c->out_len += n;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Called by long-running commands before producing more output.  Flushes
+ * once we pass the high-water mark, and returns 1 if the client still
+ * hasn't taken enough of it and the command should pause, or -1 on error.
+ */
+int net_out_wait(struct net_conn *c) {
+	if (c->out_len < NET_HIWAT) return 0;
+	if (0 > net_flush(c)) return -1;
+	return (c->out_len < NET_HIWAT) ? 0 : 1;
+}
+
+/*
+ * Write out as much of the output buffer as the socket will take, using
+ * one writev() for all queued chunks.  Returns 0 once the buffer is empty,
+ * 1 if the socket is full, or -1 on error.
+ */
+int net_flush(struct net_conn *c) {
+	struct iovec iov[NET_CHUNKS];
+	struct net_chunk *ch = NULL;
+	ssize_t ret = 0;
+	int i = 0;
+
+	while (c->out_len > 0) {
+		for (i = 0; i < c->out_num; i++) {
+			ch = c->out[(c->out_head + i) % NET_CHUNKS];
+			iov[i].iov_base = ch->data;
+			iov[i].iov_len = ch->len;
+		}
+		iov[0].iov_base = (char *)iov[0].iov_base + c->out_off;
+		iov[0].iov_len -= c->out_off;
+
+		ret = writev(c->fd, iov, c->out_num);
+		if (0 > ret) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+			return -1;
+		}
+		c->last = time(NULL);
+		c->out_len -= ret;
+
+		/* release the chunks that went out */
+		while (ret > 0) {
+			ch = c->out[c->out_head];
+			if (ret < ch->len - c->out_off) {
+				c->out_off += ret;
+				break;
 			}
-			
-			/* send each system followed by its data sets */
-			list_for_each(i, &nv_sys_list) {
-				/* write system name and description */
-				sys = node_data(struct nv_sys, i);
-				snprintf(buf, BUF_LEN, MSG_105, sys->name, sys->desc);
-				writen(*fd, buf, strlen(buf));
-
-				list_for_each(j, &nv_dsts_list) {
-					dsts = node_data(struct nv_dsts, j);
-					if (dsts->sys == sys) {
-						snprintf(buf, BUF_LEN, MSG_106, dsts->name);
-						writen(*fd, buf, strlen(buf));
-					}
+			ret -= ch->len - c->out_off;
+			nv_free(c->out[c->out_head]);
+			c->out_head = (c->out_head + 1) % NET_CHUNKS;
+			c->out_num--;
+			c->out_off = 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The commands we understand, with the number of arguments each takes.
+ * A maximum of -1 means any number of arguments is ignored.
+ */
+struct net_cmd {
+	char *				word;
+	int					min;
+	int					max;
+	int					(*func)(struct net_conn *, struct nv_token *, int);
+};
+
+static struct net_cmd net_cmds[] = {
+	{ WORD_FETCH,	5,	5,	net_cmd_fetch },
+	{ WORD_ENUM,	0,	0,	net_cmd_enum },
+	{ WORD_PROTO,	1,	1,	net_cmd_proto },
+	{ WORD_QUIT,	0,	-1,	net_cmd_quit },
+	{ WORD_EXIT,	0,	-1,	net_cmd_quit },
+	{ NULL,			0,	0,	NULL }
+};
+
+/*
+ * Run a single command line from a client.  The line is split into words
+ * in place and handed to the matching entry in net_cmds.  Commands with a
+ * lot of output leave themselves in c->pending when the client falls
+ * behind.  Returns non-zero when the connection should be dropped.
+ */
+int net_command(struct net_conn *c, char *line, int len) {
+	struct nv_token tok[NET_MAX_TOKENS];
+	struct net_cmd *cmd = NULL;
+	int n = 0;
+
+	/* parse incoming request */
+	n = nv_tokenize(line, len, tok, NET_MAX_TOKENS);
+	if (n == 0) return 0;
+	if (0 > n) {
+		invalid_query(c);
+		return 0;
+	}
+
+	for (cmd = net_cmds; cmd->word != NULL; cmd++) {
+		if (nv_token_eq(&tok[0], cmd->word)) break;
+	}
+	if (cmd->word == NULL || n-1 < cmd->min ||
+		(cmd->max >= 0 && n-1 > cmd->max)) {
+		invalid_query(c);
+		return 0;
+	}
+
+	return cmd->func(c, tok+1, n-1);
+}
+
+/*
+ * quit
+ */
+int net_cmd_quit(struct net_conn *c, struct nv_token *arg, int n) {
+	(void)arg;
+	(void)n;
+
+	/* they want to leave :( */
+	net_out(c, MSG_102, strlen(MSG_102));
+	c->quit = 1;
+	return 0;
+}
+
+/*
+ * fetch <system> <dataset> <start> <end> <resolution>
+ */
+int net_cmd_fetch(struct net_conn *c, struct nv_token *arg, int n) {
+	long start;
+	long end;
+	long res;
+	struct nv_dsts *dset = NULL;
+
+	(void)n;
+	if (0 > nv_token_long(&arg[2], &start) ||
+		0 > nv_token_long(&arg[3], &end) ||
+		0 > nv_token_long(&arg[4], &res)) {
+		invalid_query(c);
+		return 0;
+	}
+
+	/* find the dataset */
+	dset = nv_dsts_find(arg[0].ptr, arg[0].len, arg[1].ptr, arg[1].len);
+	if (dset == NULL) {
+		invalid_query(c);
+		return 0;
+	}
+
+	/* the read, consolidated to the given resolution, is opened as the
+	 * result goes out */
+	c->dset = dset;
+	c->next = start;
+	c->end = end;
+	c->res = res;
+	c->cur = NULL;
+	c->blk = nv_calloc(struct nv_ts_block, 1);
+	c->blk_pos = 0;
+
+	/* send data to the client as storage hands it to us */
+	if (c->proto == 2) net_out(c, MSG_108, strlen(MSG_108));
+	c->pending = net_fetch_resume;
+	if (0 > net_fetch_resume(c)) return -1;
+	return 0;
+}
+
+/*
+ * enum
+ */
+int net_cmd_enum(struct net_conn *c, struct nv_token *arg, int n) {
+	(void)arg;
+	(void)n;
+
+	/* send each system followed by its data sets */
+	c->sys_pos = nv_sys_list.next;
+	c->dsts_pos = -1;
+	c->pending = net_enum_resume;
+	if (0 > net_enum_resume(c)) return -1;
+	return 0;
+}
+
+/*
+ * proto <version>
+ */
+int net_cmd_proto(struct net_conn *c, struct nv_token *arg, int n) {
+	(void)n;
+	if (nv_token_eq(&arg[0], PROTO_1)) {
+		c->proto = 1;
+		net_out(c, MSG_101, strlen(MSG_101));
+	} else if (nv_token_eq(&arg[0], PROTO_2)) {
+		c->proto = 2;
+		net_out(c, MSG_101_2, strlen(MSG_101_2));
+	} else {
+		invalid_query(c);
+	}
+	return 0;
+}
+
+/*
+ * Send as much of a FETCH result as the client will currently take,
+ * reading the next block from storage only once the last one is out.  In
+ * proto_2.0 each block goes out as one frame.  The read is closed
+ * whenever we have to wait for the client, so a slow one never holds
+ * storage resources (a database connection, say); it is opened again
+ * after the last entry sent.  If storage fails part way, the response
+ * ends with 201 instead of 104, so the client knows it is short.
+ */
+int net_fetch_resume(struct net_conn *c) {
+	struct nv_ts_block *b = c->blk;
+	char out[BUF_LEN];
+	int failed = 0;
+	int ret = 0;
+
+	for (;;) {
+		if (c->blk_pos == b->num) {
+			c->blk_pos = 0;
+			b->num = 0;
+			if (c->cur == NULL) {
+				c->cur = stor_ts_open(c->dset, c->next, c->end, c->res);
+				if (c->cur == NULL) {
+					failed = 1;
+					break;
 				}
 			}
-			writen(*fd, MSG_107, strlen(MSG_107));
+			ret = stor_ts_next_block(c->cur, b);
+			if (ret <= 0) {
+				b->num = 0;
+				failed = ret < 0;
+				break;
+			}
+
+			/* the next bucket, or second, after this block */
+			c->next = b->time[b->num-1] +
+					  (c->res > 0 ? (time_t)c->res * 60 : 1);
+		}
+
+		ret = net_out_wait(c);
+		if (ret != 0) {
+			stor_ts_close(c->cur);
+			c->cur = NULL;
+			return ret;
+		}
+
+		if (c->proto == 2) {
+			net_frame_send(c, b);
+			c->blk_pos = b->num;
 		} else {
-			invalid_query(*fd);
+			snprintf(out, BUF_LEN, MSG_103, (int)b->time[c->blk_pos],
+					 b->value[c->blk_pos], b->min[c->blk_pos],
+					 b->max[c->blk_pos]);
+			net_out(c, out, strlen(out));
+			c->blk_pos++;
 		}
 	}
 
-	close(*fd);
-	nv_free(arg);
+	/* the empty frame ends a proto_2.0 response; then say whether the
+	 * result is all there */
+	b->num = 0;
+	if (c->proto == 2) net_frame_send(c, b);
+	stor_ts_close(c->cur);
+	c->cur = NULL;
+	nv_free(c->blk);
+	if (failed) {
+		net_out(c, MSG_201, strlen(MSG_201));
+	} else {
+		net_out(c, MSG_104, strlen(MSG_104));
+	}
+	c->pending = NULL;
+	return 0;
+}
 
-	return (void *)NULL;
+/*
+ * Send as much of the ENUM listing as the client will currently take.
+ */
+int net_enum_resume(struct net_conn *c) {
+	struct nv_sys *sys;
+	struct nv_dsts *dsts;
+	char out[BUF_LEN];
+	int ret = 0;
+
+	for (; c->sys_pos != &nv_sys_list && c->sys_pos != NULL;
+		 c->sys_pos = c->sys_pos->next) {
+		sys = node_data(struct nv_sys, c->sys_pos);
+
+		/* write system name and description */
+		if (c->dsts_pos < 0) {
+			ret = net_out_wait(c);
+			if (ret != 0) return ret;
+			snprintf(out, BUF_LEN, MSG_105, sys->name, sys->desc);
+			net_out(c, out, strlen(out));
+			c->dsts_pos = 0;
+		}
+
+		for (; c->dsts_pos < sys->num_dsets; c->dsts_pos++) {
+			dsts = sys->dsets[c->dsts_pos];
+			ret = net_out_wait(c);
+			if (ret != 0) return ret;
+			snprintf(out, BUF_LEN, MSG_106, dsts->name);
+			net_out(c, out, strlen(out));
+		}
+		c->dsts_pos = -1;
+	}
+
+	net_out(c, MSG_107, strlen(MSG_107));
+	c->pending = NULL;
+	return 0;
+}
+
+/*
+ * Send a block as a proto_2.0 FETCH frame.  On the wire this is a 32-bit
+ * sample count followed by that many 64-bit timestamps, then the values,
+ * minimums and maximums as IEEE doubles, all in network byte order.  A
+ * frame with a count of zero ends the response.
+ */
+static void net_frame_send(struct net_conn *c, struct nv_ts_block *b) {
+	char *buf = NULL;
+	char *ptr = NULL;
+	uint32_t num = 0;
+	uint64_t v = 0;
+	int len = 0;
+	int i = 0;
+
+	len = sizeof(num) + b->num * (sizeof(int64_t) + 3 * sizeof(double));
+	buf = nv_malloc(char, len);
+	ptr = buf;
+
+	num = htobe32(b->num);
+	memcpy(ptr, &num, sizeof(num));
+	ptr += sizeof(num);
+	for (i = 0; i < b->num; i++, ptr += sizeof(v)) {
+		v = htobe64((uint64_t)b->time[i]);
+		memcpy(ptr, &v, sizeof(v));
+	}
+	for (i = 0; i < b->num; i++, ptr += sizeof(v)) {
+		memcpy(&v, &b->value[i], sizeof(v));
+		v = htobe64(v);
+		memcpy(ptr, &v, sizeof(v));
+	}
+	for (i = 0; i < b->num; i++, ptr += sizeof(v)) {
+		memcpy(&v, &b->min[i], sizeof(v));
+		v = htobe64(v);
+		memcpy(ptr, &v, sizeof(v));
+	}
+	for (i = 0; i < b->num; i++, ptr += sizeof(v)) {
+		memcpy(&v, &b->max[i], sizeof(v));
+		v = htobe64(v);
+		memcpy(ptr, &v, sizeof(v));
+	}
+
+	net_out(c, buf, len);
+	nv_free(buf);
 }
 
+/* vim: set ts=4 sw=4: */
@@ -25,6 +25,8 @@
 #include <netvizd.h>
 #include <nvconfig.h>
 #include <io.h>
+#include <sensor.h>
+#include <storage.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -116,8 +118,10 @@ int rrd_beatfunc(struct nv_sens *s) {
 	nv_node n;
 	time_t rrd_time = 0;
 	FILE *rrdout = NULL;
-	int fd = 0;
+	struct nv_rbuf rb;
+	struct nv_ts_batch b;
 	char buf[BUF_LEN];
+	char *line = NULL;
 	struct rrd_data *me = NULL;
 	ssize_t c = 0;
 	char *word = NULL;
@@ -152,22 +156,22 @@ int rrd_beatfunc(struct nv_sens *s) {
 					 me->rrdtool, me->file, ds_time, rrd_time);
 			nv_log(NVLOG_DEBUG, "%s: running cmd: %s", s->name, buf);
 			rrdout = popen(buf, "r");
-			fd = fileno(rrdout);
+			nv_rbuf_init(&rb, fileno(rrdout));
+			sens_batch_init(&b, d, SENS_BATCH);
 
 			/* read each line and add to storage */
 			for (;;) {
 nextline:
 				/* read line */
-				c = readline(fd, buf, BUF_LEN-1);
-				buf[BUF_LEN-1] = '\0';
-				if (0 == c) break;
+				c = nv_readline(&rb, &line);
+				if (0 > c) break;
 				row++;
 				/* skip first line */
 				if (row < 3) goto nextline;
 
 				/* parse line into time and find our column */
 				col = -1;
-				for (word = strtok_r(buf, sep, &brk); word;
+				for (word = strtok_r(line, sep, &brk); word;
 					 word = strtok_r(NULL, sep, &brk)) {
 					if (col == -1) {
 						/* time */
@@ -178,7 +182,7 @@ nextline:
 						value = atof(word);
 						nv_log(NVLOG_DEBUG, "%s: adding time %i with value %f",
 							   s->name, vtime, value);
-						stor_submit_ts_data(d, vtime, value);
+						sens_batch_add(&b, vtime, value);
 						valid_vtime = vtime;
 						break;
 					}
@@ -186,14 +190,21 @@ nextline:
 				}
 			}
 			pclose(rrdout);
+			if (0 > sens_batch_flush(&b)) {
+				/* leave the updated time where it is, so the same range
+				 * is fetched and submitted again next time */
+				nv_log(NVLOG_ERROR, "%s: storage refused samples for %s, "
+					   "will retry", s->name, d->name);
+				valid_vtime = 0;
+			}
+			sens_batch_free(&b);
 		}
 
 		/* Store new updated time for data set, but only if it's larger than
 		 * the previous updated time (this covers the case where we get no
-		 * output from rrdtool).
-		 * TODO (Is this still the case??) This currently will cause the above
-		 * code to attempt to re-add the last value added during this run when
-		 * it is run next. */
+		 * output from rrdtool).  The last value added during this run will
+		 * be submitted again next time; storage skips samples it already
+		 * has. */
 		if (valid_vtime > ds_time) stor_submit_ts_utime(d, valid_vtime);
 	}
 	
@@ -0,0 +1,1048 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by Robert Timothy Stewart                          *
+ *   tims@cc.gatech.edu                                                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <storage.h>
+#include <aggregate.h>
+#include "col.h"
+#include "col_seg.h"
+
+#define storage_init	col_LTX_storage_init
+
+static int col_free(struct nv_stor_p *p);
+static int col_inst_init(struct nv_stor *s);
+static int col_inst_free(struct nv_stor *s);
+static void *col_open_series(struct nv_stor *s, char *dset, char *sys);
+static int col_stor_ts_data(struct nv_stor *s, void *series, time_t time,
+							double value);
+static int col_stor_ts_batch(struct nv_stor *s, void *series, time_t *time,
+							 double *value, int num);
+static nv_list *col_get_ts_data(struct nv_stor *s, void *series,
+								time_t start, time_t end, int res);
+static void *col_ts_open(struct nv_stor *s, void *series, time_t start,
+						 time_t end, int res, enum nv_ds_cf cf);
+static int col_ts_next_block(struct nv_stor *s, void *h,
+							 struct nv_ts_block *b);
+static void col_ts_close(struct nv_stor *s, void *h);
+static int col_stor_ts_utime(struct nv_stor *s, void *series, time_t time);
+static time_t col_get_ts_utime(struct nv_stor *s, void *series);
+
+static int col_beat(struct nv_stor *s);
+static int col_catalog_load(struct nv_stor *s);
+static int col_utime_load(struct nv_stor *s);
+static int col_utime_save(struct nv_stor *s);
+static int col_tail_load(struct nv_stor *s);
+static int col_tail_write(struct nv_stor *s);
+static size_t col_tail_rec(struct col_series *e, int from, char **buf,
+						   size_t *size);
+static struct col_series *col_series_add(struct col_data *me,
+										 const char *sys, const char *dset,
+										 unsigned int h);
+static struct col_series *col_series_find(struct col_data *me,
+										  const char *sys, const char *dset,
+										  unsigned int *h);
+static unsigned int col_series_hash(const char *sys, const char *dset);
+static struct col_series *col_series_get(struct col_data *me, int id);
+
+/* the start of the bucket 't' falls in */
+#define col_floor(t, step)	((t) - ((((t) % (step)) + (step)) % (step)))
+
+int storage_init(struct nv_stor_p *p) {
+	int stat = 0;
+
+	/* fill in config structure */
+	p->free = col_free;
+	p->inst_init = col_inst_init;
+	p->inst_free = col_inst_free;
+	p->open_series = col_open_series;
+	p->stor_ts_data = col_stor_ts_data;
+	p->stor_ts_data_batch = col_stor_ts_batch;
+	p->get_ts_data = col_get_ts_data;
+	p->ts_open = col_ts_open;
+	p->ts_next_block = col_ts_next_block;
+	p->ts_close = col_ts_close;
+	p->stor_ts_utime = col_stor_ts_utime;
+	p->get_ts_utime = col_get_ts_utime;
+
+	return stat;
+}
+
+static int col_free(struct nv_stor_p *p) {
+	(void)p;
+	return 0;
+}
+
+static int col_inst_init(struct nv_stor *s) {
+	nv_node i;
+	struct col_data *me = NULL;
+	unsigned long blocks = 0;
+	int seg_size = 0;
+	int stat = 0;
+	int n;
+
+	/* process configuration */
+	me = nv_calloc(struct col_data, 1);
+	me->tail_fd = -1;
+	s->data = (void *)me;
+	list_for_each(i, s->conf) {
+		struct nv_conf *c = node_data(struct nv_conf, i);
+
+		if (strncmp(c->key, "dir", NAME_LEN) == 0) {
+			me->dir = c->value;
+		} else if (strncmp(c->key, "segment_size", NAME_LEN) == 0) {
+			seg_size = atoi(c->value);
+		} else if (strncmp(c->key, "flush_interval", NAME_LEN) == 0) {
+			me->interval = atoi(c->value);
+		} else {
+			nv_log(NVLOG_ERROR, "unknown key \"%s\" with value \"%s\"",
+				   c->key, c->value);
+			stat = -1;
+			goto cleanup;
+		}
+	}
+
+	/* check for missing information */
+	if (me->dir == NULL) {
+		stat = -1;
+		nv_log(NVLOG_ERROR, "dir not specified for col plugin instance %s",
+			   s->name);
+		goto cleanup;
+	}
+	if (seg_size <= 0) {
+		seg_size = COL_SEG_SIZE;
+	}
+	me->seg_size = (size_t)seg_size * 1024 * 1024;
+	if (me->interval <= 0) {
+		me->interval = COL_FLUSH;
+	}
+
+	me->series = nv_calloc(struct col_series *, COL_SERIES_HASH);
+	me->slock = nv_calloc(pthread_mutex_t, 1);
+	me->flock = nv_calloc(pthread_mutex_t, 1);
+	pthread_mutex_init(me->slock, NULL);
+	pthread_mutex_init(me->flock, NULL);
+
+	/* find the series we already have, and index their blocks */
+	if (mkdir(me->dir, 0755) != 0 && errno != EEXIST) {
+		nv_perror(NVLOG_ERROR, me->dir, errno);
+		stat = -1;
+		goto cleanup;
+	}
+	if (0 > col_catalog_load(s) || 0 > col_utime_load(s) ||
+		0 > col_tail_load(s)) {
+		stat = -1;
+		goto cleanup;
+	}
+	for (n = 0; n < me->num; n++) blocks += me->byid[n]->nidx;
+	nv_log(NVLOG_INFO, "%s: %i series, %lu blocks in %s", s->name, me->num,
+		   blocks, me->dir);
+
+	/* samples short of a block go to the tail log, and update times to
+	 * disk, from the heartbeat */
+	s->beat = me->interval;
+	s->beatfunc = col_beat;
+
+cleanup:
+	return stat;
+}
+
+/* log what is left in memory and close every series */
+static int col_inst_free(struct nv_stor *s) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_series *e = NULL;
+	unsigned long written = 0;
+	unsigned long blocks = 0;
+	unsigned long skipped = 0;
+	unsigned long failed = 0;
+	int stat = 0;
+	int n;
+
+	/* no new samples or reads start once quit is set; let the reads
+	 * decoding a block finish before its segment goes away */
+	nv_lock(me->flock);
+	me->quit = 1;
+	if (0 > col_tail_write(s)) {
+		nv_log(NVLOG_ERROR, "%s: samples short of a block were lost",
+			   s->name);
+		stat = -1;
+	}
+	if (0 > col_utime_save(s)) stat = -1;
+	for (n = 0; n < me->num; n++) {
+		e = me->byid[n];
+		nv_lock(&e->lock);
+		while (e->readers > 0) {
+			nv_wait(&e->idle, &e->lock);
+		}
+		col_seg_close(s, e);
+		written += e->written;
+		blocks += e->blocks;
+		skipped += e->skipped;
+		failed += e->failed;
+		nv_unlock(&e->lock);
+	}
+	if (me->tail_fd >= 0) close(me->tail_fd);
+	me->tail_fd = -1;
+	nv_unlock(me->flock);
+
+	nv_log(NVLOG_INFO, "%s: %lu samples written in %lu blocks, %lu failed, "
+		   "%lu duplicates skipped", s->name, written, blocks, failed,
+		   skipped);
+	return stat;
+}
+
+/*
+ * Blocks that filled since the last beat are already in their segments;
+ * push them toward the disk, log the samples still short of a block,
+ * then save the update times.
+ */
+static int col_beat(struct nv_stor *s) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_series *e = NULL;
+	int n;
+
+	nv_lock(me->flock);
+	if (!me->quit) {
+		for (n = 0; (e = col_series_get(me, n)) != NULL; n++) {
+			nv_lock(&e->lock);
+			col_seg_sync(e, MS_ASYNC);
+			nv_unlock(&e->lock);
+		}
+		if (0 > col_tail_write(s)) {
+			nv_log(NVLOG_WARN, "%s: samples short of a block are only in "
+				   "memory", s->name);
+		}
+		col_utime_save(s);
+	}
+	nv_unlock(me->flock);
+	return 0;
+}
+
+/*
+ * Find or add a series.  A new one goes in the catalog at once; its
+ * segments come when it has a block to write.
+ */
+static void *col_open_series(struct nv_stor *s, char *dset, char *sys) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_series *e = NULL;
+	char path[BUF_LEN];
+	unsigned int h = 0;
+	FILE *f = NULL;
+
+	if (strpbrk(sys, "\t\n") != NULL || strpbrk(dset, "\t\n") != NULL) {
+		nv_log(NVLOG_ERROR, "%s: cannot store %s/%s, tab or newline in name",
+			   s->name, sys, dset);
+		return NULL;
+	}
+
+	nv_lock(me->slock);
+	e = col_series_find(me, sys, dset, &h);
+	if (e == NULL) {
+		snprintf(path, sizeof(path), "%s/series", me->dir);
+		f = fopen(path, "a");
+		if (f == NULL) {
+			nv_perror(NVLOG_ERROR, path, errno);
+		} else if (0 > fprintf(f, "%i\t%s\t%s\n", me->num, sys, dset) ||
+				   fclose(f) != 0) {
+			nv_perror(NVLOG_ERROR, path, errno);
+		} else {
+			e = col_series_add(me, sys, dset, h);
+		}
+	}
+	nv_unlock(me->slock);
+	return e;
+}
+
+
+/* a single sample is a batch of one */
+static int col_stor_ts_data(struct nv_stor *s, void *series, time_t time,
+							double value) {
+	return col_stor_ts_batch(s, series, &time, &value, 1);
+}
+
+/*
+ * Add samples for one series to the block being filled, writing it out
+ * whenever it is full.  Samples no newer than the last one taken are
+ * dropped as duplicates: a series only ever grows at the end.  Returns
+ * -1 if samples had to be dropped because a block could not be written.
+ */
+static int col_stor_ts_batch(struct nv_stor *s, void *series, time_t *time,
+							 double *value, int num) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_series *e = (struct col_series *)series;
+	int stat = 0;
+	int i;
+
+	nv_lock(&e->lock);
+	if (me->quit) {
+		nv_unlock(&e->lock);
+		return -1;
+	}
+	for (i = 0; i < num; i++) {
+		if (time[i] <= e->last) {
+			e->skipped++;
+			continue;
+		}
+		if (e->bnum == COL_BLOCK && 0 > col_seg_write(s, e)) {
+			e->failed += num - i;
+			stat = -1;
+			break;
+		}
+		if (e->bnum == e->bsize) {
+			e->bsize = e->bsize ? 2 * e->bsize : 16;
+			e->btime = nv_realloc(time_t, e->btime, e->bsize);
+			e->bvalue = nv_realloc(double, e->bvalue, e->bsize);
+		}
+		e->btime[e->bnum] = time[i];
+		e->bvalue[e->bnum] = value[i];
+		e->bnum++;
+		e->last = time[i];
+	}
+	nv_unlock(&e->lock);
+
+	return stat;
+}
+
+
+/*
+ * A range read, for a cursor or a list.  It walks the series a block at
+ * a time, remembering only the newest time it has handed out, so blocks
+ * written while it runs are picked up where they belong.
+ */
+struct col_cursor {
+	struct col_series *		e;
+	time_t					end;
+	time_t					after;  /* newest sample handed out */
+	int						done;
+	int						agg;    /* hand out buckets, not samples */
+	enum nv_ds_cf			cf;
+	struct nv_agg			a;      /* buckets not handed out yet */
+	int						apos;   /* next of them */
+
+	/* the current chunk: samples, or a whole block's summary */
+	const struct col_block *sum;    /* NULL, or &head */
+	struct col_block		head;   /* copied, the block may be unmapped */
+	time_t					t[COL_BLOCK];
+	double					v[COL_BLOCK];
+	int						n;
+	int						pos;
+};
+
+static struct col_cursor *col_cursor_new(void *series, time_t start,
+										 time_t end) {
+	struct col_cursor *cur = nv_calloc(struct col_cursor, 1);
+
+	cur->e = (struct col_series *)series;
+	cur->end = end;
+	cur->after = start - 1;
+	return cur;
+}
+
+static int col_chunk_block(struct nv_stor *s, struct col_cursor *cur,
+						   const struct col_block *b, time_t step);
+
+/*
+ * Get the next chunk of the range: the samples of the next block in it,
+ * or the ones still in memory.  Given a bucket width 'step', a block
+ * that lies inside the range and inside one bucket comes back as its
+ * summary instead of being decoded.  Only the index is read under the
+ * lock; the block itself is read after, counted in the series' readers
+ * so that shutdown does not unmap it underneath us.  Returns 1 for a
+ * chunk, 0 at the end, or -1.
+ */
+static int col_chunk(struct nv_stor *s, struct col_cursor *cur,
+					 time_t step) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_series *e = cur->e;
+	const struct col_block *b = NULL;
+	int ret = 0;
+	int i, k;
+
+	cur->sum = NULL;
+	cur->n = 0;
+	cur->pos = 0;
+	while (!cur->done && cur->n == 0) {
+		nv_lock(&e->lock);
+		if (me->quit) {
+			nv_unlock(&e->lock);
+			return -1;
+		}
+		i = col_seg_find(e, cur->after);
+		if (i < e->nidx) {
+			b = e->idx[i].b;
+			e->readers++;
+		} else {
+			/* the rest of the range has not made it to a block yet */
+			b = NULL;
+			for (k = 0; k < e->bnum && e->btime[k] <= cur->end; k++) {
+				if (e->btime[k] <= cur->after) continue;
+				cur->t[cur->n] = e->btime[k];
+				cur->v[cur->n] = e->bvalue[k];
+				cur->n++;
+			}
+			cur->done = 1;
+		}
+		nv_unlock(&e->lock);
+		if (b == NULL) break;
+
+		ret = col_chunk_block(s, cur, b, step);
+		nv_lock(&e->lock);
+		if (--e->readers == 0) {
+			nv_broadcast(&e->idle);
+		}
+		nv_unlock(&e->lock);
+		if (ret != 0) return ret;
+	}
+	return cur->n > 0;
+}
+
+/*
+ * The part of col_chunk() that reads block 'b': decode the samples in
+ * the range, or copy its summary.  Returns 1 for a summary, -1 for a
+ * corrupt block, or 0.
+ */
+static int col_chunk_block(struct nv_stor *s, struct col_cursor *cur,
+						   const struct col_block *b, time_t step) {
+	int i, k, n;
+
+	if (b->first > cur->end) {
+		cur->done = 1;
+		return 0;
+	}
+	if (step > 0 && b->first > cur->after && b->last <= cur->end &&
+		col_floor(b->first, step) == col_floor(b->last, step)) {
+		memcpy(&cur->head, b, sizeof(cur->head));
+		cur->sum = &cur->head;
+		cur->after = b->last;
+		return 1;
+	}
+
+	n = col_block_decode(b, cur->t, cur->v);
+	if (n < 0) {
+		nv_log(NVLOG_ERROR, "%s: corrupt block in %s/%s", s->name,
+			   cur->e->sys, cur->e->dset);
+		cur->done = 1;
+		return -1;
+	}
+	for (i = 0, k = 0; i < n && cur->t[i] <= cur->end; i++) {
+		if (cur->t[i] <= cur->after) continue;
+		cur->t[k] = cur->t[i];
+		cur->v[k] = cur->v[i];
+		k++;
+	}
+	cur->n = k;
+	cur->after = b->last;
+	if (b->last >= cur->end) cur->done = 1;
+	return 0;
+}
+
+/* fold a chunk into 'a' */
+static void col_chunk_agg(struct col_cursor *cur, struct nv_agg *a) {
+	const struct col_block *b = cur->sum;
+
+	if (b != NULL) {
+		nv_agg_merge(a, col_floor((time_t)b->first, a->step), b->count,
+					 b->total, b->min, b->max, b->lval, (time_t)b->ltime);
+	} else {
+		nv_agg_add(a, cur->t, cur->v, cur->n);
+	}
+}
+
+/*
+ * The list form of a read, for callers that want one: what a cursor at
+ * resolution 'res' hands out, each bucket averaged.
+ */
+static nv_list *col_get_ts_data(struct nv_stor *s, void *series,
+								time_t start, time_t end, int res) {
+	struct nv_ts_block *b = NULL;
+	nv_list *list = NULL;
+	void *h = NULL;
+	int i;
+
+	nv_list_new(list);
+	b = nv_calloc(struct nv_ts_block, 1);
+	h = col_ts_open(s, series, start, end, res, ds_cf_average);
+	while (col_ts_next_block(s, h, b) > 0) {
+		for (i = 0; i < b->num; i++) {
+			nv_node n;
+			struct nv_ts_data *d = nv_calloc(struct nv_ts_data, 1);
+
+			d->time = b->time[i];
+			d->value = b->value[i];
+			d->min = b->min[i];
+			d->max = b->max[i];
+			nv_node_new(n);
+			set_node_data(n, d);
+			list_append(list, n);
+		}
+	}
+	col_ts_close(s, h);
+	nv_free(b);
+	return list;
+}
+
+static void *col_ts_open(struct nv_stor *s, void *series, time_t start,
+						 time_t end, int res, enum nv_ds_cf cf) {
+	struct col_cursor *cur = NULL;
+
+	(void)s;
+	cur = col_cursor_new(series, start, end);
+	cur->agg = res > 0;
+	cur->cf = cf;
+	nv_agg_init(&cur->a, res);
+	return cur;
+}
+
+/*
+ * Fill a block from the cursor.  Buckets go out once a later chunk has
+ * moved past them; the last one waits, since the next chunk may add to
+ * it.  Unknown values are left out, as in aggregate.c.
+ */
+static int col_ts_next_block(struct nv_stor *s, void *h,
+							 struct nv_ts_block *b) {
+	struct col_cursor *cur = (struct col_cursor *)h;
+	struct nv_agg *a = &cur->a;
+	int ret = 0;
+	int last;
+	double v;
+
+	b->num = 0;
+	while (b->num < NV_TS_BLOCK) {
+		if (cur->agg) {
+			if (cur->apos < a->num - (cur->done ? 0 : 1)) {
+				b->time[b->num] = a->time[cur->apos];
+				b->value[b->num] = nv_agg_value(a, cur->apos, cur->cf);
+				b->min[b->num] = a->min[cur->apos];
+				b->max[b->num] = a->max[cur->apos];
+				b->num++;
+				cur->apos++;
+				continue;
+			}
+			if (cur->done) break;
+
+			/* only the open bucket is left: keep it, then read on */
+			if (a->num > 0) {
+				last = a->num - 1;
+				a->time[0] = a->time[last];
+				a->count[0] = a->count[last];
+				a->sum[0] = a->sum[last];
+				a->min[0] = a->min[last];
+				a->max[0] = a->max[last];
+				a->last[0] = a->last[last];
+				a->ltime[0] = a->ltime[last];
+				a->num = 1;
+			}
+			cur->apos = 0;
+			ret = col_chunk(s, cur, a->step);
+			if (ret < 0) return -1;
+			if (ret > 0) col_chunk_agg(cur, a);
+		} else {
+			if (cur->pos == cur->n) {
+				if (cur->done) break;
+				if (0 > col_chunk(s, cur, 0)) return -1;
+				continue;
+			}
+			v = cur->v[cur->pos];
+			if (!isnan(v)) {
+				b->time[b->num] = cur->t[cur->pos];
+				b->value[b->num] = v;
+				b->min[b->num] = v;
+				b->max[b->num] = v;
+				b->num++;
+			}
+			cur->pos++;
+		}
+	}
+	return b->num;
+}
+
+static void col_ts_close(struct nv_stor *s, void *h) {
+	struct col_cursor *cur = (struct col_cursor *)h;
+
+	(void)s;
+	nv_agg_free(&cur->a);
+	nv_free(cur);
+}
+
+
+/*
+ * Update times are kept in memory and written to the utimes file from
+ * the heartbeat (see col_utime_save()).
+ */
+static int col_stor_ts_utime(struct nv_stor *s, void *series, time_t time) {
+	struct col_series *e = (struct col_series *)series;
+
+	(void)s;
+	nv_lock(&e->lock);
+	e->utime = time;
+	nv_unlock(&e->lock);
+	return 0;
+}
+
+static time_t col_get_ts_utime(struct nv_stor *s, void *series) {
+	struct col_series *e = (struct col_series *)series;
+	time_t utime;
+
+	(void)s;
+	nv_lock(&e->lock);
+	utime = e->utime;
+	nv_unlock(&e->lock);
+	return utime;
+}
+
+
+/*
+ * Read the catalog and load every series in it.  Ids are handed out in
+ * order, so they are also line numbers.  A last line cut short by a
+ * crash is cut off, so the next series goes on a line of its own.
+ */
+static int col_catalog_load(struct nv_stor *s) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_series *e = NULL;
+	char line[2 * NAME_LEN + 32];
+	char path[BUF_LEN];
+	char *sys = NULL;
+	char *dset = NULL;
+	char *nl = NULL;
+	unsigned int h = 0;
+	long good = 0;
+	FILE *f = NULL;
+	int stat = 0;
+	int id;
+
+	snprintf(path, sizeof(path), "%s/series", me->dir);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		if (errno == ENOENT) return 0;
+		nv_perror(NVLOG_ERROR, path, errno);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		nl = strchr(line, '\n');
+		id = (int)strtol(line, &sys, 10);
+		dset = *sys == '\t' ? strchr(sys + 1, '\t') : NULL;
+		if (nl == NULL || dset == NULL || id != me->num) {
+			nv_log(NVLOG_WARN, "%s: bad line %i of %s, dropping the rest",
+				   s->name, me->num + 1, path);
+			if (truncate(path, good) != 0) {
+				nv_perror(NVLOG_ERROR, path, errno);
+				stat = -1;
+			}
+			break;
+		}
+		*nl = '\0';
+		*dset++ = '\0';
+		sys++;
+
+		e = col_series_find(me, sys, dset, &h);
+		if (e == NULL) e = col_series_add(me, sys, dset, h);
+		if (0 > col_seg_load(s, e)) {
+			stat = -1;
+			break;
+		}
+		good = ftell(f);
+	}
+	fclose(f);
+	return stat;
+}
+
+/* read the update times saved by col_utime_save() */
+static int col_utime_load(struct nv_stor *s) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_series *e = NULL;
+	char path[BUF_LEN];
+	long long utime = 0;
+	FILE *f = NULL;
+	int id = 0;
+
+	snprintf(path, sizeof(path), "%s/utimes", me->dir);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		if (errno == ENOENT) return 0;
+		nv_perror(NVLOG_ERROR, path, errno);
+		return -1;
+	}
+	while (fscanf(f, "%i\t%lli\n", &id, &utime) == 2) {
+		e = col_series_get(me, id);
+		if (e == NULL) continue;
+		e->utime = (time_t)utime;
+		e->saved = e->utime;
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Rewrite the update times, if any changed, by way of a temporary file.
+ * While a series has samples in memory we save no later than its newest
+ * one on disk: after a crash its sensor starts again from there, and
+ * sends again what was lost.
+ */
+static int col_utime_save(struct nv_stor *s) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_series *e = NULL;
+	char path[BUF_LEN];
+	char tmp[BUF_LEN];
+	time_t *utime = NULL;
+	FILE *f = NULL;
+	int changed = 0;
+	int stat = 0;
+	int num = 0;
+	int n;
+
+	nv_lock(me->slock);
+	num = me->num;
+	nv_unlock(me->slock);
+	if (num == 0) return 0;
+
+	utime = nv_calloc(time_t, num);
+	for (n = 0; n < num; n++) {
+		e = col_series_get(me, n);
+		nv_lock(&e->lock);
+		utime[n] = e->utime;
+		if (e->bnum > 0 && e->durable < utime[n]) utime[n] = e->durable;
+		if (utime[n] != e->saved) changed = 1;
+		nv_unlock(&e->lock);
+	}
+	if (!changed) goto cleanup;
+
+	snprintf(path, sizeof(path), "%s/utimes", me->dir);
+	snprintf(tmp, sizeof(tmp), "%s/utimes.tmp", me->dir);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		nv_perror(NVLOG_ERROR, tmp, errno);
+		stat = -1;
+		goto cleanup;
+	}
+	for (n = 0; n < num; n++) {
+		if (utime[n] != 0) fprintf(f, "%i\t%lli\n", n, (long long)utime[n]);
+	}
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+		nv_perror(NVLOG_ERROR, tmp, errno);
+		fclose(f);
+		stat = -1;
+		goto cleanup;
+	}
+	fclose(f);
+	if (rename(tmp, path) != 0) {
+		nv_perror(NVLOG_ERROR, path, errno);
+		stat = -1;
+		goto cleanup;
+	}
+
+	for (n = 0; n < num; n++) {
+		e = col_series_get(me, n);
+		nv_lock(&e->lock);
+		e->saved = utime[n];
+		nv_unlock(&e->lock);
+	}
+
+cleanup:
+	nv_free(utime);
+	return stat;
+}
+
+
+/*
+ * Read the tail log back into memory, through col_stor_ts_batch(), so
+ * samples already in a block are skipped and full blocks are written.
+ * A record cut short or garbled by a crash ends the log.  The log is
+ * then rewritten with just what is left in memory.
+ */
+static int col_tail_load(struct nv_stor *s) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_tail_rec *r = NULL;
+	struct col_series *e = NULL;
+	unsigned long skipped = 0;
+	unsigned long got = 0;
+	char path[BUF_LEN];
+	struct stat st;
+	time_t *time = NULL;
+	int64_t *t = NULL;
+	char *buf = NULL;
+	size_t head = offsetof(struct col_tail_rec, id);
+	size_t len = 0;
+	size_t off = 0;
+	ssize_t ret = 0;
+	int fd = -1;
+	int stat = 0;
+	uint32_t i;
+
+	snprintf(path, sizeof(path), "%s/tail", me->dir);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+		nv_perror(NVLOG_ERROR, path, errno);
+		return -1;
+	}
+	if (fstat(fd, &st) != 0) {
+		nv_perror(NVLOG_ERROR, path, errno);
+		stat = -1;
+		goto cleanup;
+	}
+	len = (size_t)st.st_size;
+	buf = nv_malloc(char, len + 1);
+	while (off < len) {
+		ret = read(fd, buf + off, len - off);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINTR) continue;
+			nv_perror(NVLOG_ERROR, path, ret < 0 ? errno : EIO);
+			stat = -1;
+			goto cleanup;
+		}
+		off += ret;
+	}
+
+	time = nv_calloc(time_t, COL_BLOCK);
+	for (off = 0; off < len; off += head + r->len) {
+		r = (struct col_tail_rec *)(buf + off);
+		if (len - off < sizeof(*r) || r->num > COL_BLOCK ||
+			r->len != sizeof(*r) - head + r->num * 16 ||
+			len - off - head < r->len ||
+			r->sum != col_seg_sum((unsigned char *)&r->id, r->len)) {
+			nv_log(NVLOG_WARN, "%s: bad record at byte %lu of %s, dropping "
+				   "the rest", s->name, (unsigned long)off, path);
+			break;
+		}
+		e = col_series_get(me, r->id);
+		if (e == NULL) continue;
+
+		t = (int64_t *)(r + 1);
+		for (i = 0; i < r->num; i++) time[i] = (time_t)t[i];
+		skipped = e->skipped;
+		if (0 > col_stor_ts_batch(s, e, time, (double *)(t + r->num),
+								  r->num)) {
+			stat = -1;
+			goto cleanup;
+		}
+		got += r->num - (e->skipped - skipped);
+		e->skipped = skipped;
+	}
+	if (got > 0) {
+		nv_log(NVLOG_INFO, "%s: %lu samples short of a block recovered "
+			   "from %s", s->name, got, path);
+	}
+
+cleanup:
+	close(fd);
+	nv_free(buf);
+	nv_free(time);
+	if (stat == 0) stat = col_tail_write(s);
+	return stat;
+}
+
+/*
+ * Lay out the samples of a series from 'from' on as a tail log record in
+ * *buf, growing it as needed, and return its length.  Call with the
+ * series locked.
+ */
+static size_t col_tail_rec(struct col_series *e, int from, char **buf,
+						   size_t *size) {
+	struct col_tail_rec *r = NULL;
+	int num = e->bnum - from;
+	size_t len = sizeof(*r) + (size_t)num * 16;
+	int64_t *t = NULL;
+	double *v = NULL;
+	int i;
+
+	if (len > *size) {
+		*size = len;
+		*buf = nv_realloc(char, *buf, *size);
+	}
+	r = (struct col_tail_rec *)*buf;
+	r->len = len - offsetof(struct col_tail_rec, id);
+	r->id = e->id;
+	r->num = num;
+	t = (int64_t *)(r + 1);
+	v = (double *)(t + num);
+	for (i = 0; i < num; i++) {
+		t[i] = (int64_t)e->btime[from + i];
+		v[i] = e->bvalue[from + i];
+	}
+	r->sum = col_seg_sum((unsigned char *)&r->id, r->len);
+	return len;
+}
+
+/*
+ * Bring the tail log up to date with the samples in memory.  Mostly this
+ * appends the ones that came in since the last call.  Once the log has
+ * grown well past what it held after its last rewrite, or a write to it
+ * failed, it is rewritten instead with just the samples still short of a
+ * block, by way of a temporary file; the segments are synced first, as
+ * the old log may have the only copy on disk of samples sealed since.
+ * When the log is synced its samples count as durable for
+ * col_utime_save().  Call with flock held.
+ */
+static int col_tail_write(struct nv_stor *s) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_series *e = NULL;
+	char path[BUF_LEN];
+	char tmp[BUF_LEN];
+	time_t *logged = NULL;
+	char *buf = NULL;
+	size_t size = 0;
+	size_t len = 0;
+	size_t off = 0;
+	int rewrite = 0;
+	int from = 0;
+	int fd = -1;
+	int stat = 0;
+	int num = 0;
+	int n;
+
+	nv_lock(me->slock);
+	num = me->num;
+	nv_unlock(me->slock);
+	if (num == 0) return 0;
+
+	snprintf(path, sizeof(path), "%s/tail", me->dir);
+	snprintf(tmp, sizeof(tmp), "%s/tail.tmp", me->dir);
+	rewrite = me->tail_fd < 0 || me->tail_bad ||
+		me->tail_len > 2 * me->tail_live + COL_TAIL_MIN;
+	if (rewrite) {
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			nv_perror(NVLOG_ERROR, tmp, errno);
+			stat = -1;
+			goto cleanup;
+		}
+	} else {
+		fd = me->tail_fd;
+		off = me->tail_len;
+	}
+
+	logged = nv_calloc(time_t, num);
+	for (n = 0; n < num; n++) {
+		e = col_series_get(me, n);
+		nv_lock(&e->lock);
+		if (rewrite) col_seg_sync(e, MS_SYNC);
+		from = rewrite ? 0 : e->logged;
+		if (e->bnum > from) {
+			len = col_tail_rec(e, from, &buf, &size);
+			if (pwrite(fd, buf, len, off) != (ssize_t)len) {
+				nv_perror(NVLOG_ERROR, rewrite ? tmp : path, errno);
+				nv_unlock(&e->lock);
+				stat = -1;
+				goto cleanup;
+			}
+			off += len;
+			logged[n] = e->btime[e->bnum-1];
+		}
+		e->logged = e->bnum;
+		nv_unlock(&e->lock);
+	}
+
+	if (rewrite) {
+		if (fsync(fd) != 0 || rename(tmp, path) != 0) {
+			nv_perror(NVLOG_ERROR, path, errno);
+			stat = -1;
+			goto cleanup;
+		}
+		if (me->tail_fd >= 0) close(me->tail_fd);
+		me->tail_fd = fd;
+		me->tail_live = off;
+		me->tail_bad = 0;
+	} else if (off > me->tail_len && fdatasync(fd) != 0) {
+		nv_perror(NVLOG_ERROR, path, errno);
+		stat = -1;
+		goto cleanup;
+	}
+	me->tail_len = off;
+
+	for (n = 0; n < num; n++) {
+		e = col_series_get(me, n);
+		nv_lock(&e->lock);
+		if (e->durable < logged[n]) e->durable = logged[n];
+		nv_unlock(&e->lock);
+	}
+
+cleanup:
+	if (stat < 0) me->tail_bad = 1;
+	if (fd >= 0 && fd != me->tail_fd) close(fd);
+	nv_free(buf);
+	nv_free(logged);
+	return stat;
+}
+
+/* add a series with the next id, in hash bucket 'h'; call with slock held */
+struct col_series *col_series_add(struct col_data *me, const char *sys,
+								  const char *dset, unsigned int h) {
+	struct col_series *e = NULL;
+
+	e = nv_calloc(struct col_series, 1);
+	e->sys = strdup(sys);
+	e->dset = strdup(dset);
+	e->id = me->num;
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->idle, NULL);
+	e->next = me->series[h];
+	me->series[h] = e;
+
+	if (me->num == me->size) {
+		me->size = me->size ? 2 * me->size : 64;
+		me->byid = nv_realloc(struct col_series *, me->byid, me->size);
+	}
+	me->byid[me->num++] = e;
+	return e;
+}
+
+/* find a series; also returns its hash bucket in 'h' */
+struct col_series *col_series_find(struct col_data *me, const char *sys,
+								   const char *dset, unsigned int *h) {
+	struct col_series *e = NULL;
+
+	*h = col_series_hash(sys, dset);
+	for (e = me->series[*h]; e; e = e->next) {
+		if (strcmp(e->dset, dset) == 0 && strcmp(e->sys, sys) == 0) break;
+	}
+	return e;
+}
+
+unsigned int col_series_hash(const char *sys, const char *dset) {
+	unsigned int h = 2166136261u;
+
+	for (; *sys; sys++) h = (h ^ (unsigned char)*sys) * 16777619u;
+	h = (h ^ '/') * 16777619u;
+	for (; *dset; dset++) h = (h ^ (unsigned char)*dset) * 16777619u;
+	return h % COL_SERIES_HASH;
+}
+
+/* the series with id 'id', or NULL */
+struct col_series *col_series_get(struct col_data *me, int id) {
+	struct col_series *e = NULL;
+
+	nv_lock(me->slock);
+	if (id >= 0 && id < me->num) e = me->byid[id];
+	nv_unlock(me->slock);
+	return e;
+}
+
+/* vim: set ts=4 sw=4: */
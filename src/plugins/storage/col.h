@@ -0,0 +1,123 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by Robert Timothy Stewart                          *
+ *   tims@cc.gatech.edu                                                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef _PLUGINS_COL_H_
+#define _PLUGINS_COL_H_
+
+#include <netvizd.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * An embedded column store: no server, just files under one directory.
+ * Every series is a run of append-only segment files holding compressed
+ * blocks of up to COL_BLOCK samples, times and values in separate
+ * columns (see col_seg.h).  Samples collect in memory until there are
+ * enough for a block; only full blocks are written.  Until then, every
+ * flush_interval seconds, the samples that came in are appended to one
+ * tail log for the instance, which is read back at startup and rewritten
+ * with just the samples still in memory once it has grown well past
+ * them.  A sparse index of the blocks, by time, is kept in memory and
+ * rebuilt from the block headers at startup.
+ *
+ *   <dir>/series            catalog: "id<TAB>system<TAB>data set" lines
+ *   <dir>/utimes            update times: "id<TAB>time" lines
+ *   <dir>/tail              tail log: samples not in a block yet
+ *   <dir>/<id>.<n>.col      segment n of series id
+ */
+#define COL_BLOCK			1024	/* samples per block */
+#define COL_SEG_SIZE		8		/* default megabytes per segment */
+#define COL_FLUSH			300		/* default seconds samples wait */
+#define COL_TAIL_MIN		(1024 * 1024)	/* log bytes before rewriting */
+#define COL_SERIES_HASH		1024
+
+/* a block in the sparse index */
+struct col_idx {
+	time_t					first;
+	time_t					last;
+	const struct col_block *b;      /* in a segment mapping */
+};
+
+/* a mapped segment */
+struct col_seg {
+	char *					map;
+	size_t					len;    /* bytes mapped */
+};
+
+/*
+ * One series, and the handle the core passes us for its data set.  All
+ * but the names and id are protected by 'lock'.
+ */
+struct col_series {
+	char *					sys;
+	char *					dset;
+	int						id;
+	pthread_mutex_t			lock;
+	pthread_cond_t			idle;   /* signalled when readers reaches 0 */
+	int						readers;    /* reading a block unlocked */
+
+	struct col_idx *		idx;    /* every block, in time order */
+	int						nidx;
+	int						sidx;   /* entries allocated */
+	struct col_seg *		seg;    /* segment n is seg[n] */
+	int						nseg;
+	size_t					off;    /* end of the data in the last one */
+	size_t					alloc;  /* bytes of it allocated on disk */
+
+	time_t *				btime;  /* samples not in a block yet */
+	double *				bvalue;
+	int						bnum;
+	int						bsize;
+	int						logged; /* of them, in the tail log */
+
+	time_t					last;   /* newest sample taken */
+	time_t					durable;    /* newest sample on disk */
+	time_t					utime;  /* last update time, 0 for none */
+	time_t					saved;  /* utime as written to disk */
+
+	unsigned long			written;
+	unsigned long			blocks;
+	unsigned long			skipped;
+	unsigned long			failed;
+
+	struct col_series *		next;   /* hash chain */
+};
+
+struct col_data {
+	char *					dir;    /* where our files live */
+	size_t					seg_size;   /* bytes per segment */
+	int						interval;   /* flush interval, seconds */
+	int						quit;
+	pthread_mutex_t *		flock;  /* the heartbeat, or shutdown */
+	int						tail_fd;    /* the tail log, -1 before it is made */
+	size_t					tail_len;   /* bytes in it */
+	size_t					tail_live;  /* of them, written by the last rewrite */
+	int						tail_bad;   /* a write failed; rewrite it */
+
+	struct col_series **	series; /* by hash of system and data set */
+	struct col_series **	byid;   /* by id */
+	int						num;
+	int						size;
+	pthread_mutex_t *		slock;
+};
+
+#endif
+
+/* vim: set ts=4 sw=4: */
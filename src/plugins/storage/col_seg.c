@@ -0,0 +1,496 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by Robert Timothy Stewart                          *
+ *   tims@cc.gatech.edu                                                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include <math.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "col.h"
+#include "col_seg.h"
+
+static int col_seg_open(struct nv_stor *s, struct col_series *e);
+static int col_seg_blank(int fd, size_t end);
+static int col_seg_grow(struct nv_stor *s, struct col_series *e,
+						size_t need);
+static void col_seg_add(struct col_series *e, char *map, size_t len);
+static void col_seg_path(struct nv_stor *s, int id, int seg, char *buf,
+						 size_t len);
+static void col_idx_add(struct col_series *e, const struct col_block *b);
+static uint8_t *col_put_varint(uint8_t *p, uint64_t v);
+static const uint8_t *col_get_varint(const uint8_t *p, const uint8_t *end,
+									 uint64_t *v);
+
+/* bytes of a block before the part its checksum covers */
+#define COL_BLOCK_HEAD		offsetof(struct col_block, num)
+
+/* signed deltas as unsigned, small either way */
+#define col_zigzag(d)		(((uint64_t)(d) << 1) ^ (uint64_t)((d) >> 63))
+#define col_unzigzag(u)		((int64_t)((u) >> 1) ^ -(int64_t)((u) & 1))
+
+/*
+ * Map the segments of a series and index their blocks, from the headers
+ * alone.  A block that does not check out ends its segment; it and
+ * anything after it are cleared, to be written over.  A last segment
+ * without its header is removed.  Returns -1 if a segment cannot be read
+ * at all.
+ */
+int col_seg_load(struct nv_stor *s, struct col_series *e) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_seg_head *head = NULL;
+	struct col_block *b = NULL;
+	struct stat st;
+	char path[BUF_LEN];
+	char next[BUF_LEN];
+	char *map = NULL;
+	size_t len = 0;
+	size_t end = 0;
+	size_t off = 0;
+	int fd = -1;
+	int n;
+
+	for (n = 0; ; n++) {
+		col_seg_path(s, e->id, n, path, sizeof(path));
+		fd = open(path, O_RDWR);
+		if (fd < 0) {
+			if (errno == ENOENT) break;
+			nv_perror(NVLOG_ERROR, path, errno);
+			return -1;
+		}
+		if (fstat(fd, &st) != 0) {
+			nv_perror(NVLOG_ERROR, path, errno);
+			close(fd);
+			return -1;
+		}
+
+		/* a crash as the last segment was started can leave it short or
+		 * blank; it never held a block, so it goes */
+		end = st.st_size;
+		if (col_seg_blank(fd, end)) {
+			col_seg_path(s, e->id, n + 1, next, sizeof(next));
+			if (access(next, F_OK) != 0) {
+				nv_log(NVLOG_WARN, "%s: removing unfinished segment %s",
+					   s->name, path);
+				close(fd);
+				unlink(path);
+				break;
+			}
+		}
+
+		/* map the whole segment size, so it can grow in place */
+		len = end > me->seg_size ? end : me->seg_size;
+		map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			nv_perror(NVLOG_ERROR, "mmap()", errno);
+			return -1;
+		}
+		head = (struct col_seg_head *)map;
+		if (end < sizeof(*head) || head->magic != COL_SEG_MAGIC ||
+			head->version != COL_SEG_VERSION || head->id != e->id) {
+			nv_log(NVLOG_ERROR, "%s: %s is not a segment of series %i",
+				   s->name, path, e->id);
+			munmap(map, len);
+			return -1;
+		}
+		col_seg_add(e, map, len);
+
+		off = sizeof(*head);
+		while (off + sizeof(*b) <= end) {
+			b = (struct col_block *)(map + off);
+			if (b->len == 0) break;
+			if (b->len > end - off - COL_BLOCK_HEAD ||
+				b->len < sizeof(*b) - COL_BLOCK_HEAD || (b->len & 7) != 0 ||
+				b->num == 0 || b->num > COL_BLOCK || b->first > b->last ||
+				(e->nidx > 0 && b->first <= e->idx[e->nidx-1].last) ||
+				b->sum != col_seg_sum((unsigned char *)&b->num, b->len)) {
+				nv_log(NVLOG_WARN, "%s: bad block at offset %lu of %s, "
+					   "dropping the rest", s->name, (unsigned long)off,
+					   path);
+				memset(map + off, 0, end - off);
+				break;
+			}
+			col_idx_add(e, b);
+			off += COL_BLOCK_HEAD + b->len;
+		}
+		e->off = off;
+		e->alloc = end;
+	}
+
+	if (e->nidx > 0) {
+		e->last = e->idx[e->nidx-1].last;
+		e->durable = e->last;
+	}
+	return 0;
+}
+
+/*
+ * Encode the samples waiting in memory as a block at the end of the last
+ * segment, starting a new segment if it would not fit, and index it.
+ * Call with the series locked, once COL_BLOCK samples are waiting.  On
+ * error the samples stay where they are.
+ */
+int col_seg_write(struct nv_stor *s, struct col_series *e) {
+	struct col_block *b = NULL;
+	uint64_t bits = 0;
+	uint64_t prev = 0;
+	uint64_t x = 0;
+	int64_t delta = 0;
+	int64_t d = 0;
+	uint8_t *p = NULL;
+	size_t need = 0;
+	size_t len = 0;
+	int num = e->bnum;
+	int i, k, n, tz;
+
+	if (num == 0) return 0;
+
+	need = sizeof(*b) + num * COL_SAMPLE_MAX + 8;
+	if (e->nseg == 0 || e->off + need > e->seg[e->nseg-1].len) {
+		if (0 > col_seg_open(s, e)) return -1;
+	}
+	if (e->off + need > e->alloc && 0 > col_seg_grow(s, e, e->off + need)) {
+		return -1;
+	}
+	b = (struct col_block *)(e->seg[e->nseg-1].map + e->off);
+	p = (uint8_t *)(b + 1);
+
+	/* times: delta of deltas */
+	for (i = 1; i < num; i++) {
+		d = (int64_t)e->btime[i] - (int64_t)e->btime[i-1];
+		p = col_put_varint(p, col_zigzag(d - delta));
+		delta = d;
+	}
+
+	/* values: XOR with the one before, leading and trailing zero bytes
+	 * dropped */
+	for (i = 0; i < num; i++) {
+		memcpy(&bits, &e->bvalue[i], sizeof(bits));
+		x = bits ^ prev;
+		prev = bits;
+		if (x == 0) {
+			*p++ = 0;
+			continue;
+		}
+		tz = __builtin_ctzll(x) >> 3;
+		n = 8 - tz - (__builtin_clzll(x) >> 3);
+		*p++ = (uint8_t)((tz << 4) | n);
+		x >>= 8 * tz;
+		for (k = 0; k < n; k++) {
+			*p++ = (uint8_t)x;
+			x >>= 8;
+		}
+	}
+	while (((char *)p - (char *)b) & 7) *p++ = 0;
+
+	/* the summary */
+	b->num = num;
+	b->count = 0;
+	b->first = e->btime[0];
+	b->last = e->btime[num-1];
+	b->min = NAN;
+	b->max = NAN;
+	b->total = 0.0;
+	b->lval = NAN;
+	b->ltime = 0;
+	for (i = 0; i < num; i++) {
+		double v = e->bvalue[i];
+
+		if (isnan(v)) continue;
+		if (b->count == 0 || v < b->min) b->min = v;
+		if (b->count == 0 || v > b->max) b->max = v;
+		b->total += v;
+		b->lval = v;
+		b->ltime = e->btime[i];
+		b->count++;
+	}
+
+	/* the length goes in last: until then the block ends the segment */
+	len = (char *)p - (char *)&b->num;
+	b->sum = col_seg_sum((unsigned char *)&b->num, len);
+	b->len = len;
+
+	col_idx_add(e, b);
+	e->off += COL_BLOCK_HEAD + len;
+	e->durable = b->last;
+	e->written += num;
+	e->blocks++;
+	e->bnum = 0;
+	e->logged = 0;
+	return 0;
+}
+
+/* push the last segment's blocks toward the disk */
+void col_seg_sync(struct col_series *e, int flags) {
+	if (e->nseg == 0) return;
+
+	if (msync(e->seg[e->nseg-1].map, e->off, flags) != 0) {
+		nv_perror(NVLOG_ERROR, "msync()", errno);
+	}
+}
+
+/*
+ * Sync and unmap the segments of a series, giving back the space the
+ * last one has allocated past its data.  Call with the series locked.
+ */
+void col_seg_close(struct nv_stor *s, struct col_series *e) {
+	char path[BUF_LEN];
+	int i;
+
+	if (e->nseg > 0) {
+		col_seg_sync(e, MS_SYNC);
+		if (e->off < e->alloc) {
+			col_seg_path(s, e->id, e->nseg - 1, path, sizeof(path));
+			if (truncate(path, e->off) != 0) {
+				nv_perror(NVLOG_WARN, path, errno);
+			}
+		}
+	}
+	for (i = 0; i < e->nseg; i++) {
+		munmap(e->seg[i].map, e->seg[i].len);
+	}
+	nv_free(e->seg);
+	nv_free(e->idx);
+	e->nseg = 0;
+	e->nidx = 0;
+	e->sidx = 0;
+}
+
+/*
+ * The first block holding a sample newer than 'after', or nidx if there
+ * is none.  Call with the series locked.
+ */
+int col_seg_find(struct col_series *e, time_t after) {
+	int lo = 0;
+	int hi = e->nidx;
+	int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (e->idx[mid].last <= after) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Decode a block into 'time' and 'value', which must have room for
+ * COL_BLOCK samples.  Blocks are written once and never move, so this
+ * needs no lock.  Returns the number of samples, or -1 if the block is
+ * corrupt.
+ */
+int col_block_decode(const struct col_block *b, time_t *time,
+					 double *value) {
+	const uint8_t *p = (const uint8_t *)(b + 1);
+	const uint8_t *end = (const uint8_t *)&b->num + b->len;
+	uint64_t prev = 0;
+	uint64_t x = 0;
+	uint64_t u = 0;
+	int64_t delta = 0;
+	int64_t t = b->first;
+	int num = b->num;
+	int i, k, n, tz;
+
+	time[0] = t;
+	for (i = 1; i < num; i++) {
+		p = col_get_varint(p, end, &u);
+		if (p == NULL) return -1;
+		delta += col_unzigzag(u);
+		t += delta;
+		time[i] = t;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (p >= end) return -1;
+		n = *p & 0x0f;
+		tz = *p >> 4;
+		p++;
+		x = 0;
+		if (n > 0) {
+			if (tz + n > 8 || end - p < n) return -1;
+			for (k = n - 1; k >= 0; k--) x = (x << 8) | p[k];
+			x <<= 8 * tz;
+			p += n;
+		}
+		prev ^= x;
+		memcpy(&value[i], &prev, sizeof(prev));
+	}
+	return num;
+}
+
+/* start segment number nseg; the last one is synced first */
+int col_seg_open(struct nv_stor *s, struct col_series *e) {
+	struct col_data *me = (struct col_data *)s->data;
+	struct col_seg_head head;
+	char path[BUF_LEN];
+	char *map = NULL;
+	int fd = -1;
+	int ret = 0;
+
+	col_seg_sync(e, MS_SYNC);
+
+	col_seg_path(s, e->id, e->nseg, path, sizeof(path));
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		nv_perror(NVLOG_ERROR, path, errno);
+		return -1;
+	}
+
+	/* the header goes to disk before any block can; see col_seg_load()
+	 * for a crash before it gets there */
+	head.magic = COL_SEG_MAGIC;
+	head.version = COL_SEG_VERSION;
+	head.id = e->id;
+	head.pad = 0;
+	if (pwrite(fd, &head, sizeof(head), 0) != (ssize_t)sizeof(head) ||
+		fdatasync(fd) != 0) {
+		nv_perror(NVLOG_ERROR, path, errno);
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	ret = posix_fallocate(fd, 0, COL_SEG_GROW);
+	if (ret != 0) {
+		nv_perror(NVLOG_ERROR, path, ret);
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	map = mmap(NULL, me->seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			   0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		nv_perror(NVLOG_ERROR, "mmap()", errno);
+		unlink(path);
+		return -1;
+	}
+
+	col_seg_add(e, map, me->seg_size);
+	e->off = sizeof(head);
+	e->alloc = COL_SEG_GROW;
+	return 0;
+}
+
+/* is the segment open on 'fd', 'end' bytes long, missing its header? */
+int col_seg_blank(int fd, size_t end) {
+	struct col_seg_head head;
+
+	if (end < sizeof(head)) return 1;
+	if (pread(fd, &head, sizeof(head), 0) != (ssize_t)sizeof(head)) return 0;
+	return head.magic == 0 && head.version == 0 && head.id == 0;
+}
+
+/*
+ * Allocate more of the last segment on disk, COL_SEG_GROW at a time, so
+ * that it has at least 'need' bytes.  Only allocated pages of the
+ * mapping may be touched.
+ */
+int col_seg_grow(struct nv_stor *s, struct col_series *e, size_t need) {
+	char path[BUF_LEN];
+	size_t len = e->seg[e->nseg-1].len;
+	size_t alloc = 0;
+	int fd = -1;
+	int ret = 0;
+
+	alloc = (need + COL_SEG_GROW - 1) / COL_SEG_GROW * COL_SEG_GROW;
+	if (alloc > len) alloc = len;
+
+	col_seg_path(s, e->id, e->nseg - 1, path, sizeof(path));
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		nv_perror(NVLOG_ERROR, path, errno);
+		return -1;
+	}
+	ret = posix_fallocate(fd, 0, alloc);
+	close(fd);
+	if (ret != 0) {
+		nv_perror(NVLOG_ERROR, path, ret);
+		return -1;
+	}
+	e->alloc = alloc;
+	return 0;
+}
+
+void col_seg_add(struct col_series *e, char *map, size_t len) {
+	e->seg = nv_realloc(struct col_seg, e->seg, e->nseg + 1);
+	e->seg[e->nseg].map = map;
+	e->seg[e->nseg].len = len;
+	e->nseg++;
+}
+
+void col_seg_path(struct nv_stor *s, int id, int seg, char *buf,
+				  size_t len) {
+	struct col_data *me = (struct col_data *)s->data;
+
+	snprintf(buf, len, "%s/%i.%08i.col", me->dir, id, seg);
+}
+
+void col_idx_add(struct col_series *e, const struct col_block *b) {
+	if (e->nidx == e->sidx) {
+		e->sidx = e->sidx ? 2 * e->sidx : 64;
+		e->idx = nv_realloc(struct col_idx, e->idx, e->sidx);
+	}
+	e->idx[e->nidx].first = b->first;
+	e->idx[e->nidx].last = b->last;
+	e->idx[e->nidx].b = b;
+	e->nidx++;
+}
+
+/*
+ * FNV-1a: one multiply a byte instead of the bitwise CRC's eight steps
+ * (pgsql_spool_crc()).  It only has to notice a block torn by a crash.
+ */
+uint32_t col_seg_sum(const unsigned char *p, size_t len) {
+	uint32_t h = 2166136261u;
+
+	while (len--) h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+uint8_t *col_put_varint(uint8_t *p, uint64_t v) {
+	while (v >= 0x80) {
+		*p++ = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+/* returns where the varint ends, or NULL if it runs past 'end' */
+const uint8_t *col_get_varint(const uint8_t *p, const uint8_t *end,
+							  uint64_t *v) {
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (uint64_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+/* vim: set ts=4 sw=4: */
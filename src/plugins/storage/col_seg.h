@@ -0,0 +1,97 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by Robert Timothy Stewart                          *
+ *   tims@cc.gatech.edu                                                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef _PLUGINS_COL_SEG_H_
+#define _PLUGINS_COL_SEG_H_
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include <stdint.h>
+#include "col.h"
+
+/*
+ * A segment is a header and then blocks, each a header and its two
+ * columns.  The segment header is written and synced before anything
+ * else; blocks are written through a shared mapping.  Files grow on
+ * disk COL_SEG_GROW bytes at a time, and the zeroes past the last block
+ * end the segment.  As in the pgsql spool, a block's
+ * length goes in last and its checksum covers the rest, so a block torn
+ * by a crash ends its segment and is written over.  Everything is in
+ * host byte order.
+ *
+ * The time column is the delta of deltas from the block's first time,
+ * zigzag varints: a sample on its regular interval takes one byte.  The
+ * value column is each value's bits XORed with the previous value's, as
+ * a control byte (zero for a repeat; otherwise trailing zero bytes in
+ * the high nibble, significant bytes in the low) and the significant
+ * bytes.  The header also sums up the block, so aggregate reads can
+ * skip decoding blocks that fall in one bucket.
+ */
+#define COL_SEG_GROW		(64 * 1024)
+#define COL_SEG_MAGIC		0x4e56434f	/* "NVCO" */
+#define COL_SEG_VERSION		1
+#define COL_SAMPLE_MAX		19		/* most bytes a sample encodes to */
+
+struct col_seg_head {
+	uint32_t				magic;
+	uint32_t				version;
+	int32_t					id;     /* series id */
+	uint32_t				pad;
+};
+
+struct col_block {
+	uint32_t				len;    /* bytes after 'sum', 0 past the end */
+	uint32_t				sum;    /* FNV-1a of those bytes */
+	uint32_t				num;    /* samples */
+	uint32_t				count;  /* of them, known (not NaN) */
+	int64_t					first;  /* time of the first sample */
+	int64_t					last;   /* and of the last */
+	double					min;    /* of the known values */
+	double					max;
+	double					total;
+	double					lval;   /* latest known value */
+	int64_t					ltime;  /* and its time */
+	/* the time column follows, then the value column, padded to 8 bytes */
+};
+
+/*
+ * A record of the tail log (see col.h): samples of one series that are
+ * not in a block yet, checked as a block is.
+ */
+struct col_tail_rec {
+	uint32_t				len;    /* bytes after 'sum' */
+	uint32_t				sum;    /* FNV-1a of those bytes */
+	int32_t					id;     /* series id */
+	uint32_t				num;    /* samples */
+	/* num int64_t times follow, then num double values */
+};
+
+int col_seg_load(struct nv_stor *s, struct col_series *e);
+int col_seg_write(struct nv_stor *s, struct col_series *e);
+void col_seg_sync(struct col_series *e, int flags);
+void col_seg_close(struct nv_stor *s, struct col_series *e);
+int col_seg_find(struct col_series *e, time_t after);
+int col_block_decode(const struct col_block *b, time_t *time,
+					 double *value);
+uint32_t col_seg_sum(const unsigned char *p, size_t len);
+
+#endif
+
+/* vim: set ts=4 sw=4: */
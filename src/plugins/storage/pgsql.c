@@ -26,13 +26,18 @@
 #include <nvconfig.h>
 #include <libpq-fe.h>
 #include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <endian.h>
 #include <storage.h>
+#include <aggregate.h>
 #include "pgsql.h"
 #include "pgsql_pool.h"
-
-/* various PostgreSQL OIDs, used for parameter types */
-#define VARCHAROID			1043
-#define INT4OID				23
+#include "pgsql_series.h"
+#include "pgsql_part.h"
+#include "pgsql_rollup.h"
+#include "pgsql_spool.h"
+#include "pgsql_io.h"
 
 #define storage_init	pgsql_LTX_storage_init
 /* plugin interface */
@@ -41,20 +46,29 @@ static int pgsql_inst_init(struct nv_stor *s);
 static int pgsql_inst_free(struct nv_stor *s);
 
 /* data interface */
-static int pgsql_stor_ts_data(struct nv_stor *s, char *dset, char *sys,
-							  time_t time, double value);
-static nv_list *pgsql_get_ts_data(struct nv_stor *s, char *dset, char *sys,
+static int pgsql_stor_ts_data(struct nv_stor *s, void *series, time_t time,
+							  double value);
+static int pgsql_stor_ts_batch(struct nv_stor *s, void *series, time_t *time,
+							   double *value, int num);
+static nv_list *pgsql_get_ts_data(struct nv_stor *s, void *series,
 								  time_t start, time_t end, int res);
-static int pgsql_stor_ts_utime(struct nv_stor *s, char *dset, char *sys,
-							   time_t time);
-static time_t pgsql_get_ts_utime(struct nv_stor *s, char *dset, char *sys);
+static int pgsql_get_ts_buf(struct nv_stor *s, void *series, time_t start,
+							time_t end, struct nv_ts_buf *b);
+static void *pgsql_ts_open(struct nv_stor *s, void *series, time_t start,
+						   time_t end, int res, enum nv_ds_cf cf);
+static int pgsql_ts_next_block(struct nv_stor *s, void *h,
+							   struct nv_ts_block *b);
+static void pgsql_ts_close(struct nv_stor *s, void *h);
+static int pgsql_stor_ts_utime(struct nv_stor *s, void *series, time_t time);
+static time_t pgsql_get_ts_utime(struct nv_stor *s, void *series);
 
 /* internal management */
 static void *pgsql_thread(void *arg);
 static int pgsql_init_table(struct nv_stor *s, char *table, char *sql);
-static int pgsql_add_row(struct nv_stor *s, char *system, char *dataset,
-						 time_t time, double value);
+static int pgsql_beat(struct nv_stor *s);
 static void pgsql_get_ready(struct nv_stor *s);
+struct pgsql_cursor;
+static int pgsql_cursor_fetch(struct pgsql_cursor *cur);
 
 int storage_init(struct nv_stor_p *p) {
 	int stat = 0;
@@ -63,8 +77,13 @@ int storage_init(struct nv_stor_p *p) {
 	p->free = pgsql_free;
 	p->inst_init = pgsql_inst_init;
 	p->inst_free = pgsql_inst_free;
+	p->open_series = pgsql_series_open;
 	p->stor_ts_data = pgsql_stor_ts_data;
+	p->stor_ts_data_batch = pgsql_stor_ts_batch;
 	p->get_ts_data = pgsql_get_ts_data;
+	p->ts_open = pgsql_ts_open;
+	p->ts_next_block = pgsql_ts_next_block;
+	p->ts_close = pgsql_ts_close;
 	p->stor_ts_utime = pgsql_stor_ts_utime;
 	p->get_ts_utime = pgsql_get_ts_utime;
 
@@ -88,6 +107,13 @@ static int pgsql_free(struct nv_stor_p *p) {
 							"    value DOUBLE PRECISION, " \
 							"    PRIMARY KEY (system, dataset, time)" \
 							");"
+#define SQL_CREATE_DATA_PART	"CREATE TABLE %s ( " \
+								"    system VARCHAR(256), " \
+								"    dataset VARCHAR(256), " \
+								"    time TIMESTAMP WITH TIME ZONE, " \
+								"    value DOUBLE PRECISION, " \
+								"    PRIMARY KEY (system, dataset, time)" \
+								") PARTITION BY RANGE (time);"
 
 static int pgsql_inst_init(struct nv_stor *s) {
 	nv_node i;
@@ -96,13 +122,16 @@ static int pgsql_inst_init(struct nv_stor *s) {
 	struct pgsql_conn *c = NULL;
 	struct pgsql_data *me = NULL;
 	int pool_num = 0;
+	char *read_host = NULL;
+	int read_port = 0;
+	int read_pool_num = 0;
+	char buf[NAME_LEN + 8];
 	pthread_attr_t attr;
 
 	/* process configuration */
 	me = nv_calloc(struct pgsql_data, 1);
+	me->part_ahead = PGSQL_PART_AHEAD;
 	s->data = (void *)me;
-	s->beat = 0;
-	s->beatfunc = NULL;
 	list_for_each(i, s->conf) {
 		struct nv_conf *c = node_data(struct nv_conf, i);
 
@@ -118,10 +147,59 @@ static int pgsql_inst_init(struct nv_stor *s) {
 			me->db = c->value;
 		} else if (strncmp(c->key, "pool_num", NAME_LEN) == 0) {
 			pool_num = atoi(c->value);
+		} else if (strncmp(c->key, "read_host", NAME_LEN) == 0) {
+			read_host = c->value;
+		} else if (strncmp(c->key, "read_port", NAME_LEN) == 0) {
+			read_port = atoi(c->value);
+		} else if (strncmp(c->key, "read_pool_num", NAME_LEN) == 0) {
+			read_pool_num = atoi(c->value);
+		} else if (strncmp(c->key, "read_lag", NAME_LEN) == 0) {
+			me->read_lag = atoi(c->value);
 		} else if (strncmp(c->key, "connect_timeout", NAME_LEN) == 0) {
 			me->ctimeout = atoi(c->value);
 		} else if (strncmp(c->key, "retry_timeout", NAME_LEN) == 0) {
 			me->rtimeout = atoi(c->value);
+		} else if (strncmp(c->key, "batch_size", NAME_LEN) == 0) {
+			me->batch = atoi(c->value);
+		} else if (strncmp(c->key, "flush_interval", NAME_LEN) == 0) {
+			me->interval = atoi(c->value);
+		} else if (strncmp(c->key, "schema", NAME_LEN) == 0) {
+			if (strncmp(c->value, "ids", NAME_LEN) == 0) {
+				me->ids = 1;
+			} else if (strncmp(c->value, "names", NAME_LEN) == 0) {
+				me->ids = 0;
+			} else {
+				nv_log(NVLOG_ERROR, "unknown schema \"%s\"", c->value);
+				stat = -1;
+				goto cleanup;
+			}
+		} else if (strncmp(c->key, "partition", NAME_LEN) == 0) {
+			me->part = pgsql_part_parse(c->value);
+			if (0 > me->part) {
+				nv_log(NVLOG_ERROR, "unknown partition interval \"%s\"",
+					   c->value);
+				stat = -1;
+				goto cleanup;
+			}
+		} else if (strncmp(c->key, "partition_ahead", NAME_LEN) == 0) {
+			me->part_ahead = atoi(c->value);
+			if (me->part_ahead < 1) {
+				nv_log(NVLOG_ERROR, "partition_ahead must be at least 1, "
+					   "not \"%s\"", c->value);
+				stat = -1;
+				goto cleanup;
+			}
+		} else if (strncmp(c->key, "retention", NAME_LEN) == 0) {
+			me->retention = atoi(c->value);
+		} else if (strncmp(c->key, "rollups", NAME_LEN) == 0) {
+			if (0 > pgsql_rollup_parse(s, c->value)) {
+				stat = -1;
+				goto cleanup;
+			}
+		} else if (strncmp(c->key, "spool", NAME_LEN) == 0) {
+			me->spool = c->value;
+		} else if (strncmp(c->key, "spool_max", NAME_LEN) == 0) {
+			me->spool_max = atoi(c->value);
 		} else if (strncmp(c->key, "ssl", NAME_LEN) == 0) {
 			if (strncmp(c->value, "yes", 3) == 0) {
 				me->ssl = 1;
@@ -167,16 +245,70 @@ static int pgsql_inst_init(struct nv_stor *s) {
 	if (me->rtimeout == 0) {
 		me->rtimeout = 10;
 	}
+	if (me->batch <= 0) {
+		me->batch = 1000;
+	}
+	if (me->interval <= 0) {
+		me->interval = 5;
+	}
+	if (me->spool_max <= 0) {
+		me->spool_max = PGSQL_SPOOL_MAX;
+	}
+
+	/* a read pool, against the primary unless read_host names a replica */
+	if (read_host != NULL || read_port != 0 || read_pool_num > 0) {
+		if (read_host == NULL) read_host = me->host;
+		if (read_port == 0) read_port = me->port;
+		if (read_pool_num <= 0) read_pool_num = PGSQL_READ_POOL;
+	}
+	if (me->read_lag <= 0) {
+		me->read_lag = PGSQL_READ_LAG;
+	}
+
+	/* spool_max is given in megabytes; keep it in segments */
+	me->spool_max = me->spool_max / (PGSQL_SPOOL_SEG / (1024 * 1024));
+	if (me->spool_max < 1) me->spool_max = 1;
+	if (me->spool != NULL && 0 > pgsql_spool_init(s)) {
+		stat = -1;
+		goto cleanup;
+	}
+
+	/* rows are buffered and written in batches, at the latest every
+	 * interval seconds from the storage heartbeat */
+	me->rows = nv_calloc(struct pgsql_row, me->batch);
+	s->beat = me->interval;
+	s->beatfunc = pgsql_beat;
 	
 	/* initialize pthreads stuff */
 	me->lock = nv_calloc(pthread_mutex_t, 1);
 	me->readyc = nv_calloc(pthread_cond_t, 1);
+	me->wlock = nv_calloc(pthread_mutex_t, 1);
+	me->flock = nv_calloc(pthread_mutex_t, 1);
 	pthread_mutex_init(me->lock, NULL);
 	pthread_cond_init(me->readyc, NULL);
+	pthread_mutex_init(me->wlock, NULL);
+	pthread_mutex_init(me->flock, NULL);
+
+	/* the series cache has to be here before our data sets are opened in
+	 * it; the maintenance thread fills it from the database later */
+	me->series = nv_calloc(struct pgsql_series *, PGSQL_SERIES_HASH);
+	me->slock = nv_calloc(pthread_mutex_t, 1);
+	pthread_mutex_init(me->slock, NULL);
 	
-	/* start our connection pool */
-	pgsql_pool_init(s, pool_num);
+	/* start our connection pools */
+	pgsql_pool_init(s, &me->pool, s->name, me->host, me->port, pool_num);
+	if (read_pool_num > 0) {
+		snprintf(buf, sizeof(buf), "%s/read", s->name);
+		pgsql_pool_init(s, &me->rpool, buf, read_host, read_port,
+						read_pool_num);
+	}
 	
+	/* batches are written from their own thread */
+	if (0 > pgsql_io_init(s)) {
+		stat = -1;
+		goto cleanup;
+	}
+
 	/* start our maintenance thread */
 	pthread_attr_init(&attr);
 	me->thread = nv_calloc(pthread_t, 1);
@@ -226,22 +358,51 @@ void *pgsql_thread(void *arg) {
 	
 	nv_log(NVLOG_INFO, "%s: storage maintenance thread starting", s->name);
 
-	/* init the nv_dsts table */
-	ret = pgsql_init_table(s, "nv_dsts", SQL_CREATE_META);
+	/* the integer id schema sets up (and migrates to) its own tables in
+	 * pgsql_series_init() */
+	if (!me->ids) {
+		/* init the nv_dsts table */
+		ret = pgsql_init_table(s, "nv_dsts", SQL_CREATE_META);
+		if (0 > ret) {
+			nv_log(NVLOG_ERROR, "error initializing table nv_dsts, aborting");
+			me->quit = 1;
+			goto cleanup;
+		}
+
+		/* init the nv_dsts_data table */
+		ret = pgsql_init_table(s, "nv_dsts_data", me->part ?
+							   SQL_CREATE_DATA_PART : SQL_CREATE_DATA);
+		if (0 > ret) {
+			nv_log(NVLOG_ERROR, "error initializing table nv_dsts, aborting");
+			me->quit = 1;
+			goto cleanup;
+		}
+	}
+
+	/* load the series we know, with their update times */
+	ret = pgsql_series_init(s);
 	if (0 > ret) {
-		nv_log(NVLOG_ERROR, "error initializing table nv_dsts, aborting");
+		nv_log(NVLOG_ERROR, "error initializing series, aborting");
 		me->quit = 1;
 		goto cleanup;
 	}
-	
-	/* init the nv_dsts_data table */
-	ret = pgsql_init_table(s, "nv_dsts_data", SQL_CREATE_DATA);
+
+	/* set up the partitions, if we use them */
+	ret = pgsql_part_init(s);
 	if (0 > ret) {
-		nv_log(NVLOG_ERROR, "error initializing table nv_dsts, aborting");
+		nv_log(NVLOG_ERROR, "error initializing partitions, aborting");
 		me->quit = 1;
 		goto cleanup;
 	}
-	
+
+	/* and the rollup tables */
+	ret = pgsql_rollup_init(s);
+	if (0 > ret) {
+		nv_log(NVLOG_ERROR, "error initializing rollups, aborting");
+		me->quit = 1;
+		goto cleanup;
+	}
+
 	/* signal that we're ready to start servicing requests */
 	nv_lock(me->lock);
 	me->ready = 1;
@@ -257,7 +418,9 @@ void *pgsql_thread(void *arg) {
 cleanup:
 	nv_log(NVLOG_INFO, "%s: storage maintenance thread stopping", s->name);
 
-	pgsql_pool_free(s);
+	pgsql_pool_free(s, &me->pool);
+	if (me->rpool.num > 0) pgsql_pool_free(s, &me->rpool);
+	pgsql_series_free(s);
 	
 	/* free pthreads stuff */
 	pthread_mutex_destroy(me->lock);
@@ -271,240 +434,551 @@ cleanup:
 
 int pgsql_inst_free(struct nv_stor *s) {
 	struct pgsql_data *me = NULL;
+	int stat = 0;
 	
 	me = (struct pgsql_data *)s->data;
+
+	/* write out whatever is still buffered before we go */
+	if (me->ready) stat = pgsql_series_sync(s);
+	pgsql_io_free(s);
+	if (me->spool != NULL) pgsql_spool_free(s);
+	nv_log(NVLOG_INFO, "%s: %lu rows written, %lu rows failed, %lu "
+		   "duplicates skipped", s->name, me->written, me->failed,
+		   me->skipped);
 	me->quit = 1;
 	
-	return 0;
+	return stat;
 }
 
 
-int pgsql_stor_ts_data(struct nv_stor *s, char *dset, char *sys,
-							  time_t time, double value) {
+/* a single sample is a batch of one */
+int pgsql_stor_ts_data(struct nv_stor *s, void *series, time_t time,
+							  double value) {
+	return pgsql_stor_ts_batch(s, series, &time, &value, 1);
+}
+
+/*
+ * Queue rows for one series in the write-behind buffer.  Whenever the
+ * buffer fills, the caller hands the batch to the I/O thread; otherwise
+ * the heartbeat will get to it.  A row at the newest time already stored
+ * for its series is dropped as a duplicate.  Returns -1 only if the rows
+ * cannot be taken at all; writing them fails later, in pgsql_io_done().
+ */
+int pgsql_stor_ts_batch(struct nv_stor *s, void *series, time_t *time,
+						double *value, int num) {
+	struct pgsql_series *e = (struct pgsql_series *)series;
 	struct pgsql_data *me = NULL;
+	struct pgsql_row *r = NULL;
+	char one = 0;
+	char *take = &one;
 	int stat = 0;
-	int res = 0;
+	int id = -1;
+	int i;
 
 	pgsql_get_ready(s);
 
 	me = (struct pgsql_data *)s->data;
-
-	/* store the data element in the table */
-retry:
-	res = pgsql_add_row(s, sys, dset, time, value);
-	if (0 > res) {
-//		nv_log(NVLOG_ERROR, "error writing values to table nv_dsts_data, "
-//			   "aborting");
+	if (me->quit) {
 		stat = -1;
 		goto cleanup;
 	}
 
+	/* resolve the series now so the batch can go out without lookups;
+	 * rows spooled while the server is down get theirs on replay */
+	if (me->ids && (me->spool == NULL || !pgsql_pool_down(s))) {
+		id = pgsql_series_get_id(s, e);
+		if (0 > id) {
+			stat = -1;
+			goto cleanup;
+		}
+	}
+	if (num > 1) take = nv_malloc(char, num);
+	if (0 == pgsql_series_take(s, e, time, num, take)) goto cleanup;
+
+	nv_lock(me->wlock);
+	for (i = 0; i < num; i++) {
+		if (!take[i]) continue;
+		while (me->num_rows == me->batch) {
+			nv_unlock(me->wlock);
+			pgsql_flush(s);
+			nv_lock(me->wlock);
+		}
+		r = &me->rows[me->num_rows++];
+		r->sys = e->sys;
+		r->dset = e->dset;
+		r->id = id;
+		r->series = e;
+		r->time = time[i];
+		r->value = value[i];
+	}
+	nv_unlock(me->wlock);
+
 cleanup:
+	if (take != &one) nv_free(take);
 	return stat;
 }
 
+/*
+ * Storage heartbeat: write out the rows and update times that have been
+ * waiting.  Errors are logged where they happen; returning one would stop
+ * the heartbeat.
+ */
+int pgsql_beat(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	if (me->ready && !me->quit) {
+		pgsql_series_sync(s);
+		if (me->spool != NULL && !pgsql_pool_down(s)) pgsql_spool_replay(s);
+		pgsql_pool_lag(s);
+		pgsql_part_beat(s);
+	}
+	return 0;
+}
+
+/*
+ * Hand the buffered rows to the I/O thread, waiting for it to catch up
+ * first if every batch is in use.  New rows keep going into the buffer
+ * meanwhile.  How the batch fares is logged and counted there, see
+ * pgsql_io_done(); pgsql_io_wait() waits for it.
+ */
+int pgsql_flush(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_batch *b = NULL;
+	struct pgsql_row *rows = NULL;
+	int i;
+
+	nv_lock(me->flock);
+	b = pgsql_io_get(s);
+
+	/* take the current batch */
+	nv_lock(me->wlock);
+	rows = me->rows;
+	me->rows = b->rows;
+	b->rows = rows;
+	b->num = me->num_rows;
+	me->num_rows = 0;
+	nv_unlock(me->wlock);
+
+	/* rows buffered while the server was down may still need their
+	 * series ids; any that cannot get one go to the spool with the batch */
+	if (me->ids && (me->spool == NULL || !pgsql_pool_down(s))) {
+		for (i = 0; i < b->num; i++) {
+			if (b->rows[i].id >= 0) continue;
+			b->rows[i].id = pgsql_series_id(s, b->rows[i].sys,
+											b->rows[i].dset);
+		}
+	}
+	pgsql_io_put(s, b);
+
+	nv_unlock(me->flock);
+	return 0;
+}
+
 
-#define SQL_GET_TS		"SELECT EXTRACT(epoch FROM time), value " \
+/*
+ * Raw samples are read through a binary cursor, a block of rows at a time,
+ * and decoded straight into the caller's buffer.  The result never has to
+ * be held in memory all at once.
+ */
+#define SQL_DECLARE_TS	"DECLARE nv_ts NO SCROLL CURSOR FOR " \
+						"SELECT time, value " \
 						"FROM nv_dsts_data " \
-						"WHERE system = '%s' and dataset = '%s' and " \
-						"      time >= '%s' AND time <= '%s';"
-nv_list *pgsql_get_ts_data(struct nv_stor *s, char *dset, char *sys,
-								  time_t start, time_t end, int res) {
-	struct pgsql_data *me = NULL;
-	nv_list *list = NULL;
-	int stat = 0;
-	int ret = 0;
+						"WHERE system = $1 AND dataset = $2 AND " \
+						"      time >= $3 AND time <= $4 AND " \
+						"      value IS NOT NULL " \
+						"ORDER BY time;"
+#define NUM_DECLARE_TS	4
+#define OID_DECLARE_TS	{ VARCHAROID, VARCHAROID, TIMESTAMPTZOID, \
+						  TIMESTAMPTZOID }
+#define SQL_DECLARE_TS_ID	"DECLARE nv_ts NO SCROLL CURSOR FOR " \
+							"SELECT time, value " \
+							"FROM nv_series_data " \
+							"WHERE series_id = $1 AND " \
+							"      time >= $2 AND time <= $3 AND " \
+							"      value IS NOT NULL " \
+							"ORDER BY time;"
+#define NUM_DECLARE_TS_ID	3
+#define OID_DECLARE_TS_ID	{ INT4OID, TIMESTAMPTZOID, TIMESTAMPTZOID }
+#define PGSQL_FETCH_ROWS	8192
+#define SQL_FETCH_TS	"FETCH 8192 FROM nv_ts;"
+int pgsql_get_ts_buf(struct nv_stor *s, void *series, time_t start,
+					 time_t end, struct nv_ts_buf *b) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
 	struct pgsql_conn *c = NULL;
-	char buf[NAME_LEN];
-	char startbuf[26];
-	char endbuf[26];
-	PGresult *result = NULL;
+	struct pgsql_params p;
+	Oid types[] = OID_DECLARE_TS;
+	Oid types_id[] = OID_DECLARE_TS_ID;
+	PGresult *res = NULL;
+	int stat = 0;
 	int row = 0;
 	int rownum = 0;
-	int status = 0;
-	
+
 	pgsql_get_ready(s);
-	
-	nv_list_new(list);
-	me = (struct pgsql_data *)s->data;
 
-	/* pull data from the table */
-	ctime_r(&start, startbuf);
-	ctime_r(&end, endbuf);
-	snprintf(buf, NAME_LEN, SQL_GET_TS, sys, dset, startbuf, endbuf);
-	buf[NAME_LEN-1] = '\0';
+	b->num = 0;
+	pgsql_params_init(&p);
+	if (0 > pgsql_param_series(s, &p, series)) {
+		stat = -1;
+		goto cleanup;
+	}
+	pgsql_param_time(&p, start);
+	pgsql_param_time(&p, end);
 retry:
-	c = pgsql_pool_get(s);
-	if (c == NULL) goto cleanup;
-	result = PQexec(c->conn, buf);
+	c = pgsql_pool_get_read(s, 1);
+	if (c == NULL) {
+		stat = -1;
+		goto cleanup;
+	}
+	res = PQexec(c->conn, "BEGIN;");
 	pgsql_pool_conncheck(s, c, retry);
-	status = PQresultStatus(result);
-	switch(status) {
-		case PGRES_TUPLES_OK:
-			/* do nothing, we're OK */
-			break;
-
-		default:
-			nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
-				   PQresultErrorMessage(result));
-			stat = -1;
-			goto cleanup2;
-			break;
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto error;
+	PQclear(res);
+	if (me->ids) {
+		res = PQexecParams(c->conn, SQL_DECLARE_TS_ID, NUM_DECLARE_TS_ID,
+						   types_id, p.values, p.lengths, p.formats, 0);
+	} else {
+		res = PQexecParams(c->conn, SQL_DECLARE_TS, NUM_DECLARE_TS, types,
+						   p.values, p.lengths, p.formats, 0);
 	}
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto error;
 
-	/* add data to list */
-	rownum = PQntuples(result);
-	for (row = 0; row < rownum; row++) {
+	/* pull blocks of rows until we run out */
+	do {
+		PQclear(res);
+		res = PQexecParams(c->conn, SQL_FETCH_TS, 0, NULL, NULL, NULL, NULL,
+						   1);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK) goto error;
+
+		rownum = PQntuples(res);
+		for (row = 0; row < rownum; row++) {
+			b->time[b->num] = pgsql_get_time(PQgetvalue(res, row, 0));
+			b->value[b->num] = pgsql_get_float8(PQgetvalue(res, row, 1));
+			b->num++;
+			if (b->num == b->size) {
+				stat = b->flush(b);
+				b->num = 0;
+				if (stat != 0) goto rollback;
+			}
+		}
+	} while (rownum == PGSQL_FETCH_ROWS);
+	if (b->num > 0) stat = b->flush(b);
+	b->num = 0;
+
+	/* closes the cursor too */
+	PQclear(res);
+	res = PQexec(c->conn, "COMMIT;");
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) goto error;
+	goto cleanup2;
+
+error:
+	nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name, PQresultErrorMessage(res));
+	stat = -1;
+rollback:
+	PQclear(res);
+	res = PQexec(c->conn, "ROLLBACK;");
+cleanup2:
+	PQclear(res);
+	pgsql_pool_release(s, c);
+
+cleanup:
+	return stat;
+}
+
+/* append a buffer of samples to the nv_list in b->arg */
+static int pgsql_list_flush(struct nv_ts_buf *b) {
+	nv_list *list = (nv_list *)b->arg;
+	int i;
+
+	for (i = 0; i < b->num; i++) {
 		nv_node n;
-		struct nv_ts_data *d = NULL;
+		struct nv_ts_data *d = nv_calloc(struct nv_ts_data, 1);
 
-		d = nv_calloc(struct nv_ts_data, 1);
-		d->time = atoi(PQgetvalue(result, row, 0));
-		d->value = atof(PQgetvalue(result, row, 1));
-		
+		d->time = b->time[i];
+		d->value = b->value[i];
 		nv_node_new(n);
 		set_node_data(n, d);
 		list_append(list, n);
 	}
-	
-cleanup2:
-	PQclear(result);
-	pgsql_pool_release(s, c);
-	
-cleanup:
+	return 0;
+}
+
+/*
+ * The list form of pgsql_get_ts_buf(), for callers that want one: raw
+ * samples, whatever the resolution.  Unlike a cursor it waits for a read
+ * connection, so storage falls back to it when pgsql_ts_open() cannot
+ * get one.
+ */
+nv_list *pgsql_get_ts_data(struct nv_stor *s, void *series, time_t start,
+						   time_t end, int res) {
+	nv_list *list = NULL;
+	time_t t[BUF_LEN];
+	double v[BUF_LEN];
+	struct nv_ts_buf b;
+
+	(void)res;
+	nv_list_new(list);
+	b.time = t;
+	b.value = v;
+	b.size = BUF_LEN;
+	b.flush = pgsql_list_flush;
+	b.arg = list;
+	pgsql_get_ts_buf(s, series, start, end, &b);
 	return list;
 }
 
 
-#define SQL_GET_UTIME		"SELECT EXTRACT(epoch FROM utime) " \
-							"FROM nv_dsts " \
-							"WHERE system = '%s' and dataset = '%s';"
-#define SQL_ADD_UTIME		"INSERT INTO nv_dsts ( system, dataset, utime ) " \
-							"VALUES ( '%s', '%s', '%s' );"
-#define SQL_UPDATE_UTIME	"UPDATE nv_dsts " \
-							"SET utime = '%s' " \
-							"WHERE system = '%s' and dataset = '%s';"
+/*
+ * Consolidate a range in the database, one row per bucket: the bucket
+ * start (the epoch floored to a multiple of the step), then count, sum,
+ * min, max, the latest value and its time.  NaN (unknown) values are left
+ * out, as in aggregate.c.
+ */
+#define SQL_GET_TS_AGG	"SELECT floor(EXTRACT(epoch FROM time) / $3) * $3 " \
+						"           AS bucket, " \
+						"       count(value), sum(value), min(value), " \
+						"       max(value), " \
+						"       (array_agg(value ORDER BY time DESC))[1], " \
+						"       max(EXTRACT(epoch FROM time)) " \
+						"FROM nv_dsts_data " \
+						"WHERE system = $1 AND dataset = $2 AND " \
+						"      time >= $4 AND time <= $5 AND " \
+						"      value <> 'NaN' " \
+						"GROUP BY bucket " \
+						"ORDER BY bucket;"
+#define OID_GET_TS_AGG	{ VARCHAROID, VARCHAROID, INT4OID, TIMESTAMPTZOID, \
+						  TIMESTAMPTZOID }
+#define SQL_GET_TS_AGG_ID	"SELECT floor(EXTRACT(epoch FROM time) / $2) " \
+							"           * $2 AS bucket, " \
+							"       count(value), sum(value), min(value), " \
+							"       max(value), " \
+							"       (array_agg(value ORDER BY time DESC))[1], " \
+							"       max(EXTRACT(epoch FROM time)) " \
+							"FROM nv_series_data " \
+							"WHERE series_id = $1 AND " \
+							"      time >= $3 AND time <= $4 AND " \
+							"      value <> 'NaN' " \
+							"GROUP BY bucket " \
+							"ORDER BY bucket;"
+#define OID_GET_TS_AGG_ID	{ INT4OID, INT4OID, TIMESTAMPTZOID, \
+							  TIMESTAMPTZOID }
+
+
+/*
+ * A range read for stor_ts_open(): a cursor over the raw samples, or over
+ * the buckets of the query above, pulled from the database a FETCH at a
+ * time as the caller asks for blocks.  The next FETCH is sent as soon as one comes back, so the server fills it while
+ * the caller works through the rows it has.  It keeps its read connection
+ * (and transaction) until it is closed, so callers close it rather than
+ * leave it idle.  Opening one fails at once when no read connection is
+ * free.
+ */
+struct pgsql_cursor {
+	struct pgsql_conn *	c;
+	PGresult *			res;		/* the rows of the last FETCH */
+	int					row;		/* next row of res */
+	int					done;		/* the last FETCH came up short */
+	int					pending;	/* the next FETCH has been sent */
+	int					agg;		/* rows are buckets, not samples */
+	enum nv_ds_cf		cf;
+	struct nv_agg		a;			/* one bucket, to consolidate a row */
+};
 
-int pgsql_stor_ts_utime(struct nv_stor *s, char *dset, char *sys,
-							   time_t time) {
+#define PGSQL_DECLARE	"DECLARE nv_ts NO SCROLL CURSOR FOR "
+void *pgsql_ts_open(struct nv_stor *s, void *series, time_t start,
+					time_t end, int res, enum nv_ds_cf cf) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_cursor *cur = NULL;
 	struct pgsql_conn *c = NULL;
-	int stat = 0;
-	int ret = 0;
-	PGresult *res = NULL;
-	char buf[NAME_LEN];
-	char tbuf[26];
-	
-	pgsql_get_ready(s);
+	struct pgsql_params p;
+	Oid types[] = OID_DECLARE_TS;
+	Oid types_id[] = OID_DECLARE_TS_ID;
+	Oid types_agg[] = OID_GET_TS_AGG;
+	Oid types_agg_id[] = OID_GET_TS_AGG_ID;
+	Oid types_roll[] = OID_GET_ROLLUP;
+	Oid types_roll_id[] = OID_GET_ROLLUP_ID;
+	Oid *t = NULL;
+	PGresult *result = NULL;
+	char buf[1024];
+	const char *sql = NULL;
+	int step = 0;
 
-	/* see if we already have a value for the update time */
-	snprintf(buf, NAME_LEN, SQL_GET_UTIME, sys, dset);
-	buf[NAME_LEN-1] = '\0';
-retry:
-	c = pgsql_pool_get(s);
-	if (c == NULL) goto cleanup;
-	res = PQexec(c->conn, buf);
-	pgsql_pool_conncheck(s, c, retry);
-	switch(PQresultStatus(res)) {
-		case PGRES_TUPLES_OK:
-			/* do nothing, we're OK */
-			break;
+	/* callers are I/O threads, which must not sleep here: no waiting for
+	 * the database to come up, or for a connection */
+	if (!me->ready || me->quit) return NULL;
 
-		default:
-			nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
-				   PQresultErrorMessage(res));
-			stat = -1;
-			goto cleanup2;
-			break;
-	}
-	ctime_r(&time, tbuf);
-	if (PQntuples(res) < 1) {
-		/* we need to add a new row for the update time */
-		snprintf(buf, NAME_LEN, SQL_ADD_UTIME, sys, dset, tbuf);
-		buf[NAME_LEN-1] = '\0';
-	} else {
-		/* we need to update the existing row */
-		snprintf(buf, NAME_LEN, SQL_UPDATE_UTIME, tbuf, sys, dset);
-		buf[NAME_LEN-1] = '\0';
-	}
-	PQclear(res);
-	pgsql_pool_release(s, c);
+	cur = nv_calloc(struct pgsql_cursor, 1);
+	cur->agg = res > 0;
+	cur->cf = cf;
+	nv_agg_init(&cur->a, res);
 
-	/* run the SQL */
-retry2:
-	c = pgsql_pool_get(s);
-	if (c == NULL) goto cleanup;
-	res = PQexec(c->conn, buf);
-	pgsql_pool_conncheck(s, c, retry2);
-	switch(PQresultStatus(res)) {
-		case PGRES_COMMAND_OK:
-			/* do nothing, we're OK */
-			break;
+	pgsql_params_init(&p);
+	if (0 > pgsql_param_series(s, &p, series)) goto error;
+	if (cur->agg) {
+		pgsql_param_int4(&p, cur->a.step);
 
-		default:
-			nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
-				   PQresultErrorMessage(res));
-			stat = -1;
-			goto cleanup2;
-			break;
+		/* from a rollup if one fits: its buckets fit evenly in ours */
+		step = pgsql_rollup_pick(s, cur->a.step);
+		if (step > 0) {
+			pgsql_rollup_query(s, buf, sizeof(buf), step, PGSQL_DECLARE);
+			pgsql_rollup_params(&p, start, end, step);
+			sql = buf;
+			t = me->ids ? types_roll_id : types_roll;
+		} else {
+			sql = me->ids ? PGSQL_DECLARE SQL_GET_TS_AGG_ID :
+				  PGSQL_DECLARE SQL_GET_TS_AGG;
+			t = me->ids ? types_agg_id : types_agg;
+		}
+	} else {
+		sql = me->ids ? SQL_DECLARE_TS_ID : SQL_DECLARE_TS;
+		t = me->ids ? types_id : types;
 	}
+	if (step == 0) {
+		pgsql_param_time(&p, start);
+		pgsql_param_time(&p, end);
+	}
+retry:
+	c = pgsql_pool_get_read(s, 0);
+	if (c == NULL) {
+		nv_log(NVLOG_DEBUG, "%s: no free read connection", s->name);
+		goto error;
+	}
+	result = PQexec(c->conn, "BEGIN;");
+	pgsql_pool_conncheck(s, c, retry);
+	if (PQresultStatus(result) != PGRES_COMMAND_OK) goto error2;
+	PQclear(result);
+	result = PQexecParams(c->conn, sql, p.num, t, p.values, p.lengths,
+						  p.formats, 0);
+	if (PQresultStatus(result) != PGRES_COMMAND_OK) goto error2;
+	PQclear(result);
 
-cleanup2:
-	PQclear(res);
+	cur->c = c;
+	return cur;
+
+error2:
+	nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+		   PQresultErrorMessage(result));
+	PQclear(result);
+	result = PQexec(c->conn, "ROLLBACK;");
+	PQclear(result);
 	pgsql_pool_release(s, c);
-	
-cleanup:
-	return stat;
+error:
+	nv_agg_free(&cur->a);
+	nv_free(cur);
+	return NULL;
 }
 
-time_t pgsql_get_ts_utime(struct nv_stor *s, char *dset, char *sys) {
-	struct pgsql_conn *c = NULL;
-	time_t utime = 0;
-	int ret = 0;
-	PGresult *res = NULL;
-	char buf[NAME_LEN];
-	char tbuf[26];
-	char *resval = NULL;
+/* send the next FETCH, without waiting for it */
+int pgsql_cursor_fetch(struct pgsql_cursor *cur) {
+	if (PQsendQueryParams(cur->c->conn, SQL_FETCH_TS, 0, NULL, NULL, NULL,
+						  NULL, cur->agg ? 0 : 1) != 1) {
+		return -1;
+	}
+	return 0;
+}
 
-	pgsql_get_ready(s);
+int pgsql_ts_next_block(struct nv_stor *s, void *h, struct nv_ts_block *b) {
+	struct pgsql_cursor *cur = (struct pgsql_cursor *)h;
+	struct nv_agg *a = &cur->a;
+	PGresult *res = NULL;
+	double v;
 
-	/* get the value for the update time */
-	snprintf(buf, NAME_LEN, SQL_GET_UTIME, sys, dset);
-retry:
-	c = pgsql_pool_get(s);
-	if (c == NULL) goto cleanup;
-	buf[NAME_LEN-1] = '\0';
-	res = PQexec(c->conn, buf);
-	pgsql_pool_conncheck(s, c, retry);
-	if (c == NULL) goto cleanup;
-	switch(PQresultStatus(res)) {
-		case PGRES_TUPLES_OK:
-			/* do nothing, we're OK */
-			break;
+	b->num = 0;
+	while (b->num < NV_TS_BLOCK) {
+		/* out of rows: get more, text for buckets, binary for samples */
+		if (cur->res == NULL || cur->row == PQntuples(cur->res)) {
+			if (cur->done) break;
+			PQclear(cur->res);
+			cur->res = NULL;
+			if (!cur->pending) pgsql_cursor_fetch(cur);
+			cur->pending = 0;
+			cur->res = PQgetResult(cur->c->conn);
+			while ((res = PQgetResult(cur->c->conn)) != NULL) PQclear(res);
+			if (PQresultStatus(cur->res) != PGRES_TUPLES_OK) {
+				nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+					   cur->res ? PQresultErrorMessage(cur->res) :
+					   PQerrorMessage(cur->c->conn));
+				PQclear(cur->res);
+				cur->res = NULL;
+				cur->done = 1;
+				return -1;
+			}
+			cur->row = 0;
+			cur->done = PQntuples(cur->res) < PGSQL_FETCH_ROWS;
+			if (!cur->done) cur->pending = pgsql_cursor_fetch(cur) == 0;
+			continue;
+		}
 
-		default:
-			nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
-				   PQresultErrorMessage(res));
-			utime = -1;
-			goto cleanup2;
-			break;
+		res = cur->res;
+		if (cur->agg) {
+			a->num = 0;
+			nv_agg_merge(a, (time_t)strtoll(PQgetvalue(res, cur->row, 0),
+											NULL, 10),
+						 atoi(PQgetvalue(res, cur->row, 1)),
+						 atof(PQgetvalue(res, cur->row, 2)),
+						 atof(PQgetvalue(res, cur->row, 3)),
+						 atof(PQgetvalue(res, cur->row, 4)),
+						 atof(PQgetvalue(res, cur->row, 5)),
+						 (time_t)atof(PQgetvalue(res, cur->row, 6)));
+			if (a->num > 0) {
+				b->time[b->num] = a->time[0];
+				b->value[b->num] = nv_agg_value(a, 0, cur->cf);
+				b->min[b->num] = a->min[0];
+				b->max[b->num] = a->max[0];
+				b->num++;
+			}
+		} else {
+			/* unknown values are left out, as in aggregate.c */
+			v = pgsql_get_float8(PQgetvalue(res, cur->row, 1));
+			if (!isnan(v)) {
+				b->time[b->num] = pgsql_get_time(PQgetvalue(res, cur->row,
+															0));
+				b->value[b->num] = v;
+				b->min[b->num] = v;
+				b->max[b->num] = v;
+				b->num++;
+			}
+		}
+		cur->row++;
 	}
+	return b->num;
+}
 
-	/* return the value, or zero if none exists */
-	if (PQntuples(res) < 1) {
-		/* no value returned, never been updated */
-		utime = 0;
-	} else {
-		/* get the time value to return */
-		resval = PQgetvalue(res, 0, 0);
-		utime = atoi(resval);
-	}
+void pgsql_ts_close(struct nv_stor *s, void *h) {
+	struct pgsql_cursor *cur = (struct pgsql_cursor *)h;
+	PGresult *res = NULL;
 
-cleanup2:
+	/* closes the cursor too, once a FETCH still on its way is in */
+	PQclear(cur->res);
+	if (cur->pending) {
+		while ((res = PQgetResult(cur->c->conn)) != NULL) PQclear(res);
+	}
+	res = PQexec(cur->c->conn, "COMMIT;");
 	PQclear(res);
-	pgsql_pool_release(s, c);
-	
-cleanup:
-	return utime;
+	pgsql_pool_release(s, cur->c);
+
+	nv_agg_free(&cur->a);
+	nv_free(cur);
+}
+
+/*
+ * Update times live in the series cache (pgsql_series.c): they are read
+ * from there, and changes go back to the database in one statement from
+ * the heartbeat.
+ */
+int pgsql_stor_ts_utime(struct nv_stor *s, void *series, time_t time) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	pgsql_get_ready(s);
+	if (me->quit) return -1;
+	return pgsql_series_set_utime(s, series, time);
+}
+
+time_t pgsql_get_ts_utime(struct nv_stor *s, void *series) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	pgsql_get_ready(s);
+	if (me->quit) return -1;
+	return pgsql_series_utime(s, series);
 }
 
 
@@ -520,7 +994,7 @@ int pgsql_init_table(struct nv_stor *s, char *table, char *sql) {
 	PGresult *res = NULL;
 	Oid types[] = OID_TABLE_EXISTS;
 	const char *params[1] = { NULL };
-	char buf[NAME_LEN];
+	char buf[2*NAME_LEN];
 	int stat = 0;
 	struct pgsql_conn *c = NULL;
 	
@@ -549,8 +1023,7 @@ retry:
 		PQclear(res);
 
 		/* table does not exist, create it */
-		snprintf(buf, NAME_LEN, sql, table);
-		buf[NAME_LEN-1] = '\0';
+		snprintf(buf, sizeof(buf), sql, table);
 		res = PQexec(c->conn, buf);
 		switch(PQresultStatus(res)) {
 			case PGRES_COMMAND_OK:
@@ -575,46 +1048,84 @@ cleanup:
 }
 
 
-#define SQL_ADD_ROW		"INSERT INTO nv_dsts_data ( system, dataset, " \
-						"    time, value ) " \
-						"VALUES ( '%s', '%s', '%s', %f );"
-int pgsql_add_row(struct nv_stor *s, char *system, char *dataset, time_t time,
-				  double value) {
-	char buf[NAME_LEN];
-	char tbuf[26];
-	PGresult *res = NULL;
-	int stat = 0;
-	struct pgsql_conn *c = NULL;
-	
-	pgsql_get_ready(s);
+/* the data table for the schema in use */
+const char *pgsql_data_table(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
 
-	ctime_r(&time, tbuf);
-	snprintf(buf, NAME_LEN, SQL_ADD_ROW, system, dataset, tbuf, value);
-	buf[NAME_LEN-1] = '\0';
-retry:
-	c = pgsql_pool_get(s);
-	if (c == NULL) goto cleanup;
-	res = PQexec(c->conn, buf);
-	pgsql_pool_conncheck(s, c, retry);
-	switch(PQresultStatus(res)) {
-		case PGRES_COMMAND_OK:
-			/* do nothing, we're OK */
-			break;
+	return me->ids ? "nv_series_data" : "nv_dsts_data";
+}
 
-		default:
-			nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
-				   PQresultErrorMessage(res));
-			stat = -1;
-			goto cleanup2;
-			break;
-	}
+/*
+ * Building parameter lists.  Strings go as text, numbers and times in
+ * binary (network byte order), which saves the server parsing them.
+ */
+void pgsql_params_init(struct pgsql_params *p) {
+	p->num = 0;
+}
 
-cleanup2:
-	PQclear(res);
-	pgsql_pool_release(s, c);
-	
-cleanup:
-	return stat;
+void pgsql_param_text(struct pgsql_params *p, const char *v) {
+	p->values[p->num] = v;
+	p->lengths[p->num] = 0;
+	p->formats[p->num] = 0;
+	p->num++;
+}
+
+void pgsql_param_int4(struct pgsql_params *p, int32_t v) {
+	uint32_t be = htobe32((uint32_t)v);
+
+	memcpy(p->buf[p->num], &be, 4);
+	p->values[p->num] = p->buf[p->num];
+	p->lengths[p->num] = 4;
+	p->formats[p->num] = 1;
+	p->num++;
+}
+
+void pgsql_param_int8(struct pgsql_params *p, int64_t v) {
+	uint64_t be = htobe64((uint64_t)v);
+
+	memcpy(p->buf[p->num], &be, 8);
+	p->values[p->num] = p->buf[p->num];
+	p->lengths[p->num] = 8;
+	p->formats[p->num] = 1;
+	p->num++;
+}
+
+void pgsql_param_float8(struct pgsql_params *p, double v) {
+	uint64_t u;
+
+	memcpy(&u, &v, 8);
+	pgsql_param_int8(p, (int64_t)u);
+}
+
+/* timestamptz goes as microseconds since 2000-01-01 00:00 UTC */
+void pgsql_param_time(struct pgsql_params *p, time_t t) {
+	pgsql_param_int8(p, ((int64_t)t - PGSQL_EPOCH_OFFSET) * 1000000);
+}
+
+/*
+ * Decoding binary results.
+ */
+time_t pgsql_get_time(const char *v) {
+	uint64_t be;
+	int64_t us;
+
+	memcpy(&be, v, 8);
+	us = (int64_t)be64toh(be);
+
+	/* round toward the past, even before 2000 */
+	if (us < 0) us -= 999999;
+	return (time_t)(us / 1000000 + PGSQL_EPOCH_OFFSET);
+}
+
+double pgsql_get_float8(const char *v) {
+	uint64_t be;
+	uint64_t u;
+	double d;
+
+	memcpy(&be, v, 8);
+	u = be64toh(be);
+	memcpy(&d, &u, 8);
+	return d;
 }
 
 /* vim: set ts=4 sw=4: */
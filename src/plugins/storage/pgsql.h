@@ -23,8 +23,49 @@
 
 #include <netvizd.h>
 #include <pthread.h>
+#include <stdint.h>
 #include "pgsql_pool.h"
 
+/* various PostgreSQL OIDs, used for parameter types */
+#define VARCHAROID			1043
+#define INT4OID				23
+#define INT8OID				20
+#define FLOAT8OID			701
+#define TIMESTAMPTZOID		1184
+
+/* seconds from the Unix epoch to the PostgreSQL epoch (2000-01-01) */
+#define PGSQL_EPOCH_OFFSET	946684800
+
+/* read pool defaults: connections, and seconds a replica may lag */
+#define PGSQL_READ_POOL		4
+#define PGSQL_READ_LAG		30
+
+/* most rollup steps per storage instance */
+#define PGSQL_MAX_ROLLUPS	8
+
+/* parameters for a statement */
+#define PGSQL_MAX_PARAMS	8
+struct pgsql_params {
+	int					num;
+	const char *		values[PGSQL_MAX_PARAMS];
+	int					lengths[PGSQL_MAX_PARAMS];
+	int					formats[PGSQL_MAX_PARAMS];
+	char				buf[PGSQL_MAX_PARAMS][8];  /* binary values */
+};
+
+struct pgsql_series;
+struct pgsql_batch;
+
+/* a row waiting in the write-behind buffer */
+struct pgsql_row {
+	char *				sys;
+	char *				dset;
+	int					id;         /* series id, in the "ids" schema */
+	struct pgsql_series *series;    /* NULL for rows from the spool */
+	time_t				time;
+	double				value;
+};
+
 struct pgsql_data {
 	char *				host;       /* database server hostname */
 	int					port;       /* port number */
@@ -34,13 +75,82 @@ struct pgsql_data {
 	int					ctimeout;   /* connection timeout */
 	int					rtimeout;   /* retry timeout */
 	int					ssl;        /* use ssl? */
-	struct pgsql_pool	pool;       /* our connection pool */
+	struct pgsql_pool	pool;       /* connections to the primary */
+	struct pgsql_pool	rpool;      /* connections for reads, if num > 0 */
+	int					read_lag;   /* most seconds a replica may lag */
 	
 	pthread_t *			thread;     /* maintenance thread */
 	pthread_mutex_t *	lock;       /* data lock */
 	pthread_cond_t *	readyc;     /* ready condition variables */
 	int					ready;      /* are we ready to work? */
 	int					quit;       /* are we ready to exit? */
+
+	/*
+	 * write-behind buffer.  Rows collect here until a batch is full or
+	 * the heartbeat comes round; a flush swaps the buffer with an empty
+	 * batch and queues the full one for the I/O thread (pgsql_io.h).
+	 */
+	int					batch;      /* rows per write */
+	int					interval;   /* max seconds a row waits */
+	struct pgsql_row *	rows;       /* rows waiting to be written */
+	int					num_rows;
+	pthread_mutex_t *	wlock;      /* protects rows and num_rows */
+	pthread_mutex_t *	flock;      /* one flush at a time */
+	unsigned long		written;    /* rows written so far */
+	unsigned long		failed;     /* rows we could not write */
+	unsigned long		skipped;    /* duplicate rows not written */
+
+	/* I/O thread, see pgsql_io.h */
+	pthread_t *			io_thread;
+	pthread_mutex_t *	iolock;     /* protects the rest of these */
+	pthread_cond_t *	iocond;     /* a batch was queued or finished */
+	struct pgsql_batch *ioq;        /* batches waiting to be sent */
+	struct pgsql_batch **iotail;
+	struct pgsql_batch *iofree;     /* empty batches */
+	unsigned long		ioqueued;   /* batches queued so far */
+	unsigned long		iodone;     /* newest batch finished with */
+	int					iolost;     /* rows dropped since pgsql_io_wait() */
+	int					ioquit;
+	char *				write_sql;  /* the statement that writes a batch */
+
+	/* schema */
+	int					ids;        /* integer series ids? */
+	struct pgsql_series **series;   /* id cache, see pgsql_series.h */
+	pthread_mutex_t *	slock;      /* protects series and the row counts */
+
+	/* partitioning, see pgsql_part.h */
+	int					part;       /* partition interval */
+	int					part_ahead; /* future partitions to keep ready */
+	int					retention;  /* days of data to keep, 0 for all */
+	time_t				part_check; /* next maintenance run */
+
+	/* rollups, see pgsql_rollup.h */
+	int					rollups[PGSQL_MAX_ROLLUPS];  /* bucket sizes */
+	int					num_rollups;
+
+	/* spool, see pgsql_spool.h */
+	char *				spool;      /* spool directory, NULL for none */
+	int					spool_max;  /* most segments on disk */
+	pthread_mutex_t *	splock;     /* protects the spool */
+	char *				spool_map;  /* segment being appended, mapped */
+	size_t				spool_off;  /* where the next record goes */
+	unsigned long		spool_first;  /* oldest segment */
+	unsigned long		spool_next;   /* number of the next new segment */
+	unsigned long		spool_rows; /* rows waiting in the spool */
+	unsigned long		spooled;    /* rows spooled so far */
+	unsigned long		replayed;   /* rows replayed so far */
+	unsigned long		spool_bad;  /* unreadable segments set aside */
 };
 
+int pgsql_flush(struct nv_stor *s);
+const char *pgsql_data_table(struct nv_stor *s);
+void pgsql_params_init(struct pgsql_params *p);
+void pgsql_param_text(struct pgsql_params *p, const char *v);
+void pgsql_param_int4(struct pgsql_params *p, int32_t v);
+void pgsql_param_int8(struct pgsql_params *p, int64_t v);
+void pgsql_param_float8(struct pgsql_params *p, double v);
+void pgsql_param_time(struct pgsql_params *p, time_t t);
+time_t pgsql_get_time(const char *v);
+double pgsql_get_float8(const char *v);
+
 #endif
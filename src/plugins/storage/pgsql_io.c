@@ -0,0 +1,537 @@
+/***************************************************************************
+*   Copyright (C) 2005 by Robert Timothy Stewart                          *
+*   tims@cc.gatech.edu                                                    *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU General Public License as published by  *
+*   the Free Software Foundation; either version 2 of the License, or     *
+*   (at your option) any later version.                                   *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU General Public License     *
+*   along with this program; if not, write to the                         *
+*   Free Software Foundation, Inc.,                                       *
+*   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+***************************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include <libpq-fe.h>
+#include <pthread.h>
+#include <math.h>
+#include "pgsql.h"
+#include "pgsql_io.h"
+#include "pgsql_series.h"
+#include "pgsql_rollup.h"
+#include "pgsql_spool.h"
+
+static void *pgsql_io_thread(void *arg);
+static struct pgsql_conn *pgsql_io_conn(struct nv_stor *s);
+static void pgsql_io_idle(struct nv_stor *s, struct pgsql_conn *c);
+static int pgsql_io_send(struct nv_stor *s, struct pgsql_conn *c,
+						 struct pgsql_batch *b);
+static int pgsql_io_result(struct nv_stor *s, struct pgsql_conn *c,
+						   int *stored);
+static void pgsql_io_done(struct nv_stor *s, struct pgsql_batch *b,
+						  int stat, int stored);
+static int pgsql_io_params(struct nv_stor *s, struct pgsql_batch *b,
+						   const char **values);
+
+/* where the rows of a batch come from: its parameters, as arrays */
+#define SQL_WRITE_ROWS		"SELECT u.sys, u.dset, to_timestamp(u.t), u.v " \
+							"FROM unnest($1::varchar[], $2::varchar[], " \
+							"            $3::int8[], $4::float8[]) " \
+							"     AS u(sys, dset, t, v)"
+#define SQL_WRITE_ROWS_ID	"SELECT u.id, to_timestamp(u.t), u.v " \
+							"FROM unnest($1::int4[], $2::int8[], " \
+							"            $3::float8[]) AS u(id, t, v)"
+
+/* set up the batches and the statement, and start the I/O thread */
+int pgsql_io_init(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_batch *b = NULL;
+	pthread_attr_t attr;
+	int ret = 0;
+	int i;
+
+	me->write_sql = pgsql_rollup_write(s, me->ids ? SQL_WRITE_ROWS_ID :
+									   SQL_WRITE_ROWS);
+	me->iotail = &me->ioq;
+	for (i = 0; i < PGSQL_IO_BATCHES; i++) {
+		b = nv_calloc(struct pgsql_batch, 1);
+		b->rows = nv_calloc(struct pgsql_row, me->batch);
+		b->next = me->iofree;
+		me->iofree = b;
+	}
+	me->iolock = nv_calloc(pthread_mutex_t, 1);
+	me->iocond = nv_calloc(pthread_cond_t, 1);
+	pthread_mutex_init(me->iolock, NULL);
+	pthread_cond_init(me->iocond, NULL);
+
+	pthread_attr_init(&attr);
+	me->io_thread = nv_calloc(pthread_t, 1);
+	ret = pthread_create(me->io_thread, &attr, pgsql_io_thread, s);
+	if (ret != 0) {
+		nv_perror(NVLOG_ERROR, "pthread_create()", ret);
+		nv_free(me->io_thread);
+		return -1;
+	}
+	return 0;
+}
+
+/* write out everything queued, then stop the I/O thread */
+void pgsql_io_free(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_batch *b = NULL;
+	int i;
+
+	if (me->io_thread != NULL) {
+		nv_lock(me->iolock);
+		me->ioquit = 1;
+		nv_broadcast(me->iocond);
+		nv_unlock(me->iolock);
+		pthread_join(*me->io_thread, NULL);
+		nv_free(me->io_thread);
+	}
+
+	while ((b = me->iofree) != NULL) {
+		me->iofree = b->next;
+		for (i = 0; i < 4; i++) nv_free(b->buf[i]);
+		nv_free(b->rows);
+		nv_free(b);
+	}
+	pthread_mutex_destroy(me->iolock);
+	pthread_cond_destroy(me->iocond);
+	nv_free(me->iolock);
+	nv_free(me->iocond);
+	nv_free(me->write_sql);
+}
+
+/* an empty batch, waiting for the I/O thread to finish one if need be */
+struct pgsql_batch *pgsql_io_get(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_batch *b = NULL;
+
+	nv_lock(me->iolock);
+	while (me->iofree == NULL) {
+		nv_wait(me->iocond, me->iolock);
+	}
+	b = me->iofree;
+	me->iofree = b->next;
+	nv_unlock(me->iolock);
+
+	b->num = 0;
+	b->tries = 0;
+	b->next = NULL;
+	return b;
+}
+
+/* queue a batch for the I/O thread, or give back an empty one */
+void pgsql_io_put(struct nv_stor *s, struct pgsql_batch *b) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	nv_lock(me->iolock);
+	if (b->num > 0) {
+		b->seq = ++me->ioqueued;
+		*me->iotail = b;
+		me->iotail = &b->next;
+	} else {
+		b->next = me->iofree;
+		me->iofree = b;
+	}
+	nv_broadcast(me->iocond);
+	nv_unlock(me->iolock);
+}
+
+/*
+ * Wait until every batch queued so far has been written, spooled or
+ * dropped.  Returns -1 if any were dropped since the last call.
+ */
+int pgsql_io_wait(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	unsigned long seq = 0;
+	int stat = 0;
+
+	nv_lock(me->iolock);
+	seq = me->ioqueued;
+	while (me->iodone < seq) {
+		nv_wait(me->iocond, me->iolock);
+	}
+	if (me->iolost) stat = -1;
+	me->iolost = 0;
+	nv_unlock(me->iolock);
+	return stat;
+}
+
+/*
+ * The I/O thread.  Batches are sent in the order they were queued, as
+ * long as the pipeline has room; then the oldest result is read.  Results
+ * are small, so the server never blocks on them while we are still
+ * sending, and blocking mode is safe here.
+ */
+void *pgsql_io_thread(void *arg) {
+	struct nv_stor *s = (struct nv_stor *)arg;
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_conn *c = NULL;
+	struct pgsql_batch *b = NULL;
+	struct pgsql_batch *sent = NULL;    /* in flight, oldest first */
+	struct pgsql_batch **tail = &sent;
+	int depth = 0;
+	int stored = 0;
+	int ret = 0;
+
+	nv_log(NVLOG_INFO, "%s: storage I/O thread starting", s->name);
+	for (;;) {
+		/* the next batch, if the pipeline has room for it */
+		b = NULL;
+		nv_lock(me->iolock);
+		while (me->ioq == NULL && sent == NULL && !me->ioquit) {
+			nv_wait(me->iocond, me->iolock);
+		}
+		if (me->ioq != NULL && depth < PGSQL_PIPE_DEPTH) {
+			b = me->ioq;
+			me->ioq = b->next;
+			if (me->ioq == NULL) me->iotail = &me->ioq;
+			b->next = NULL;
+		}
+		nv_unlock(me->iolock);
+		if (b == NULL && sent == NULL) break;
+
+		if (b != NULL) {
+			/* given up on, or no connection to send it on */
+			if (b->tries >= PGSQL_IO_TRIES) {
+				nv_log(NVLOG_ERROR, "%s: connection failed under a batch "
+					   "%i times, giving up on it", s->name, b->tries);
+				pgsql_io_done(s, b, -1, 0);
+				continue;
+			}
+			if (c == NULL) c = pgsql_io_conn(s);
+			if (c == NULL) {
+				pgsql_io_done(s, b, -1, 0);
+				continue;
+			}
+
+			ret = pgsql_io_send(s, c, b);
+			if (ret == -1) {
+				pgsql_io_done(s, b, -1, 0);
+				if (sent == NULL) {
+					pgsql_io_idle(s, c);
+					c = NULL;
+				}
+				continue;
+			}
+			*tail = b;
+			tail = &b->next;
+			depth++;
+			if (ret >= 0) continue;
+		} else {
+			/* full, or nothing more to send: the oldest result */
+			ret = pgsql_io_result(s, c, &stored);
+			if (ret != -2) {
+				b = sent;
+				sent = b->next;
+				if (sent == NULL) tail = &sent;
+				depth--;
+				b->next = NULL;
+				pgsql_io_done(s, b, ret, stored);
+				if (sent == NULL) {
+					pgsql_io_idle(s, c);
+					c = NULL;
+				}
+				continue;
+			}
+		}
+
+		/* the connection failed: send what was in flight again, first */
+		nv_log(NVLOG_WARN, "%s: connection lost with %i batches in flight, "
+			   "sending them again", s->name, depth);
+		if (PQstatus(c->conn) == CONNECTION_BAD) {
+			pgsql_pool_release(s, c);
+		} else {
+			pgsql_pool_discard(s, c);
+		}
+		c = NULL;
+		for (b = sent; b != NULL; b = b->next) b->tries++;
+		nv_lock(me->iolock);
+		*tail = me->ioq;
+		if (me->ioq == NULL) me->iotail = tail;
+		me->ioq = sent;
+		nv_unlock(me->iolock);
+		sent = NULL;
+		tail = &sent;
+		depth = 0;
+	}
+	nv_log(NVLOG_INFO, "%s: storage I/O thread stopping", s->name);
+	return NULL;
+}
+
+/*
+ * A write connection, in pipeline mode if we have it.  With a spool and
+ * every connection down, NULL at once: the batch is better off there than
+ * waiting for the repair thread.
+ */
+struct pgsql_conn *pgsql_io_conn(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_conn *c = NULL;
+
+	if (me->spool != NULL && pgsql_pool_down(s)) return NULL;
+	c = pgsql_pool_get(s);
+	if (c == NULL) return NULL;
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQenterPipelineMode(c->conn) != 1) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQerrorMessage(c->conn));
+		pgsql_pool_release(s, c);
+		return NULL;
+	}
+#endif
+	return c;
+}
+
+/* the pipeline has drained: give the connection back */
+void pgsql_io_idle(struct nv_stor *s, struct pgsql_conn *c) {
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQexitPipelineMode(c->conn) != 1) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQerrorMessage(c->conn));
+		pgsql_pool_discard(s, c);
+		return;
+	}
+#endif
+	pgsql_pool_release(s, c);
+}
+
+/*
+ * Send a batch, and a sync after it.  Returns 0 if there is room for
+ * more in the pipeline, 1 if its result has to be read first, -1 if the
+ * batch cannot be sent at all, and -2 if the connection failed.
+ */
+int pgsql_io_send(struct nv_stor *s, struct pgsql_conn *c,
+				  struct pgsql_batch *b) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	const char *values[4];
+	int n = 0;
+
+	n = pgsql_io_params(s, b, values);
+	if (0 > n) return -1;
+	if (PQsendQueryParams(c->conn, me->write_sql, n, NULL, values, NULL,
+						  NULL, 0) != 1) {
+		goto failed;
+	}
+#ifdef LIBPQ_HAS_PIPELINING
+	if (PQpipelineSync(c->conn) != 1) goto failed;
+	return 0;
+#else
+	return 1;
+#endif
+
+failed:
+	nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name, PQerrorMessage(c->conn));
+	return -2;
+}
+
+/*
+ * Read the outcome of the oldest batch in flight: 0 with 'stored' set if
+ * it committed, -1 if the server refused it, -2 if the connection failed
+ * under it.
+ */
+int pgsql_io_result(struct nv_stor *s, struct pgsql_conn *c, int *stored) {
+	PGresult *res = NULL;
+	int stat = -2;
+
+	*stored = 0;
+	res = PQgetResult(c->conn);
+	if (res == NULL) return -2;
+	if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+		*stored = atoi(PQgetvalue(res, 0, 0));
+		stat = 0;
+	} else if (PQstatus(c->conn) != CONNECTION_BAD) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		stat = -1;
+	}
+	PQclear(res);
+
+	/* the end of its results, then the sync that ends the batch */
+	while ((res = PQgetResult(c->conn)) != NULL) PQclear(res);
+#ifdef LIBPQ_HAS_PIPELINING
+	res = PQgetResult(c->conn);
+	if (PQresultStatus(res) != PGRES_PIPELINE_SYNC) stat = -2;
+	PQclear(res);
+#endif
+	if (PQstatus(c->conn) == CONNECTION_BAD) stat = -2;
+	return stat;
+}
+
+/*
+ * A batch is finished with.  Rows that went in are counted, and their
+ * series learn their newest stored time.  Otherwise they go to the spool
+ * if there is one; failing that (or if it is full) they are logged and
+ * counted, then dropped.  The batch goes back on the free list.
+ */
+void pgsql_io_done(struct nv_stor *s, struct pgsql_batch *b, int stat,
+				   int stored) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	int failed = 0;
+
+	if (stat == 0) {
+		if (stored < b->num) {
+			nv_log(NVLOG_DEBUG, "%s: skipped %i rows already stored",
+				   s->name, b->num - stored);
+		}
+		nv_lock(me->slock);
+		me->written += stored;
+		me->skipped += b->num - stored;
+		nv_unlock(me->slock);
+		pgsql_series_stored(s, b->rows, b->num);
+	} else if (me->spool != NULL) {
+		/* keep them on disk until the server is back */
+		failed = pgsql_spool_rows(s, b->rows, b->num);
+		if (failed > 0) {
+			nv_lock(me->slock);
+			me->failed += failed;
+			nv_unlock(me->slock);
+			nv_log(NVLOG_ERROR, "%s: spool full, dropped %i rows (%lu so "
+				   "far)", s->name, failed, me->failed);
+			pgsql_series_lost(s, b->rows + b->num - failed, failed);
+		}
+	} else {
+		failed = b->num;
+		nv_lock(me->slock);
+		me->failed += failed;
+		nv_unlock(me->slock);
+		nv_log(NVLOG_ERROR, "%s: dropped %i rows (%lu so far) from %s/%s "
+			   "onward", s->name, failed, me->failed, b->rows[0].sys,
+			   b->rows[0].dset);
+		pgsql_series_lost(s, b->rows, b->num);
+	}
+
+	nv_lock(me->iolock);
+	if (failed > 0) me->iolost = 1;
+	if (b->seq > me->iodone) me->iodone = b->seq;
+	b->num = 0;
+	b->next = me->iofree;
+	me->iofree = b;
+	nv_broadcast(me->iocond);
+	nv_unlock(me->iolock);
+}
+
+/*
+ * The rows of a batch as the parameters of me->write_sql: one array
+ * literal per column.  Returns the number of parameters, or -1 if a row
+ * has no series id yet (it can go to the spool, whose replay looks it
+ * up).
+ */
+int pgsql_io_params(struct nv_stor *s, struct pgsql_batch *b,
+					const char **values) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_row *r = NULL;
+	char t[32];
+	int n = me->ids ? 3 : 4;
+	int i, k;
+
+	for (k = 0; k < n; k++) b->len[k] = 0;
+	for (i = 0; i < b->num; i++) {
+		r = &b->rows[i];
+		k = 0;
+		if (me->ids) {
+			if (0 > r->id) return -1;
+			snprintf(t, sizeof(t), "%d", r->id);
+			pgsql_array_add(&b->buf[k], &b->len[k], &b->size[k], t, 0);
+			k++;
+		} else {
+			pgsql_array_add(&b->buf[k], &b->len[k], &b->size[k], r->sys, 1);
+			k++;
+			pgsql_array_add(&b->buf[k], &b->len[k], &b->size[k], r->dset, 1);
+			k++;
+		}
+		snprintf(t, sizeof(t), "%ld", (long)r->time);
+		pgsql_array_add(&b->buf[k], &b->len[k], &b->size[k], t, 0);
+		k++;
+
+		/* spelled out, as "-nan" and the like are not float8 input */
+		if (isnan(r->value)) {
+			strcpy(t, "NaN");
+		} else if (isinf(r->value)) {
+			strcpy(t, r->value > 0 ? "Infinity" : "-Infinity");
+		} else {
+			snprintf(t, sizeof(t), "%.17g", r->value);
+		}
+		pgsql_array_add(&b->buf[k], &b->len[k], &b->size[k], t, 0);
+	}
+	for (k = 0; k < n; k++) {
+		pgsql_array_add(&b->buf[k], &b->len[k], &b->size[k], NULL, 0);
+		values[k] = b->buf[k];
+	}
+	return n;
+}
+
+/*
+ * Write rows with the same statement, synchronously and on any write
+ * connection; this is how the spool is replayed.  Rows without a series
+ * id yet (in the "ids" schema) are looked up first.  'stored' says how
+ * many went in.  If there is a spool, gives up rather than wait while
+ * every connection is down.  Returns 0 on success or -1 on error.
+ */
+int pgsql_write_rows(struct nv_stor *s, struct pgsql_row *rows, int num,
+					 int *stored) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_conn *c = NULL;
+	struct pgsql_batch b;
+	PGresult *res = NULL;
+	const char *values[4];
+	int stat = 0;
+	int n = 0;
+	int i;
+
+	*stored = 0;
+	memset(&b, 0, sizeof(b));
+	b.rows = rows;
+	b.num = num;
+	if (me->ids) {
+		for (i = 0; i < num; i++) {
+			if (rows[i].id >= 0) continue;
+			rows[i].id = pgsql_series_id(s, rows[i].sys, rows[i].dset);
+			if (0 > rows[i].id) return -1;
+		}
+	}
+	n = pgsql_io_params(s, &b, values);
+
+retry:
+	if (me->spool != NULL && pgsql_pool_down(s)) {
+		stat = -1;
+		goto cleanup;
+	}
+	c = pgsql_pool_get(s);
+	if (c == NULL) {
+		stat = -1;
+		goto cleanup;
+	}
+	res = PQexecParams(c->conn, me->write_sql, n, NULL, values, NULL, NULL,
+					   0);
+	pgsql_pool_conncheck(s, c, retry);
+	if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+		*stored = atoi(PQgetvalue(res, 0, 0));
+	} else {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		stat = -1;
+	}
+	PQclear(res);
+	pgsql_pool_release(s, c);
+
+cleanup:
+	for (i = 0; i < 4; i++) nv_free(b.buf[i]);
+	return stat;
+}
+
+/* vim: set ts=4 sw=4: */
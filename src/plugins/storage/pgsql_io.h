@@ -0,0 +1,74 @@
+/***************************************************************************
+*   Copyright (C) 2005 by Robert Timothy Stewart                          *
+*   tims@cc.gatech.edu                                                    *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU General Public License as published by  *
+*   the Free Software Foundation; either version 2 of the License, or     *
+*   (at your option) any later version.                                   *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU General Public License     *
+*   along with this program; if not, write to the                         *
+*   Free Software Foundation, Inc.,                                       *
+*   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+***************************************************************************/
+
+
+#ifndef _PLUGINS_PGSQL_IO_H_
+#define _PLUGINS_PGSQL_IO_H_
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include <libpq-fe.h>
+#include "pgsql.h"
+
+/*
+ * Batches are written by a per-instance I/O thread.  A flush hands the
+ * buffered rows over and returns; the thread sends each batch as one
+ * statement (the rows as arrays, inserted with ON CONFLICT DO NOTHING and
+ * folded into the rollups, see pgsql_rollup_write()) followed by a sync,
+ * so each commits or fails on its own.  With libpq's pipeline mode it
+ * keeps up to PGSQL_PIPE_DEPTH batches in flight on its connection and
+ * only then reads the oldest result; without it, one at a time.  The
+ * connection goes back to the pool whenever the pipeline drains.
+ *
+ * Batches are a fixed set, so a flush waits for one to come back when the
+ * server falls behind.  A batch the server refuses goes to the spool, or
+ * is dropped without one.  Batches in flight on a connection that fails
+ * are sent again on another, up to PGSQL_IO_TRIES times.
+ */
+#ifdef LIBPQ_HAS_PIPELINING
+#define PGSQL_PIPE_DEPTH	8
+#else
+#define PGSQL_PIPE_DEPTH	1
+#endif
+#define PGSQL_IO_BATCHES	(2 * PGSQL_PIPE_DEPTH + 2)
+#define PGSQL_IO_TRIES		3
+
+struct pgsql_batch {
+	struct pgsql_row *	rows;
+	int					num;
+	int					tries;      /* connections it has failed on */
+	unsigned long		seq;        /* order in which it was queued */
+	char *				buf[4];     /* the rows as array literals */
+	int					len[4];
+	int					size[4];
+	struct pgsql_batch *next;
+};
+
+int pgsql_io_init(struct nv_stor *s);
+void pgsql_io_free(struct nv_stor *s);
+struct pgsql_batch *pgsql_io_get(struct nv_stor *s);
+void pgsql_io_put(struct nv_stor *s, struct pgsql_batch *b);
+int pgsql_io_wait(struct nv_stor *s);
+int pgsql_write_rows(struct nv_stor *s, struct pgsql_row *rows, int num,
+					 int *stored);
+
+#endif
+
+/* vim: set ts=4 sw=4: */
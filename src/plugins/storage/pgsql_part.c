@@ -0,0 +1,397 @@
+/***************************************************************************
+*   Copyright (C) 2005 by Robert Timothy Stewart                          *
+*   tims@cc.gatech.edu                                                    *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU General Public License as published by  *
+*   the Free Software Foundation; either version 2 of the License, or     *
+*   (at your option) any later version.                                   *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU General Public License     *
+*   along with this program; if not, write to the                         *
+*   Free Software Foundation, Inc.,                                       *
+*   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+***************************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include <libpq-fe.h>
+#include <time.h>
+#include "pgsql.h"
+#include "pgsql_pool.h"
+#include "pgsql_part.h"
+
+static int pgsql_part_maint(struct nv_stor *s, time_t now);
+static int pgsql_part_create(struct nv_stor *s, struct pgsql_conn *c,
+							 time_t start);
+static int pgsql_part_expire(struct nv_stor *s, struct pgsql_conn *c,
+							 time_t cutoff);
+static int pgsql_part_exec(struct nv_stor *s, struct pgsql_conn *c,
+						   char *sql);
+static time_t pgsql_part_floor(time_t t, int part);
+static time_t pgsql_part_next(time_t t, int part);
+
+/* turn a "partition" value into a PGSQL_PART_* interval, or -1 */
+int pgsql_part_parse(const char *value) {
+	if (strncmp(value, "none", NAME_LEN) == 0) return PGSQL_PART_NONE;
+	if (strncmp(value, "daily", NAME_LEN) == 0) return PGSQL_PART_DAY;
+	if (strncmp(value, "weekly", NAME_LEN) == 0) return PGSQL_PART_WEEK;
+	if (strncmp(value, "monthly", NAME_LEN) == 0) return PGSQL_PART_MONTH;
+	return -1;
+}
+
+/*
+ * Check that the data table really is partitioned, make sure the default
+ * partition exists and create the partitions we need now.  A table made
+ * before partitioning was turned on is left alone; moving hundreds of
+ * gigabytes is not something to do behind the administrator's back.
+ */
+#define SQL_IS_PARTITIONED	"SELECT 1 " \
+							"FROM pg_partitioned_table p " \
+							"JOIN pg_class c ON c.oid = p.partrelid " \
+							"WHERE c.relname = $1;"
+#define SQL_CREATE_DEFAULT	"CREATE TABLE IF NOT EXISTS %s_default " \
+							"PARTITION OF %s DEFAULT;"
+int pgsql_part_init(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_conn *c = NULL;
+	struct pgsql_params p;
+	Oid types[] = { VARCHAROID };
+	PGresult *res = NULL;
+	char buf[NAME_LEN];
+	int stat = 0;
+
+	if (me->part == PGSQL_PART_NONE) {
+		if (me->retention > 0) {
+			nv_log(NVLOG_WARN, "%s: retention needs partitioning, "
+				   "ignoring it", s->name);
+		}
+		goto cleanup;
+	}
+
+	pgsql_params_init(&p);
+	pgsql_param_text(&p, pgsql_data_table(s));
+retry:
+	c = pgsql_pool_get(s);
+	if (c == NULL) {
+		stat = -1;
+		goto cleanup;
+	}
+	res = PQexecParams(c->conn, SQL_IS_PARTITIONED, 1, types, p.values,
+					   p.lengths, p.formats, 0);
+	pgsql_pool_conncheck(s, c, retry);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		stat = -1;
+		goto cleanup2;
+	}
+	if (PQntuples(res) < 1) {
+		nv_log(NVLOG_WARN, "%s: %s was created without partitions, "
+			   "leaving it as it is", s->name, pgsql_data_table(s));
+		me->part = PGSQL_PART_NONE;
+		goto cleanup2;
+	}
+
+	snprintf(buf, NAME_LEN, SQL_CREATE_DEFAULT, pgsql_data_table(s),
+			 pgsql_data_table(s));
+	stat = pgsql_part_exec(s, c, buf);
+
+cleanup2:
+	PQclear(res);
+	pgsql_pool_release(s, c);
+	if (stat == 0 && me->part != PGSQL_PART_NONE) {
+		stat = pgsql_part_maint(s, time(NULL));
+		me->part_check = time(NULL) + PGSQL_PART_CHECK;
+	}
+
+cleanup:
+	return stat;
+}
+
+/*
+ * Ready a new, empty partitioned data table for the rows of the old table
+ * 'from', in the migration's transaction on 'c'.  Rows from before the
+ * current partition go to the default partition; the partitions from the
+ * current one up to the newest row are made now, so those rows need not
+ * be moved out of the default again later.
+ */
+#define SQL_NEWEST_ROW		"SELECT COALESCE(EXTRACT(epoch FROM " \
+							"    max(time)), 0) FROM %s;"
+int pgsql_part_prepare(struct nv_stor *s, struct pgsql_conn *c,
+					   const char *from) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	PGresult *res = NULL;
+	char buf[NAME_LEN];
+	time_t start = 0;
+	time_t last = 0;
+
+	snprintf(buf, NAME_LEN, SQL_CREATE_DEFAULT, pgsql_data_table(s),
+			 pgsql_data_table(s));
+	if (0 > pgsql_part_exec(s, c, buf)) return -1;
+
+	snprintf(buf, NAME_LEN, SQL_NEWEST_ROW, from);
+	res = PQexec(c->conn, buf);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) < 1) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		PQclear(res);
+		return -1;
+	}
+	last = (time_t)atof(PQgetvalue(res, 0, 0));
+	PQclear(res);
+
+	for (start = pgsql_part_floor(time(NULL), me->part); start <= last;
+		 start = pgsql_part_next(start, me->part)) {
+		if (0 > pgsql_part_create(s, c, start)) return -1;
+	}
+	return 0;
+}
+
+/*
+ * Called from the storage heartbeat: every so often, create the coming
+ * partitions and drop the ones that have aged out.
+ */
+int pgsql_part_beat(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	time_t now = time(NULL);
+
+	if (me->part == PGSQL_PART_NONE || now < me->part_check) return 0;
+	me->part_check = now + PGSQL_PART_CHECK;
+	return pgsql_part_maint(s, now);
+}
+
+/* make sure the current and the next part_ahead partitions exist */
+int pgsql_part_maint(struct nv_stor *s, time_t now) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_conn *c = NULL;
+	time_t start = 0;
+	int stat = 0;
+	int i;
+
+	c = pgsql_pool_get(s);
+	if (c == NULL) return -1;
+
+	start = pgsql_part_floor(now, me->part);
+	for (i = 0; i <= me->part_ahead; i++) {
+		if (0 > pgsql_part_create(s, c, start)) stat = -1;
+		start = pgsql_part_next(start, me->part);
+	}
+	if (me->retention > 0) {
+		if (0 > pgsql_part_expire(s, c, now - me->retention * 86400)) {
+			stat = -1;
+		}
+	}
+
+	pgsql_pool_release(s, c);
+	return stat;
+}
+
+/*
+ * Create the partition starting at 'start', if it is not there yet.  Rows
+ * for its range may be in the default partition already (they came in
+ * ahead of it), and the server will not attach a partition over them.  So
+ * the table is made on its own, those rows are moved into it and only
+ * then is it attached, all in one transaction: the caller's if it has one
+ * open (the migration's), otherwise our own.
+ */
+#define SQL_PART_EXISTS		"SELECT 1 FROM pg_class WHERE relname = $1;"
+#define SQL_CREATE_PART		"CREATE TABLE %s ( LIKE %s INCLUDING DEFAULTS );"
+#define SQL_MOVE_DEFAULT	"WITH moved AS ( " \
+							"    DELETE FROM %s_default " \
+							"    WHERE time >= '%s' AND time < '%s' " \
+							"    RETURNING *) " \
+							"INSERT INTO %s SELECT * FROM moved;"
+#define SQL_ATTACH_PART		"ALTER TABLE %s ATTACH PARTITION %s " \
+							"FOR VALUES FROM ('%s') TO ('%s');"
+int pgsql_part_create(struct nv_stor *s, struct pgsql_conn *c,
+					  time_t start) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	const char *table = pgsql_data_table(s);
+	time_t end = pgsql_part_next(start, me->part);
+	struct pgsql_params p;
+	Oid types[] = { VARCHAROID };
+	PGresult *res = NULL;
+	char name[NAME_LEN];
+	char buf[4*NAME_LEN];
+	char day[16];
+	char from[32];
+	char to[32];
+	struct tm tm;
+	int own = 0;
+	int stat = 0;
+
+	gmtime_r(&start, &tm);
+	strftime(day, sizeof(day), "%Y%m%d", &tm);
+	strftime(from, sizeof(from), "%Y-%m-%d 00:00:00+00", &tm);
+	gmtime_r(&end, &tm);
+	strftime(to, sizeof(to), "%Y-%m-%d 00:00:00+00", &tm);
+	snprintf(name, sizeof(name), "%s_%c%s", table, me->part, day);
+
+	pgsql_params_init(&p);
+	pgsql_param_text(&p, name);
+	res = PQexecParams(c->conn, SQL_PART_EXISTS, 1, types, p.values,
+					   p.lengths, p.formats, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		PQclear(res);
+		return -1;
+	}
+	if (PQntuples(res) > 0) {
+		PQclear(res);
+		return 0;
+	}
+	PQclear(res);
+
+	if (PQtransactionStatus(c->conn) == PQTRANS_IDLE) {
+		if (0 > pgsql_part_exec(s, c, "BEGIN;")) return -1;
+		own = 1;
+	}
+	snprintf(buf, sizeof(buf), SQL_CREATE_PART, name, table);
+	stat = pgsql_part_exec(s, c, buf);
+	if (stat == 0) {
+		snprintf(buf, sizeof(buf), SQL_MOVE_DEFAULT, table, from, to, name);
+		stat = pgsql_part_exec(s, c, buf);
+	}
+	if (stat == 0) {
+		snprintf(buf, sizeof(buf), SQL_ATTACH_PART, table, name, from, to);
+		stat = pgsql_part_exec(s, c, buf);
+	}
+	if (own) {
+		if (stat == 0) {
+			stat = pgsql_part_exec(s, c, "COMMIT;");
+		} else {
+			pgsql_part_exec(s, c, "ROLLBACK;");
+		}
+	}
+	return stat;
+}
+
+/*
+ * Drop every partition that ends before 'cutoff', and clear the same
+ * range out of the default partition.
+ */
+#define SQL_LIST_PARTS		"SELECT c.relname " \
+							"FROM pg_inherits i " \
+							"JOIN pg_class c ON c.oid = i.inhrelid " \
+							"JOIN pg_class p ON p.oid = i.inhparent " \
+							"WHERE p.relname = $1;"
+#define SQL_DROP_PART		"DROP TABLE IF EXISTS %s;"
+#define SQL_EXPIRE_DEFAULT	"DELETE FROM %s_default " \
+							"WHERE time < to_timestamp(%ld);"
+int pgsql_part_expire(struct nv_stor *s, struct pgsql_conn *c,
+					  time_t cutoff) {
+	const char *table = pgsql_data_table(s);
+	size_t len = strlen(table);
+	struct pgsql_params p;
+	Oid types[] = { VARCHAROID };
+	PGresult *res = NULL;
+	char buf[2*NAME_LEN];
+	int stat = 0;
+	int row = 0;
+	int rownum = 0;
+
+	pgsql_params_init(&p);
+	pgsql_param_text(&p, table);
+	res = PQexecParams(c->conn, SQL_LIST_PARTS, 1, types, p.values,
+					   p.lengths, p.formats, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		stat = -1;
+		goto cleanup;
+	}
+
+	rownum = PQntuples(res);
+	for (row = 0; row < rownum; row++) {
+		char *name = PQgetvalue(res, row, 0);
+		struct tm tm;
+		char part;
+		time_t start;
+
+		/* only touch the partitions we made: <table>_<d|w|m>YYYYMMDD */
+		memset(&tm, 0, sizeof(tm));
+		if (strncmp(name, table, len) != 0 || name[len] != '_' ||
+			sscanf(name+len+1, "%c%4d%2d%2d", &part, &tm.tm_year,
+				   &tm.tm_mon, &tm.tm_mday) != 4) {
+			continue;
+		}
+		if (part != PGSQL_PART_DAY && part != PGSQL_PART_WEEK &&
+			part != PGSQL_PART_MONTH) {
+			continue;
+		}
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		start = timegm(&tm);
+		if (pgsql_part_next(start, part) > cutoff) continue;
+
+		nv_log(NVLOG_INFO, "%s: dropping expired partition %s", s->name,
+			   name);
+		snprintf(buf, sizeof(buf), SQL_DROP_PART, name);
+		if (0 > pgsql_part_exec(s, c, buf)) stat = -1;
+	}
+
+	snprintf(buf, sizeof(buf), SQL_EXPIRE_DEFAULT, table, (long)cutoff);
+	if (0 > pgsql_part_exec(s, c, buf)) stat = -1;
+
+cleanup:
+	PQclear(res);
+	return stat;
+}
+
+/* run a statement that returns no rows */
+int pgsql_part_exec(struct nv_stor *s, struct pgsql_conn *c, char *sql) {
+	PGresult *res = NULL;
+	int stat = 0;
+
+	res = PQexec(c->conn, sql);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		stat = -1;
+	}
+	PQclear(res);
+	return stat;
+}
+
+/* the start of the partition holding 't'; weeks start on Monday */
+time_t pgsql_part_floor(time_t t, int part) {
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	if (part == PGSQL_PART_WEEK) {
+		tm.tm_mday -= (tm.tm_wday + 6) % 7;
+	} else if (part == PGSQL_PART_MONTH) {
+		tm.tm_mday = 1;
+	}
+	return timegm(&tm);
+}
+
+/* the start of the partition after the one starting at 't' */
+time_t pgsql_part_next(time_t t, int part) {
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	if (part == PGSQL_PART_WEEK) {
+		tm.tm_mday += 7;
+	} else if (part == PGSQL_PART_MONTH) {
+		tm.tm_mon += 1;
+	} else {
+		tm.tm_mday += 1;
+	}
+	return timegm(&tm);
+}
+
+/* vim: set ts=4 sw=4: */
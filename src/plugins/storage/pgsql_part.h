@@ -0,0 +1,52 @@
+/***************************************************************************
+*   Copyright (C) 2005 by Robert Timothy Stewart                          *
+*   tims@cc.gatech.edu                                                    *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU General Public License as published by  *
+*   the Free Software Foundation; either version 2 of the License, or     *
+*   (at your option) any later version.                                   *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU General Public License     *
+*   along with this program; if not, write to the                         *
+*   Free Software Foundation, Inc.,                                       *
+*   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+***************************************************************************/
+
+
+#ifndef _PLUGINS_PGSQL_PART_H_
+#define _PLUGINS_PGSQL_PART_H_
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include "pgsql.h"
+
+/*
+ * The data table can be split into native range partitions on time.  The
+ * partitions are named after the interval and the day they start on, e.g.
+ * nv_dsts_data_d20051017, so retention can tell how far each one reaches
+ * without asking the server.  Rows that fall outside every partition land
+ * in <table>_default, and move out of it when their partition is made.
+ */
+#define PGSQL_PART_NONE		0
+#define PGSQL_PART_DAY		'd'
+#define PGSQL_PART_WEEK		'w'
+#define PGSQL_PART_MONTH	'm'
+
+#define PGSQL_PART_AHEAD	3		/* default partitions to keep ready */
+#define PGSQL_PART_CHECK	3600	/* seconds between maintenance runs */
+
+int pgsql_part_parse(const char *value);
+int pgsql_part_init(struct nv_stor *s);
+int pgsql_part_prepare(struct nv_stor *s, struct pgsql_conn *c,
+					   const char *from);
+int pgsql_part_beat(struct nv_stor *s);
+
+#endif
+
+/* vim: set ts=4 sw=4: */
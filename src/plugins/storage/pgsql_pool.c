@@ -23,50 +23,79 @@
 #endif
 
 #include <netvizd.h>
-#include <nvlist.h>
 #include <nvconfig.h>
 #include <libpq-fe.h>
 #include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
 #include "pgsql.h"
 #include "pgsql_pool.h"
 
 static void *pgsql_pool_thread(void *arg);
 static void *pgsql_pool_logthread(void *arg);
-static PGconn *pgsql_connect(struct nv_stor *s);
+static struct pgsql_conn *pgsql_pool_take(struct nv_stor *s,
+										  struct pgsql_pool *p, int wait);
+static PGconn *pgsql_connect(struct nv_stor *s, struct pgsql_pool *p);
 static void pgsql_disconnect(PGconn *c);
-static void pgsql_pool_status(struct nv_stor *s, int level);
+static void pgsql_pool_status(struct pgsql_pool *p, int level);
+static void pgsql_pool_push(struct pgsql_pool *p, struct pgsql_conn *c);
+static struct pgsql_conn *pgsql_pool_pop(struct pgsql_pool *p);
+static int pgsql_pool_empty(struct pgsql_pool *p);
+static void pgsql_pool_bad(struct nv_stor *s, struct pgsql_conn *c);
+static void pgsql_pool_start(struct nv_stor *s, struct pgsql_conn *c,
+							 long now);
+static void pgsql_pool_failed(struct nv_stor *s, struct pgsql_conn *c,
+							  long now, const char *why);
+static long pgsql_pool_msec(void);
 
-int pgsql_pool_init(struct nv_stor *s, int num) {
-	struct pgsql_data *me = NULL;
+#define pool_inc(x)		__atomic_add_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define pool_dec(x)		__atomic_sub_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define pool_load(x)	__atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define pool_store(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+
+/*
+ * Start a pool of 'num' connections to host:port.  'name' goes in front
+ * of everything the pool logs.
+ */
+int pgsql_pool_init(struct nv_stor *s, struct pgsql_pool *p,
+					const char *name, char *host, int port, int num) {
 	int ret = 0;
+	int i;
 	pthread_attr_t attr;
 	
-	me = (struct pgsql_data *)s->data;
-	
+	p->stor = s;
+	name_copy(p->name, name);
+	p->host = host;
+	p->port = port;
+
 	/* initialize the locks and condition variables */
-	me->pool.bad_lock = nv_calloc(pthread_mutex_t, 1);
-	me->pool.free_lock = nv_calloc(pthread_mutex_t, 1);
-	me->pool.inuse_lock = nv_calloc(pthread_mutex_t, 1);
-	me->pool.free_avail = nv_calloc(pthread_cond_t, 1);
-	me->pool.bad_avail = nv_calloc(pthread_cond_t, 1);
-	pthread_mutex_init(me->pool.bad_lock, NULL);
-	pthread_mutex_init(me->pool.free_lock, NULL);
-	pthread_mutex_init(me->pool.inuse_lock, NULL);
-	pthread_cond_init(me->pool.free_avail, NULL);
-	pthread_cond_init(me->pool.bad_avail, NULL);
-	
-	/* init pool lists */
-	nv_list_new(me->pool.bad);
-	nv_list_new(me->pool.free);
-	nv_list_new(me->pool.inuse);
+	p->bad_lock = nv_calloc(pthread_mutex_t, 1);
+	p->free_lock = nv_calloc(pthread_mutex_t, 1);
+	p->free_avail = nv_calloc(pthread_cond_t, 1);
+	p->bad_avail = nv_calloc(pthread_cond_t, 1);
+	pthread_mutex_init(p->bad_lock, NULL);
+	pthread_mutex_init(p->free_lock, NULL);
+	pthread_cond_init(p->free_avail, NULL);
+	pthread_cond_init(p->bad_avail, NULL);
 	
-	/* save num */
-	me->pool.num = num;
+	/* every slot starts out bad, and the repair thread connects them */
+	p->num = num;
+	p->slots = nv_calloc(struct pgsql_conn, num);
+	for (i = 0; i < num; i++) {
+		p->slots[i].id = i;
+		p->slots[i].pool = p;
+		p->slots[i].state = PGSQL_SLOT_BAD;
+	}
+	p->free_top = 0;
+	p->free_num = 0;
+	p->inuse_num = 0;
+	p->bad_num = num;
 	
 	/* start up our pool management thread */
 	pthread_attr_init(&attr);
-	me->pool.thread = nv_calloc(pthread_t, 1);
-	ret = pthread_create(me->pool.thread, &attr, pgsql_pool_thread, s);
+	p->thread = nv_calloc(pthread_t, 1);
+	ret = pthread_create(p->thread, &attr, pgsql_pool_thread, p);
 	if (ret != 0) {
 		nv_perror(NVLOG_ERROR, "pthread_create()", ret);
 		return EXIT_FAILURE;
@@ -74,8 +103,8 @@ int pgsql_pool_init(struct nv_stor *s, int num) {
 	
 	/* start up logging thread */
 	pthread_attr_init(&attr);
-	me->pool.logthread = nv_calloc(pthread_t, 1);
-	ret = pthread_create(me->pool.logthread, &attr, pgsql_pool_logthread, s);
+	p->logthread = nv_calloc(pthread_t, 1);
+	ret = pthread_create(p->logthread, &attr, pgsql_pool_logthread, p);
 	if (ret != 0) {
 		nv_perror(NVLOG_ERROR, "pthread_create()", ret);
 		return EXIT_FAILURE;
@@ -84,377 +113,494 @@ int pgsql_pool_init(struct nv_stor *s, int num) {
 	return 0;
 }
 
-int pgsql_pool_free(struct nv_stor *s) {
-	struct pgsql_data *me = NULL;
-	PGconn *conn = NULL;
-	nv_node i;
-	
-	me = (struct pgsql_data *)s->data;
-	
+int pgsql_pool_free(struct nv_stor *s, struct pgsql_pool *p) {
+	(void)s;
+
 	/* indicate that we are to shut down the pool */
-	me->pool.quit = 1;
+	p->quit = 1;
 	
 	/* wait for shutdown */
-	pthread_join(*me->pool.thread, NULL);
-	pthread_join(*me->pool.logthread, NULL);
+	pthread_join(*p->thread, NULL);
+	pthread_join(*p->logthread, NULL);
+	return 0;
 }
 
+/*
+ * The repair thread.  Every bad slot is reconnected at once: each gets a
+ * non-blocking connection attempt, and one poll() loop drives them all,
+ * so capacity comes back as soon as the server takes connections.  A
+ * slot whose attempt fails waits an exponentially growing, jittered
+ * time (capped at rtimeout) before trying again, so a dead server is not
+ * hammered in lockstep.
+ */
 static void *pgsql_pool_thread(void *arg) {
+	struct pgsql_pool *p = NULL;
 	struct nv_stor *s = NULL;
 	struct pgsql_data *me = NULL;
-	nv_node n;
-	nv_node j;
-	int i = 0;
-	int ret = 0;
 	struct pgsql_conn *c = NULL;
+	struct pollfd *fds = NULL;
+	struct pgsql_conn **polled = NULL;
 	struct timespec timeout;
+	long now = 0;
+	long wait = 0;
+	int nfds = 0;
 	int fail_report = 0;
 	int init_report = 0;
-	char *buf = NULL;
+	int i = 0;
 	
 	/* get typed pointers to our data */
-	s = (struct nv_stor *)arg;
+	p = (struct pgsql_pool *)arg;
+	s = p->stor;
 	me = (struct pgsql_data *)s->data;
+	fds = nv_calloc(struct pollfd, p->num);
+	polled = nv_calloc(struct pgsql_conn *, p->num);
 
-	/* grab the pool lock and set default counters */
-	nv_lock(me->pool.free_lock);
-	me->pool.free_num = 0;
-	nv_unlock(me->pool.free_lock);
-	nv_lock(me->pool.inuse_lock);
-	me->pool.inuse_num = 0;
-	nv_unlock(me->pool.inuse_lock);
-	nv_lock(me->pool.bad_lock);
-	me->pool.bad_num = 0;
-	nv_unlock(me->pool.bad_lock);
-	
-	/* initialize the pool via the bad list */
-	nv_lock(me->pool.bad_lock);
-	for (i = 0; i < me->pool.num; i++) {
-		nv_node_new(n);
-		c = nv_calloc(struct pgsql_conn, 1);
-		c->node = n;
-		c->id = i;
-		set_node_data(n, c);
-		list_append(me->pool.bad, n);
-		me->pool.bad_num++;
-	}
-	nv_broadcast(me->pool.bad_avail);
-	nv_unlock(me->pool.bad_lock);
-	
 	/* begin connection repair */
-	nv_log(NVLOG_INFO, "%s: pool repair thread starting", s->name);
+	nv_log(NVLOG_INFO, "%s: pool repair thread starting", p->name);
 	for (;;) {
 		/* wait for there to be bad connections */
-		nv_lock(me->pool.bad_lock);
-		while (me->pool.bad_num == 0) {
+		nv_lock(p->bad_lock);
+		while (pool_load(p->bad_num) == 0) {
 			timeout.tv_sec = time(NULL) + 1;
 			timeout.tv_nsec = 0;
-			nv_timedwait(me->pool.bad_avail, me->pool.bad_lock, &timeout) {
-				if (me->pool.quit) {
-					nv_unlock(me->pool.bad_lock);
-					goto cleanup;
+			nv_timedwait(p->bad_avail, p->bad_lock, &timeout) {
+				if (p->quit) break;
+			}
+		}
+		nv_unlock(p->bad_lock);
+		if (p->quit) goto cleanup;
+
+		/* start attempts for the bad slots that are due, and collect the
+		 * ones in progress */
+		now = pgsql_pool_msec();
+		wait = 1000;
+		nfds = 0;
+		for (i = 0; i < p->num; i++) {
+			c = &p->slots[i];
+			if (pool_load(c->state) != PGSQL_SLOT_BAD) continue;
+
+			if (!c->connecting && now >= c->retry_at) {
+				if (c->conn == NULL) {
+					if (!init_report && !fail_report) {
+						nv_log(NVLOG_INFO, "%s: starting pool initialization",
+							   p->name);
+						init_report = 1;
+					}
+				} else if (!fail_report && !init_report) {
+					nv_log(NVLOG_WARN, "%s: failed connections exist in pool, "
+						   "reconnecting with up to %i seconds between "
+						   "attempts", p->name, me->rtimeout);
+					fail_report = 1;
 				}
+				pgsql_pool_start(s, c, now);
+			}
+			if (c->connecting && now >= c->deadline) {
+				pgsql_pool_failed(s, c, now, "timed out");
+			}
+
+			if (c->connecting) {
+				fds[nfds].fd = PQsocket(c->conn);
+				fds[nfds].events = c->poll == PGRES_POLLING_READING ?
+								   POLLIN : POLLOUT;
+				fds[nfds].revents = 0;
+				polled[nfds++] = c;
+			} else if (c->retry_at - now < wait) {
+				wait = c->retry_at - now;
 			}
 		}
+		if (wait < 0) wait = 0;
 
-		/* pull first node out and release bad lock */
-		n = me->pool.bad->next;
-		c = node_data(struct pgsql_conn, n);
-		list_del(n);
-		me->pool.bad_num--;
-		nv_unlock(me->pool.bad_lock);
-
-		/* try to reconnect to the database */
-retry:
-		if (me->pool.quit) goto cleanup;
-		if (NULL == c->conn) {
-			/* new connection, never before initialized */
-			if (!init_report && !fail_report) {
-				nv_log(NVLOG_INFO, "%s: starting pool initialization", s->name);
-				init_report = 1;
+		/* drive whichever attempts can make progress */
+		if (0 > poll(fds, nfds, (int)wait)) {
+			if (errno != EINTR) {
+				nv_perror(NVLOG_ERROR, "poll()", errno);
 			}
-			nv_log(NVLOG_DEBUG, "%s: attempting a new connection", s->name);
-			c->conn = pgsql_connect(s);
-		} else {
-			/* this connection needs repair */
-			if (!fail_report && !init_report) {
-				nv_log(NVLOG_WARN, "%s: failed connections exist in pool, "
-					   "running repair attempts every %i seconds", s->name,
-					   me->rtimeout);
-				fail_report = 1;
+			continue;
+		}
+		now = pgsql_pool_msec();
+		for (i = 0; i < nfds; i++) {
+			c = polled[i];
+			if (fds[i].revents == 0) continue;
+
+			c->poll = PQconnectPoll(c->conn);
+			if (c->poll == PGRES_POLLING_OK) {
+				nv_log(NVLOG_DEBUG, "%s: connection id %i successful",
+					   p->name, c->id);
+				c->connecting = 0;
+				c->backoff = 0;
+				pool_dec(p->bad_num);
+				pgsql_pool_push(p, c);
+			} else if (c->poll == PGRES_POLLING_FAILED) {
+				pgsql_pool_failed(s, c, now, PQerrorMessage(c->conn));
 			}
-			nv_log(NVLOG_DEBUG, "%s: attempting a connection reset", s->name);
-			PQreset(c->conn);
 		}
-		if (me->pool.quit) goto cleanup;
-		
-		/* did the connection succeed?  If not, retry */
-		switch (PQstatus(c->conn)) {
-			case CONNECTION_OK:
-				nv_log(NVLOG_DEBUG, "%s: connection id %i successful", s->name,
-					   c->id);
-				if (fail_report && me->pool.bad_num == 0) {
-					nv_log(NVLOG_WARN, "%s: all connections in pool are up, "
-						   "finished with repair", s->name);
-					fail_report = 0;
-				} else if (init_report && me->pool.bad_num == 0) {
-					nv_log(NVLOG_INFO, "%s: all connections in pool are up, "
-						   "finished with pool initialization", s->name);
-					init_report = 0;
-				}
-				/* do nothing */
-				break;
-				
-			case CONNECTION_BAD:
-				buf = strdup(PQerrorMessage(c->conn));
-				buf[strlen(buf)-1] = '\0';
-				nv_log(NVLOG_DEBUG, "%s: connection failed: %s", s->name, buf);
-				free(buf);
-				nv_log(NVLOG_DEBUG, "%s: database connection id %i failed, "
-					   "resuming repair in %i seconds", s->name, c->id,
-					   me->rtimeout);
-				sleep(me->rtimeout);
-				goto retry;
-				break;
+
+		if (pool_load(p->bad_num) == 0) {
+			if (fail_report) {
+				nv_log(NVLOG_WARN, "%s: all connections in pool are up, "
+					   "finished with repair", p->name);
+			} else if (init_report) {
+				nv_log(NVLOG_INFO, "%s: all connections in pool are up, "
+					   "finished with pool initialization", p->name);
+			}
+			fail_report = 0;
+			init_report = 0;
 		}
-		
-		/* we should now have a good connection, add to free list */
-		n = nv_node_new(n);
-		c->node = n;
-		set_node_data(n, c);
-		nv_lock(me->pool.free_lock);
-		me->pool.free_num++;
-		list_append(me->pool.free, n);
-		nv_signal(me->pool.free_avail);
-		nv_unlock(me->pool.free_lock);
 	}
 
 cleanup:
-	nv_log(NVLOG_INFO, "%s: pool repair thread stopping", s->name);
+	nv_log(NVLOG_INFO, "%s: pool repair thread stopping", p->name);
 
 	/* release our connections */
-	nv_lock(me->pool.free_lock);
-	list_for_each(j, me->pool.free) {
-		c = node_data(struct pgsql_conn, j);
-		if (c->conn) pgsql_disconnect(c->conn);
-		me->pool.free_num--;
-	}
-	nv_unlock(me->pool.free_lock);
-	nv_lock(me->pool.inuse_lock);
-	list_for_each(j, me->pool.inuse) {
-		c = node_data(struct pgsql_conn, j);
-		if (c->conn) pgsql_disconnect(c->conn);
-		me->pool.inuse_num--;
-	}
-	nv_unlock(me->pool.inuse_lock);
-	nv_lock(me->pool.bad_lock);
-	list_for_each(j, me->pool.bad) {
-		c = node_data(struct pgsql_conn, j);
+	for (i = 0; i < p->num; i++) {
+		c = &p->slots[i];
 		if (c->conn) pgsql_disconnect(c->conn);
-		me->pool.bad_num--;
+		c->conn = NULL;
 	}
-	nv_unlock(me->pool.bad_lock);
+	nv_free(fds);
+	nv_free(polled);
 	
 	/* free the locks and condition variables */
-	pthread_mutex_destroy(me->pool.bad_lock);
-	pthread_mutex_destroy(me->pool.free_lock);
-	pthread_mutex_destroy(me->pool.inuse_lock);
-	pthread_cond_destroy(me->pool.free_avail);
-	pthread_cond_destroy(me->pool.bad_avail);
-	nv_free(me->pool.bad_lock);
-	nv_free(me->pool.free_lock);
-	nv_free(me->pool.inuse_lock);
-	nv_free(me->pool.free_avail);
-	nv_free(me->pool.bad_avail);
-	
-	/* free lists */
-	nv_free(me->pool.bad);
-	nv_free(me->pool.free);
-	nv_free(me->pool.inuse);
+	pthread_mutex_destroy(p->bad_lock);
+	pthread_mutex_destroy(p->free_lock);
+	pthread_cond_destroy(p->free_avail);
+	pthread_cond_destroy(p->bad_avail);
+	nv_free(p->bad_lock);
+	nv_free(p->free_lock);
+	nv_free(p->free_avail);
+	nv_free(p->bad_avail);
 	
 	return NULL;
 }
 
+/* begin a non-blocking connection attempt for a bad slot */
+void pgsql_pool_start(struct nv_stor *s, struct pgsql_conn *c, long now) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	if (c->conn) pgsql_disconnect(c->conn);
+	c->conn = pgsql_connect(s, c->pool);
+	if (c->conn == NULL || PQstatus(c->conn) == CONNECTION_BAD) {
+		pgsql_pool_failed(s, c, now, c->conn ? PQerrorMessage(c->conn) :
+						  "out of memory");
+		return;
+	}
+	c->connecting = 1;
+	c->poll = PGRES_POLLING_WRITING;
+	c->deadline = now + 1000L * me->ctimeout;
+}
+
+/*
+ * An attempt failed: back off.  The delay doubles from PGSQL_BACKOFF_MIN
+ * up to rtimeout seconds, and the slot waits a random time between half
+ * of it and all of it.
+ */
+void pgsql_pool_failed(struct nv_stor *s, struct pgsql_conn *c, long now,
+					   const char *why) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	char buf[NAME_LEN];
+	long max = 1000L * me->rtimeout;
+	size_t len = 0;
+
+	c->connecting = 0;
+	if (c->backoff == 0) {
+		c->backoff = PGSQL_BACKOFF_MIN;
+	} else {
+		c->backoff *= 2;
+	}
+	if (c->backoff > max) c->backoff = max;
+	c->retry_at = now + c->backoff / 2 + random() % (c->backoff / 2 + 1);
+
+	/* the first line of libpq's message is enough */
+	len = strcspn(why, "\n");
+	if (len >= NAME_LEN) len = NAME_LEN-1;
+	memcpy(buf, why, len);
+	buf[len] = '\0';
+	nv_log(NVLOG_DEBUG, "%s: database connection id %i failed (%s), "
+		   "retrying in %li ms", c->pool->name, c->id, buf,
+		   c->retry_at - now);
+}
+
+/* a monotonic clock in milliseconds */
+long pgsql_pool_msec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* a connection to the primary, for anything that writes */
 struct pgsql_conn *pgsql_pool_get(struct nv_stor *s) {
-	struct pgsql_data *me = NULL;
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	return pgsql_pool_take(s, &me->pool, 1);
+}
+
+/*
+ * A connection for reading.  It comes from the read pool if there is one,
+ * unless every connection in it is broken or the replica it talks to has
+ * fallen behind (see pgsql_pool_lag()); then the primary has to do.
+ * As pgsql_pool_take(), waits for a free one only if 'wait' is set.
+ */
+struct pgsql_conn *pgsql_pool_get_read(struct nv_stor *s, int wait) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	if (me->rpool.num > 0 && !pool_load(me->rpool.behind) &&
+		!pgsql_pool_empty(&me->rpool)) {
+		return pgsql_pool_take(s, &me->rpool, wait);
+	}
+	return pgsql_pool_take(s, &me->pool, wait);
+}
+
+/*
+ * Check a connection out of a pool, sleeping until one is free if 'wait'
+ * is set; otherwise NULL if none is.
+ */
+struct pgsql_conn *pgsql_pool_take(struct nv_stor *s, struct pgsql_pool *p,
+								   int wait) {
 	struct pgsql_conn *c = NULL;
-	nv_node n;
 	struct timespec timeout;
 	
-	me = (struct pgsql_data *)s->data;
-	
 	/* check and see if we're invalid at this point */
-	if (me->pool.quit) goto cleanup;
+	if (p->quit) goto cleanup;
 	
-	/* wait for a connection to become available and grab one */
-retry:
-	nv_lock(me->pool.free_lock);
-	while (me->pool.free_num == 0) {
-		nv_log(NVLOG_DEBUG, "%s: no free connections in pool, waiting...",
-			   s->name);
-		timeout.tv_sec = time(NULL) + 1;
-		timeout.tv_nsec = 0;
-		nv_timedwait(me->pool.free_avail, me->pool.free_lock, &timeout) {
-			if (me->pool.quit) {
-				nv_unlock(me->pool.free_lock);
-				goto cleanup;
+	/* grab a free connection, sleeping only if there are none */
+	for (;;) {
+		c = pgsql_pool_pop(p);
+		if (c != NULL) {
+			if (PQstatus(c->conn) != CONNECTION_BAD) break;
+			pgsql_pool_bad(s, c);
+			continue;
+		}
+		if (!wait) goto cleanup;
+
+		nv_lock(p->free_lock);
+		pool_inc(p->waiters);
+		while ((pool_load(p->free_top) & 0xffffffff) == 0) {
+			nv_log(NVLOG_DEBUG, "%s: no free connections in pool, "
+				   "waiting...", p->name);
+			timeout.tv_sec = time(NULL) + 1;
+			timeout.tv_nsec = 0;
+			nv_timedwait(p->free_avail, p->free_lock, &timeout) {
+				if (p->quit) break;
 			}
 		}
+		pool_dec(p->waiters);
+		nv_unlock(p->free_lock);
+		if (p->quit) goto cleanup;
 	}
-	n = me->pool.free->next;
-	c = node_data(struct pgsql_conn, n);
-	list_del(n);
-	me->pool.free_num--;
-	nv_unlock(me->pool.free_lock);
-	
-	/* check the connection status */
-	if (PQstatus(c->conn) == CONNECTION_BAD) {
-		/* add to bad list */
-		nv_node_new(n);
-		c->node = n;
-		set_node_data(n, c);
-		nv_lock(me->pool.bad_lock);
-		list_append(me->pool.bad, n);
-		me->pool.bad_num++;
-		nv_signal(me->pool.bad_avail);
-		nv_unlock(me->pool.bad_lock);
-		
-		nv_log(NVLOG_DEBUG, "%s: marked connection id %i bad", s->name, c->id);
-		goto retry;
-	}
-	
-	/* move to the inuse list */
-	nv_node_new(n);
-	c->node = n;
-	set_node_data(n, c);
-	nv_lock(me->pool.inuse_lock);
-	list_append(me->pool.inuse, n);
-	me->pool.inuse_num++;
-	nv_unlock(me->pool.inuse_lock);
-	
-	nv_log(NVLOG_DEBUG, "%s: grabbed connection id %i", s->name, c->id);
+	pool_store(c->state, PGSQL_SLOT_INUSE);
+	pool_inc(p->inuse_num);
 
 cleanup:
 	return c;
 }
 
 void pgsql_pool_release(struct nv_stor *s, struct pgsql_conn *c) {
-	struct pgsql_data *me = NULL;
-	nv_node n;
-	
-	me = (struct pgsql_data *)s->data;
+	struct pgsql_pool *p = c->pool;
 
 	/* check and see if we're invalid at this point */
-	if (me->pool.quit) goto cleanup;
-
-	/* remove from in-use list */
-	n = c->node;
-	nv_lock(me->pool.inuse_lock);
-	list_del(n);
-	me->pool.inuse_num--;
-	nv_unlock(me->pool.inuse_lock);
-	
-	/* check status of connection */
+	if (p->quit) goto cleanup;
+
+	pool_dec(p->inuse_num);
 	if (PQstatus(c->conn) == CONNECTION_BAD) {
-		/* add to bad list */
-		nv_node_new(n);
-		c->node = n;
-		set_node_data(n, c);
-		nv_lock(me->pool.bad_lock);
-		list_append(me->pool.bad, n);
-		me->pool.bad_num++;
-		nv_signal(me->pool.bad_avail);
-		nv_unlock(me->pool.bad_lock);
-		
-		nv_log(NVLOG_DEBUG, "%s: marked connection id %i bad", s->name, c->id);
+		pgsql_pool_bad(s, c);
 	} else {
-		/* add to free list */
-		nv_node_new(n);
-		c->node = n;
-		set_node_data(n, c);
-		nv_lock(me->pool.free_lock);
-		list_append(me->pool.free, n);
-		me->pool.free_num++;
-		nv_signal(me->pool.free_avail);
-		nv_unlock(me->pool.free_lock);
-
-		nv_log(NVLOG_DEBUG, "%s: released connection id %i", s->name, c->id);
+		pgsql_pool_push(p, c);
 	}
 cleanup:
 	;;
 }
 
-PGconn *pgsql_connect(struct nv_stor *s) {
+/*
+ * Give back a connection left in a state we cannot trust (in the middle
+ * of a pipeline, say); the repair thread replaces it with a new one.
+ */
+void pgsql_pool_discard(struct nv_stor *s, struct pgsql_conn *c) {
+	struct pgsql_pool *p = c->pool;
+
+	if (p->quit) return;
+	pool_dec(p->inuse_num);
+	pgsql_pool_bad(s, c);
+}
+
+/* is every write connection broken, so that pgsql_pool_get() would block? */
+int pgsql_pool_down(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	return pgsql_pool_empty(&me->pool);
+}
+
+/* is every connection in a pool broken? */
+int pgsql_pool_empty(struct pgsql_pool *p) {
+	return pool_load(p->bad_num) >= p->num;
+}
+
+/*
+ * See how far the replica behind the read pool is, from the heartbeat.
+ * While it is more than read_lag seconds behind, reads go to the primary.
+ * A server that is not in recovery is never behind.  If no read
+ * connection is free right now, we look again next time.
+ */
+#define SQL_REPLICA_LAG		"SELECT CASE WHEN pg_is_in_recovery() THEN " \
+							"    COALESCE(EXTRACT(epoch FROM now() - " \
+							"        pg_last_xact_replay_timestamp()), 0) " \
+							"ELSE 0 END;"
+void pgsql_pool_lag(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_conn *c = NULL;
+	PGresult *res = NULL;
+	double lag = 0;
+	int behind = 0;
+
+	if (me->rpool.num == 0 || pgsql_pool_empty(&me->rpool)) return;
+
+	c = pgsql_pool_take(s, &me->rpool, 0);
+	if (c == NULL) return;
+	res = PQexec(c->conn, SQL_REPLICA_LAG);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", me->rpool.name,
+			   PQresultErrorMessage(res));
+		behind = 1;
+	} else {
+		lag = atof(PQgetvalue(res, 0, 0));
+		behind = lag > me->read_lag;
+	}
+	PQclear(res);
+	pgsql_pool_release(s, c);
+
+	if (behind && !pool_load(me->rpool.behind)) {
+		nv_log(NVLOG_WARN, "%s: replica is %.0f seconds behind, reading "
+			   "from the primary", me->rpool.name, lag);
+	} else if (!behind && pool_load(me->rpool.behind)) {
+		nv_log(NVLOG_INFO, "%s: replica has caught up", me->rpool.name);
+	}
+	pool_store(me->rpool.behind, behind);
+}
+
+/* put a slot on the free stack and wake a waiter, if there is one */
+void pgsql_pool_push(struct pgsql_pool *p, struct pgsql_conn *c) {
+	uint64_t old = pool_load(p->free_top);
+	uint64_t new = 0;
+
+	pool_store(c->state, PGSQL_SLOT_FREE);
+	do {
+		pool_store(c->next, (int)(old & 0xffffffff));
+		new = ((old >> 32) + 1) << 32 | (uint64_t)(c->id + 1);
+	} while (!__atomic_compare_exchange_n(&p->free_top, &old, new, 0,
+										  __ATOMIC_SEQ_CST,
+										  __ATOMIC_SEQ_CST));
+	pool_inc(p->free_num);
+
+	if (pool_load(p->waiters) > 0) {
+		nv_lock(p->free_lock);
+		nv_signal(p->free_avail);
+		nv_unlock(p->free_lock);
+	}
+}
+
+/* take a slot off the free stack, or NULL if it is empty */
+struct pgsql_conn *pgsql_pool_pop(struct pgsql_pool *p) {
+	uint64_t old = pool_load(p->free_top);
+	uint64_t new = 0;
+	int top = 0;
+
+	do {
+		top = (int)(old & 0xffffffff);
+		if (top == 0) return NULL;
+		new = ((old >> 32) + 1) << 32 |
+			  (uint64_t)pool_load(p->slots[top-1].next);
+	} while (!__atomic_compare_exchange_n(&p->free_top, &old, new, 0,
+										  __ATOMIC_SEQ_CST,
+										  __ATOMIC_SEQ_CST));
+	pool_dec(p->free_num);
+	return &p->slots[top-1];
+}
+
+/* hand a broken connection to the repair thread */
+void pgsql_pool_bad(struct nv_stor *s, struct pgsql_conn *c) {
+	struct pgsql_pool *p = c->pool;
+
+	(void)s;
+	pool_store(c->state, PGSQL_SLOT_BAD);
+	pool_inc(p->bad_num);
+	nv_lock(p->bad_lock);
+	nv_signal(p->bad_avail);
+	nv_unlock(p->bad_lock);
+	nv_log(NVLOG_DEBUG, "%s: marked connection id %i bad", p->name, c->id);
+}
+
+/* start connecting, without waiting for the result */
+PGconn *pgsql_connect(struct nv_stor *s, struct pgsql_pool *p) {
 	struct pgsql_data *me = NULL;
-	PGconn *conn = NULL;
-	char buf[NAME_LEN];
-	char sslmode[NAME_LEN];
+	const char *keys[8];
+	const char *values[8];
+	char port[16];
+	char ctimeout[16];
 	
 	me = (struct pgsql_data *)s->data;
-	if (me->ssl) strncpy(sslmode, "require", 8);
-	else strncpy(sslmode, "disable", 8);
-	snprintf(buf, NAME_LEN, "host=%s port=%i user=%s password=%s dbname=%s "
-			 "sslmode=%s connect_timeout=%i",
-			 me->host, me->port, me->user, me->pass, me->db, sslmode,
-			 me->ctimeout);
-	conn = PQconnectdb(buf);
-	return conn;
+	snprintf(port, sizeof(port), "%i", p->port);
+	snprintf(ctimeout, sizeof(ctimeout), "%i", me->ctimeout);
+	keys[0] = "host";				values[0] = p->host;
+	keys[1] = "port";				values[1] = port;
+	keys[2] = "user";				values[2] = me->user;
+	keys[3] = "password";			values[3] = me->pass;
+	keys[4] = "dbname";				values[4] = me->db;
+	keys[5] = "sslmode";			values[5] = me->ssl ? "require" : "disable";
+	keys[6] = "connect_timeout";	values[6] = ctimeout;
+	keys[7] = NULL;					values[7] = NULL;
+	return PQconnectStartParams(keys, values, 0);
 }
 
 void pgsql_disconnect(PGconn *conn) {
 	PQfinish(conn);
 }
 
-static void pgsql_pool_status(struct nv_stor *s, int level) {
-	struct pgsql_data *me = NULL;
-
-	me = (struct pgsql_data *)s->data;
-	nv_log(level, "%s: pool status: %i in use, %i free, %i bad", s->name,
-		   me->pool.inuse_num, me->pool.free_num, me->pool.bad_num);
+static void pgsql_pool_status(struct pgsql_pool *p, int level) {
+	nv_log(level, "%s: pool status: %i in use, %i free, %i bad", p->name,
+		   p->inuse_num, p->free_num, p->bad_num);
 }
 
 static void *pgsql_pool_logthread(void *arg) {
-	struct nv_stor *s = NULL;
-	struct pgsql_data *me = NULL;
+	struct pgsql_pool *p = NULL;
 	int badcount = 0;
 	
 	/* get typed pointers to our data */
-	s = (struct nv_stor *)arg;
-	me = (struct pgsql_data *)s->data;
+	p = (struct pgsql_pool *)arg;
 
 	/* initial report */
-	nv_log(NVLOG_INFO, "%s: pool logging thread starting", s->name);
-	pgsql_pool_status(s, NVLOG_INFO);
+	nv_log(NVLOG_INFO, "%s: pool logging thread starting", p->name);
+	pgsql_pool_status(p, NVLOG_INFO);
 	
 	/* log short-term major changes in pool status */
-	me->pool.lastbad = me->pool.bad_num;
+	p->lastbad = p->bad_num;
 	for (;;) {
 		sleep(5);
 
 		/* report status if bad number changes */
-		if (me->pool.bad_num < me->pool.lastbad) {
-			pgsql_pool_status(s, NVLOG_INFO);
-			me->pool.lastbad = me->pool.bad_num;
+		if (p->bad_num < p->lastbad) {
+			pgsql_pool_status(p, NVLOG_INFO);
+			p->lastbad = p->bad_num;
 			badcount++;
-		} else if (me->pool.bad_num > me->pool.lastbad) {
-			pgsql_pool_status(s, NVLOG_INFO);
-			me->pool.lastbad = me->pool.bad_num;
+		} else if (p->bad_num > p->lastbad) {
+			pgsql_pool_status(p, NVLOG_INFO);
+			p->lastbad = p->bad_num;
 			badcount++;
 		}
 		
 		/* log long-term bad status every 15 minutes if there are bad entries */
-		if (me->pool.bad_num == 0) badcount = 0;
+		if (p->bad_num == 0) badcount = 0;
 		if (badcount >= 180) {
 			badcount = 0;
-			pgsql_pool_status(s, NVLOG_WARN);
+			pgsql_pool_status(p, NVLOG_WARN);
 		}
 
 		/* check for exit */
-		if (me->pool.quit) break;
+		if (p->quit) break;
 	}
 	
 	/* final report */
-	pgsql_pool_status(s, NVLOG_INFO);
-	nv_log(NVLOG_INFO, "%s: pool logging thread stopping", s->name);
+	pgsql_pool_status(p, NVLOG_INFO);
+	nv_log(NVLOG_INFO, "%s: pool logging thread stopping", p->name);
+	return NULL;
 }
 
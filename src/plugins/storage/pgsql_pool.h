@@ -23,46 +23,81 @@
 
 #include <netvizd.h>
 #include <nvconfig.h>
-#include <nvlist.h>
 #include <libpq-fe.h>
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * A storage instance has a pool of connections to the primary for
+ * writing, and may have a second one for reading, usually from a replica.
+ * Each pool is a fixed array of connection slots.  Free slots sit on a
+ * lock-free stack (slot index plus a change count, to rule out ABA), so
+ * checking a connection out or in is a compare-and-swap.  The mutexes
+ * are only for sleeping: on free_avail when every connection is busy, and
+ * for the repair thread on bad_avail.
+ */
+#define PGSQL_SLOT_FREE		0
+#define PGSQL_SLOT_INUSE	1
+#define PGSQL_SLOT_BAD		2
+
+#define PGSQL_BACKOFF_MIN	250		/* first retry delay, in ms */
 
 struct pgsql_pool {
+	struct nv_stor *	stor;         /* the storage instance it serves */
+	char				name[NAME_LEN];  /* for the log */
+	char *				host;         /* server */
+	int					port;
+	int					behind;       /* replica too far behind to use? */
+
 	int					num;          /* number of connections in the pool */
+	struct pgsql_conn *	slots;        /* all of them */
 	pthread_t *			thread;       /* management thread */
 	int					quit;         /* quit flag */
 	
 	pthread_t *			logthread;    /* logging thread */
 	int					lastbad;      /* previous number of bad connections */
+
+	/* free stack: change count << 32 | (top slot + 1), 0 when empty */
+	uint64_t			free_top;
 	
-	/* bad list */
-	pthread_mutex_t *	bad_lock;     /* lock on bad list */
+	/* counters, updated atomically */
 	int					bad_num;      /* number of bad connections */
-	pthread_cond_t *	bad_avail;    /* "bad conn available" condition */
-	nv_list *			bad;          /* list of (struct pgsql_conn *) */
-	
-	/* free list */
-	pthread_mutex_t *	free_lock;    /* lock on free list */
 	int					free_num;     /* number of free connections */
-	pthread_cond_t *	free_avail;   /* "free conn available" condition */
-	nv_list *			free;         /* list of (struct pgsql_conn *) */
-	
-	/* in-use list */
-	pthread_mutex_t *   inuse_lock;   /* lock on in-use list */
 	int					inuse_num;    /* number of in-use connections */
-	nv_list *			inuse;        /* list of (struct pgsql_conn *) */
+
+	/* sleeping */
+	pthread_mutex_t *	bad_lock;
+	pthread_cond_t *	bad_avail;    /* "bad conn available" condition */
+	pthread_mutex_t *	free_lock;
+	pthread_cond_t *	free_avail;   /* "free conn available" condition */
+	int					waiters;      /* threads waiting on free_avail */
 };
 					
 struct pgsql_conn {
+	struct pgsql_pool *	pool;     /* the pool we belong to */
 	int				id;
 	PGconn *		conn;
-	nv_node			node;
+	int				state;        /* PGSQL_SLOT_* */
+	int				next;         /* next free slot + 1, 0 at the bottom */
+
+	/* reconnecting, for the repair thread only */
+	int				connecting;   /* attempt in progress? */
+	PostgresPollingStatusType poll;  /* what the attempt waits for */
+	long			deadline;     /* give up on the attempt, in ms */
+	long			retry_at;     /* next attempt, in ms */
+	long			backoff;      /* current retry delay, in ms */
 };
 
 /* public connection pool interface */
-int pgsql_pool_init(struct nv_stor *s, int num);
-int pgsql_pool_free(struct nv_stor *s);
+int pgsql_pool_init(struct nv_stor *s, struct pgsql_pool *p,
+					const char *name, char *host, int port, int num);
+int pgsql_pool_free(struct nv_stor *s, struct pgsql_pool *p);
 struct pgsql_conn *pgsql_pool_get(struct nv_stor *s);
+struct pgsql_conn *pgsql_pool_get_read(struct nv_stor *s, int wait);
 void pgsql_pool_release(struct nv_stor *s, struct pgsql_conn *conn);
+void pgsql_pool_discard(struct nv_stor *s, struct pgsql_conn *conn);
+int pgsql_pool_down(struct nv_stor *s);
+void pgsql_pool_lag(struct nv_stor *s);
 
 #define pgsql_pool_conncheck(s, c, label) \
 	if (PQstatus((c)->conn) == CONNECTION_BAD) { \
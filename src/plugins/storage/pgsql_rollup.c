@@ -0,0 +1,319 @@
+/***************************************************************************
+*   Copyright (C) 2005 by Robert Timothy Stewart                          *
+*   tims@cc.gatech.edu                                                    *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU General Public License as published by  *
+*   the Free Software Foundation; either version 2 of the License, or     *
+*   (at your option) any later version.                                   *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU General Public License     *
+*   along with this program; if not, write to the                         *
+*   Free Software Foundation, Inc.,                                       *
+*   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+***************************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include <libpq-fe.h>
+#include "pgsql.h"
+#include "pgsql_pool.h"
+#include "pgsql_rollup.h"
+
+static int pgsql_rollup_table(struct nv_stor *s, struct pgsql_conn *c,
+							  int step);
+static int pgsql_rollup_select(struct nv_stor *s, char *buf, size_t len,
+							   int step, const char *from);
+static int pgsql_rollup_exec(struct nv_stor *s, struct pgsql_conn *c,
+							 char *sql);
+static const char *pgsql_rollup_name(struct nv_stor *s);
+static const char *pgsql_rollup_key(struct nv_stor *s);
+
+#define PGSQL_ROLLUP_SQL_LEN	(1024 * (PGSQL_MAX_ROLLUPS + 1))
+
+/*
+ * Parse the "rollups" value: a list of bucket sizes in seconds, smallest
+ * first, e.g. "300 3600 86400".
+ */
+int pgsql_rollup_parse(struct nv_stor *s, const char *value) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	const char *p = value;
+	char *end = NULL;
+	long step = 0;
+
+	me->num_rollups = 0;
+	for (;;) {
+		while (*p == ' ' || *p == ',' || *p == '\t') p++;
+		if (*p == '\0') break;
+		step = strtol(p, &end, 10);
+		if (end == p || step <= 0 || me->num_rollups == PGSQL_MAX_ROLLUPS ||
+			(me->num_rollups > 0 &&
+			 step <= me->rollups[me->num_rollups-1])) {
+			nv_log(NVLOG_ERROR, "%s: bad rollups \"%s\": want up to %i "
+				   "increasing bucket sizes in seconds", s->name, value,
+				   PGSQL_MAX_ROLLUPS);
+			return -1;
+		}
+		me->rollups[me->num_rollups++] = (int)step;
+		p = end;
+	}
+	return 0;
+}
+
+/* create any rollup tables we do not have yet */
+int pgsql_rollup_init(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_conn *c = NULL;
+	int stat = 0;
+	int i;
+
+	if (me->num_rollups == 0) return 0;
+
+	c = pgsql_pool_get(s);
+	if (c == NULL) return -1;
+	for (i = 0; i < me->num_rollups && stat == 0; i++) {
+		stat = pgsql_rollup_table(s, c, me->rollups[i]);
+	}
+	pgsql_pool_release(s, c);
+	return stat;
+}
+
+/*
+ * Create the table for one step, filling it from the data we already have
+ * so it is complete from the start.
+ */
+#define SQL_ROLLUP_EXISTS	"SELECT 1 FROM pg_class " \
+							"WHERE relname = $1 AND relkind IN ('r', 'p');"
+#define SQL_CREATE_ROLLUP	"CREATE TABLE %s_%i ( " \
+							"    %s, " \
+							"    bucket TIMESTAMP WITH TIME ZONE, " \
+							"    count BIGINT, " \
+							"    sum DOUBLE PRECISION, " \
+							"    min DOUBLE PRECISION, " \
+							"    max DOUBLE PRECISION, " \
+							"    last DOUBLE PRECISION, " \
+							"    ltime TIMESTAMP WITH TIME ZONE, " \
+							"    PRIMARY KEY (%s, bucket)" \
+							");"
+#define SQL_FILL_ROLLUP		"INSERT INTO %s_%i %s;"
+int pgsql_rollup_table(struct nv_stor *s, struct pgsql_conn *c, int step) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_params p;
+	Oid types[] = { VARCHAROID };
+	PGresult *res = NULL;
+	char name[NAME_LEN];
+	char sel[1024];
+	char buf[2048];
+	int stat = 0;
+
+	snprintf(name, sizeof(name), "%s_%i", pgsql_rollup_name(s), step);
+	pgsql_params_init(&p);
+	pgsql_param_text(&p, name);
+	res = PQexecParams(c->conn, SQL_ROLLUP_EXISTS, 1, types, p.values,
+					   p.lengths, p.formats, 0);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		stat = -1;
+		goto cleanup;
+	}
+	if (PQntuples(res) > 0) goto cleanup;
+
+	nv_log(NVLOG_INFO, "%s: creating rollup table %s", s->name, name);
+	stat = pgsql_rollup_exec(s, c, "BEGIN;");
+	if (stat != 0) goto cleanup;
+	snprintf(buf, sizeof(buf), SQL_CREATE_ROLLUP, pgsql_rollup_name(s), step,
+			 me->ids ? "series_id INTEGER" :
+			 "system VARCHAR(256), dataset VARCHAR(256)",
+			 pgsql_rollup_key(s));
+	stat = pgsql_rollup_exec(s, c, buf);
+	if (stat == 0) {
+		pgsql_rollup_select(s, sel, sizeof(sel), step, pgsql_data_table(s));
+		snprintf(buf, sizeof(buf), SQL_FILL_ROLLUP, pgsql_rollup_name(s),
+				 step, sel);
+		stat = pgsql_rollup_exec(s, c, buf);
+	}
+	if (stat == 0) {
+		stat = pgsql_rollup_exec(s, c, "COMMIT;");
+	} else {
+		pgsql_rollup_exec(s, c, "ROLLBACK;");
+	}
+
+cleanup:
+	PQclear(res);
+	return stat;
+}
+
+/*
+ * The statement every batch is written with: the rows 'source' selects go
+ * into the data table, and the ones that were really new are folded into
+ * every rollup (if any), all in one statement.  Rows we already had are
+ * skipped so they are never counted twice.  The statement returns the
+ * number of rows stored; the caller frees it.
+ */
+#define SQL_APPLY_INSERT	"WITH ins AS ( " \
+							"    INSERT INTO %s %s " \
+							"    ON CONFLICT DO NOTHING " \
+							"    RETURNING *)"
+#define SQL_APPLY_ROLLUP	", r%i AS ( " \
+							"    INSERT INTO %s_%i AS r %s " \
+							"    ON CONFLICT (%s, bucket) DO UPDATE SET " \
+							"        count = r.count + EXCLUDED.count, " \
+							"        sum = r.sum + EXCLUDED.sum, " \
+							"        min = LEAST(r.min, EXCLUDED.min), " \
+							"        max = GREATEST(r.max, EXCLUDED.max), " \
+							"        last = CASE WHEN EXCLUDED.ltime >= r.ltime " \
+							"                    THEN EXCLUDED.last " \
+							"                    ELSE r.last END, " \
+							"        ltime = GREATEST(r.ltime, EXCLUDED.ltime))"
+#define SQL_APPLY_COUNT		" SELECT count(*) FROM ins;"
+char *pgsql_rollup_write(struct nv_stor *s, const char *source) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	char *buf = NULL;
+	char sel[1024];
+	int len = 0;
+	int i;
+
+	buf = nv_malloc(char, PGSQL_ROLLUP_SQL_LEN);
+	len = snprintf(buf, PGSQL_ROLLUP_SQL_LEN, SQL_APPLY_INSERT,
+				   pgsql_data_table(s), source);
+	for (i = 0; i < me->num_rollups; i++) {
+		pgsql_rollup_select(s, sel, sizeof(sel), me->rollups[i], "ins");
+		len += snprintf(buf+len, PGSQL_ROLLUP_SQL_LEN-len, SQL_APPLY_ROLLUP,
+						i, pgsql_rollup_name(s), me->rollups[i], sel,
+						pgsql_rollup_key(s));
+	}
+	snprintf(buf+len, PGSQL_ROLLUP_SQL_LEN-len, SQL_APPLY_COUNT);
+	return buf;
+}
+
+/* the coarsest rollup whose buckets fit evenly in 'res', or 0 for none */
+int pgsql_rollup_pick(struct nv_stor *s, int res) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	int i;
+
+	for (i = me->num_rollups - 1; i >= 0; i--) {
+		if (me->rollups[i] <= res && res % me->rollups[i] == 0) {
+			return me->rollups[i];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Aggregate from a rollup table instead of the raw data.  Since 'res' is
+ * a multiple of 'step', every rollup bucket falls inside one result
+ * bucket.  Only the rollup buckets wholly inside the range, [lo, hi), are
+ * read; the samples between the start and lo, and between hi and the
+ * end, come from the raw data, each as a bucket of one.
+ */
+#define SQL_GET_ROLLUP		"%sSELECT floor(EXTRACT(epoch FROM t) / $%i) " \
+							"           * $%i AS b, " \
+							"       sum(count), sum(sum), min(min), max(max), " \
+							"       (array_agg(last ORDER BY ltime DESC))[1], " \
+							"       max(EXTRACT(epoch FROM ltime)) " \
+							"FROM (SELECT bucket AS t, count, sum, min, max, " \
+							"             last, ltime " \
+							"      FROM %s_%i " \
+							"      WHERE %s AND bucket >= $%i AND " \
+							"            bucket < $%i " \
+							"      UNION ALL " \
+							"      SELECT time, 1, value, value, value, " \
+							"             value, time " \
+							"      FROM %s " \
+							"      WHERE %s AND time >= $%i AND " \
+							"            time <= $%i AND " \
+							"            (time < $%i OR time >= $%i) AND " \
+							"            value <> 'NaN') AS r " \
+							"GROUP BY b " \
+							"ORDER BY b;"
+/*
+ * The query above for a rollup of 'step', after 'prefix' (e.g. to DECLARE
+ * a cursor over it).  Its parameters are the series, the result step,
+ * then the ones pgsql_rollup_params() adds.
+ */
+int pgsql_rollup_query(struct nv_stor *s, char *buf, size_t len, int step,
+					   const char *prefix) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	const char *where = me->ids ? "series_id = $1" :
+		"system = $1 AND dataset = $2";
+	int n = me->ids ? 2 : 3;
+
+	return snprintf(buf, len, SQL_GET_ROLLUP, prefix, n, n,
+					pgsql_rollup_name(s), step, where, n+3, n+4,
+					pgsql_data_table(s), where, n+1, n+2, n+3, n+4);
+}
+
+/*
+ * Add the range parameters of the rollup query: the start and end, then
+ * the first and last rollup buckets wholly inside them (lo, and hi just
+ * past the last).  When no bucket is whole, hi <= lo and every sample
+ * comes from the raw data.
+ */
+void pgsql_rollup_params(struct pgsql_params *p, time_t start, time_t end,
+						 int step) {
+	time_t lo = start - ((start % step) + step) % step;
+	time_t hi = end + 1 - (((end + 1) % step) + step) % step;
+
+	if (lo < start) lo += step;
+	pgsql_param_time(p, start);
+	pgsql_param_time(p, end);
+	pgsql_param_time(p, lo);
+	pgsql_param_time(p, hi);
+}
+
+/* the query that rolls the rows of 'from' up into buckets of 'step' */
+#define SQL_ROLLUP_SELECT	"SELECT %s, " \
+							"       to_timestamp(floor(EXTRACT(epoch FROM " \
+							"           time) / %i) * %i) AS bucket, " \
+							"       count(value), sum(value), min(value), " \
+							"       max(value), " \
+							"       (array_agg(value ORDER BY time DESC))[1], " \
+							"       max(time) " \
+							"FROM %s " \
+							"WHERE value <> 'NaN' " \
+							"GROUP BY %s, bucket"
+int pgsql_rollup_select(struct nv_stor *s, char *buf, size_t len, int step,
+						const char *from) {
+	return snprintf(buf, len, SQL_ROLLUP_SELECT, pgsql_rollup_key(s), step,
+					step, from, pgsql_rollup_key(s));
+}
+
+/* run a statement that returns no rows */
+int pgsql_rollup_exec(struct nv_stor *s, struct pgsql_conn *c, char *sql) {
+	PGresult *res = NULL;
+	int stat = 0;
+
+	res = PQexec(c->conn, sql);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		stat = -1;
+	}
+	PQclear(res);
+	return stat;
+}
+
+const char *pgsql_rollup_name(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	return me->ids ? "nv_series_rollup" : "nv_rollup";
+}
+
+const char *pgsql_rollup_key(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	return me->ids ? "series_id" : "system, dataset";
+}
+
+/* vim: set ts=4 sw=4: */
@@ -0,0 +1,55 @@
+/***************************************************************************
+*   Copyright (C) 2005 by Robert Timothy Stewart                          *
+*   tims@cc.gatech.edu                                                    *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU General Public License as published by  *
+*   the Free Software Foundation; either version 2 of the License, or     *
+*   (at your option) any later version.                                   *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU General Public License     *
+*   along with this program; if not, write to the                         *
+*   Free Software Foundation, Inc.,                                       *
+*   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+***************************************************************************/
+
+
+#ifndef _PLUGINS_PGSQL_ROLLUP_H_
+#define _PLUGINS_PGSQL_ROLLUP_H_
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include "pgsql.h"
+
+/*
+ * Rollup tables hold count/sum/min/max/last for each series and bucket of
+ * a fixed step (nv_rollup_<step>, or nv_series_rollup_<step> in the ids
+ * schema).  They are brought up to date with every batch we write, so an
+ * aggregated FETCH can read one row per bucket instead of every sample.
+ */
+/* parameter types of pgsql_rollup_query() */
+#define OID_GET_ROLLUP		{ VARCHAROID, VARCHAROID, INT4OID, \
+							  TIMESTAMPTZOID, TIMESTAMPTZOID, \
+							  TIMESTAMPTZOID, TIMESTAMPTZOID }
+#define OID_GET_ROLLUP_ID	{ INT4OID, INT4OID, TIMESTAMPTZOID, \
+							  TIMESTAMPTZOID, TIMESTAMPTZOID, \
+							  TIMESTAMPTZOID }
+
+/* the statement batches are written with comes from here too */
+int pgsql_rollup_parse(struct nv_stor *s, const char *value);
+int pgsql_rollup_init(struct nv_stor *s);
+char *pgsql_rollup_write(struct nv_stor *s, const char *source);
+int pgsql_rollup_pick(struct nv_stor *s, int res);
+int pgsql_rollup_query(struct nv_stor *s, char *buf, size_t len, int step,
+					   const char *prefix);
+void pgsql_rollup_params(struct pgsql_params *p, time_t start, time_t end,
+						 int step);
+
+#endif
+
+/* vim: set ts=4 sw=4: */
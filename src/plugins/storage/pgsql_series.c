@@ -0,0 +1,656 @@
+/***************************************************************************
+*   Copyright (C) 2005 by Robert Timothy Stewart                          *
+*   tims@cc.gatech.edu                                                    *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU General Public License as published by  *
+*   the Free Software Foundation; either version 2 of the License, or     *
+*   (at your option) any later version.                                   *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU General Public License     *
+*   along with this program; if not, write to the                         *
+*   Free Software Foundation, Inc.,                                       *
+*   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+***************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include <libpq-fe.h>
+#include <pthread.h>
+#include "pgsql.h"
+#include "pgsql_pool.h"
+#include "pgsql_series.h"
+#include "pgsql_part.h"
+#include "pgsql_io.h"
+
+static int pgsql_series_exists(struct nv_stor *s, struct pgsql_conn *c,
+							   char *table, char *column);
+static int pgsql_series_exec(struct nv_stor *s, struct pgsql_conn *c,
+							 char *sql);
+static int pgsql_series_schema(struct nv_stor *s, struct pgsql_conn *c);
+static int pgsql_series_load(struct nv_stor *s, struct pgsql_conn *c);
+static struct pgsql_series *pgsql_series_add(struct pgsql_data *me,
+											 const char *sys,
+											 const char *dset,
+											 unsigned int h);
+static struct pgsql_series *pgsql_series_find(struct pgsql_data *me,
+											  const char *sys,
+											  const char *dset,
+											  unsigned int *h);
+static unsigned int pgsql_series_hash(const char *sys, const char *dset);
+
+#define SQL_CREATE_META_IDS	"CREATE TABLE nv_dsts ( " \
+							"    id SERIAL UNIQUE, " \
+							"    system VARCHAR(256), " \
+							"    dataset VARCHAR(256), " \
+							"    utime TIMESTAMP WITH TIME ZONE, " \
+							"    PRIMARY KEY (system, dataset)" \
+							");"
+#define SQL_ADD_SERIES_ID	"ALTER TABLE nv_dsts ADD COLUMN id SERIAL UNIQUE;"
+#define SQL_UTIME_NULL		"ALTER TABLE nv_dsts " \
+							"ALTER COLUMN utime DROP NOT NULL;"
+#define SQL_CREATE_SERIES	"CREATE TABLE nv_series_data ( " \
+							"    series_id INTEGER, " \
+							"    time TIMESTAMP WITH TIME ZONE, " \
+							"    value DOUBLE PRECISION, " \
+							"    PRIMARY KEY (series_id, time)" \
+							");"
+#define SQL_CREATE_SERIES_PART	"CREATE TABLE nv_series_data ( " \
+								"    series_id INTEGER, " \
+								"    time TIMESTAMP WITH TIME ZONE, " \
+								"    value DOUBLE PRECISION, " \
+								"    PRIMARY KEY (series_id, time)" \
+								") PARTITION BY RANGE (time);"
+#define SQL_MIGRATE_SERIES	"INSERT INTO nv_dsts ( system, dataset ) " \
+							"SELECT DISTINCT system, dataset " \
+							"FROM nv_dsts_data d " \
+							"WHERE NOT EXISTS ( " \
+							"    SELECT 1 FROM nv_dsts n " \
+							"    WHERE n.system = d.system AND " \
+							"          n.dataset = d.dataset);"
+#define SQL_MIGRATE_DATA	"INSERT INTO nv_series_data " \
+							"    ( series_id, time, value ) " \
+							"SELECT n.id, d.time, d.value " \
+							"FROM nv_dsts_data d JOIN nv_dsts n " \
+							"    ON n.system = d.system AND " \
+							"       n.dataset = d.dataset;"
+#define SQL_RETIRE_DATA		"ALTER TABLE nv_dsts_data " \
+							"RENAME TO nv_dsts_data_old;"
+#define SQL_LOAD_SERIES		"SELECT system, dataset, -1, " \
+							"       EXTRACT(epoch FROM utime) " \
+							"FROM nv_dsts;"
+#define SQL_LOAD_SERIES_ID	"SELECT system, dataset, id, " \
+							"       EXTRACT(epoch FROM utime) " \
+							"FROM nv_dsts;"
+#define SQL_TABLE_EXISTS	"SELECT 1 " \
+							"FROM information_schema.columns " \
+							"WHERE table_schema = 'public' AND " \
+							"      table_name = $1 AND " \
+							"      ($2 = '' OR column_name = $2);"
+
+/*
+ * Fill the series cache (set up in pgsql_inst_init()): in the "ids"
+ * schema, set up the tables first (see pgsql_series_schema()), then load
+ * every series we know about with its update time.
+ */
+int pgsql_series_init(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_conn *c = NULL;
+	int stat = 0;
+
+	c = pgsql_pool_get(s);
+	if (c == NULL) return -1;
+	if (me->ids) stat = pgsql_series_schema(s, c);
+	if (stat == 0) stat = pgsql_series_load(s, c);
+	pgsql_pool_release(s, c);
+	return stat;
+}
+
+/*
+ * Set up the "ids" schema, migrating the older one if it is there.  The
+ * migration runs in one transaction: ids are added to nv_dsts, the rows
+ * in nv_dsts_data are copied to nv_series_data, and nv_dsts_data is
+ * renamed to nv_dsts_data_old so nothing is lost if the move needs
+ * checking.  A partitioned nv_series_data gets the partitions for the
+ * old rows first (see pgsql_part_prepare()).
+ */
+int pgsql_series_schema(struct nv_stor *s, struct pgsql_conn *c) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	PGresult *res = NULL;
+	int stat = 0;
+
+	res = PQexec(c->conn, "BEGIN;");
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		PQclear(res);
+		return -1;
+	}
+	PQclear(res);
+
+	/* the series table, with ids */
+	if (!pgsql_series_exists(s, c, "nv_dsts", "")) {
+		stat = pgsql_series_exec(s, c, SQL_CREATE_META_IDS);
+	} else if (!pgsql_series_exists(s, c, "nv_dsts", "id")) {
+		nv_log(NVLOG_INFO, "%s: adding series ids to nv_dsts", s->name);
+		stat = pgsql_series_exec(s, c, SQL_ADD_SERIES_ID);
+		if (stat == 0) stat = pgsql_series_exec(s, c, SQL_UTIME_NULL);
+	}
+	if (stat != 0) goto rollback;
+
+	/* the data table, moving any old data over */
+	if (!pgsql_series_exists(s, c, "nv_series_data", "")) {
+		stat = pgsql_series_exec(s, c, me->part ? SQL_CREATE_SERIES_PART :
+								 SQL_CREATE_SERIES);
+		if (stat == 0 && pgsql_series_exists(s, c, "nv_dsts_data", "")) {
+			nv_log(NVLOG_INFO, "%s: migrating nv_dsts_data to "
+				   "nv_series_data", s->name);
+			stat = pgsql_series_exec(s, c, SQL_MIGRATE_SERIES);
+			if (stat == 0 && me->part) {
+				stat = pgsql_part_prepare(s, c, "nv_dsts_data");
+			}
+			if (stat == 0) stat = pgsql_series_exec(s, c, SQL_MIGRATE_DATA);
+			if (stat == 0) stat = pgsql_series_exec(s, c, SQL_RETIRE_DATA);
+			if (stat == 0) {
+				nv_log(NVLOG_INFO, "%s: migration done, old rows kept in "
+					   "nv_dsts_data_old", s->name);
+			}
+		}
+	}
+	if (stat != 0) goto rollback;
+
+	return pgsql_series_exec(s, c, "COMMIT;");
+
+rollback:
+	res = PQexec(c->conn, "ROLLBACK;");
+	PQclear(res);
+	return stat;
+}
+
+/* free the id cache */
+void pgsql_series_free(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_series *e = NULL;
+	struct pgsql_series *next = NULL;
+	int i;
+
+	if (me->series == NULL) return;
+	for (i = 0; i < PGSQL_SERIES_HASH; i++) {
+		for (e = me->series[i]; e; e = next) {
+			next = e->next;
+			nv_free(e->sys);
+			nv_free(e->dset);
+			nv_free(e);
+		}
+	}
+	nv_free(me->series);
+	pthread_mutex_destroy(me->slock);
+	nv_free(me->slock);
+}
+
+/*
+ * Return the series id of a cached series, asking the database
+ * (and adding the series there if it is new) the first time only.
+ * Returns -1 on error.
+ */
+#define SQL_GET_SERIES		"WITH ins AS ( " \
+							"    INSERT INTO nv_dsts ( system, dataset ) " \
+							"    VALUES ( $1, $2 ) " \
+							"    ON CONFLICT DO NOTHING " \
+							"    RETURNING id) " \
+							"SELECT id FROM ins " \
+							"UNION ALL " \
+							"SELECT id FROM nv_dsts " \
+							"WHERE system = $1 AND dataset = $2;"
+#define NUM_GET_SERIES		2
+#define OID_GET_SERIES		{ VARCHAROID, VARCHAROID }
+int pgsql_series_get_id(struct nv_stor *s, struct pgsql_series *e) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_conn *c = NULL;
+	struct pgsql_params p;
+	Oid types[] = OID_GET_SERIES;
+	PGresult *res = NULL;
+	int id = -1;
+
+	nv_lock(me->slock);
+	id = e->id;
+	nv_unlock(me->slock);
+	if (id >= 0) goto cleanup;
+	id = -1;
+
+	/* not seen yet, look it up */
+	pgsql_params_init(&p);
+	pgsql_param_text(&p, e->sys);
+	pgsql_param_text(&p, e->dset);
+retry:
+	c = pgsql_pool_get(s);
+	if (c == NULL) goto cleanup;
+	res = PQexecParams(c->conn, SQL_GET_SERIES, NUM_GET_SERIES, types,
+					   p.values, p.lengths, p.formats, 0);
+	pgsql_pool_conncheck(s, c, retry);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) < 1) {
+		nv_log(NVLOG_ERROR, "%s: no series id for %s/%s: libpq: %s",
+			   s->name, e->sys, e->dset, PQresultErrorMessage(res));
+		goto cleanup2;
+	}
+	id = atoi(PQgetvalue(res, 0, 0));
+
+	/* remember it */
+	nv_lock(me->slock);
+	e->id = id;
+	nv_unlock(me->slock);
+
+cleanup2:
+	PQclear(res);
+	pgsql_pool_release(s, c);
+
+cleanup:
+	return id;
+}
+
+/* the same, by name, for rows that come without a handle (the spool) */
+int pgsql_series_id(struct nv_stor *s, const char *sys, const char *dset) {
+	return pgsql_series_get_id(s, pgsql_series_open(s, (char *)dset,
+													(char *)sys));
+}
+
+/*
+ * The cache entry for a series, added if we have not seen it yet.  This
+ * is the handle the core keeps for each of our data sets; entries live
+ * until the instance shuts down.
+ */
+void *pgsql_series_open(struct nv_stor *s, char *dset, char *sys) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_series *e = NULL;
+	unsigned int h = 0;
+
+	nv_lock(me->slock);
+	e = pgsql_series_find(me, sys, dset, &h);
+	if (e == NULL) e = pgsql_series_add(me, sys, dset, h);
+	nv_unlock(me->slock);
+	return e;
+}
+
+/*
+ * Add the parameters that pick out a series: the names in the "names"
+ * schema, or the series id in the "ids" schema.
+ */
+int pgsql_param_series(struct nv_stor *s, struct pgsql_params *p,
+					   struct pgsql_series *e) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	int id;
+
+	if (!me->ids) {
+		pgsql_param_text(p, e->sys);
+		pgsql_param_text(p, e->dset);
+		return 0;
+	}
+
+	id = pgsql_series_get_id(s, e);
+	if (0 > id) return -1;
+	pgsql_param_int4(p, id);
+	return 0;
+}
+
+/* load every known series into the cache */
+int pgsql_series_load(struct nv_stor *s, struct pgsql_conn *c) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	PGresult *res = NULL;
+	int row = 0;
+	int rownum = 0;
+	int stat = 0;
+
+	res = PQexec(c->conn, me->ids ? SQL_LOAD_SERIES_ID : SQL_LOAD_SERIES);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		stat = -1;
+		goto cleanup;
+	}
+
+	nv_lock(me->slock);
+	rownum = PQntuples(res);
+	for (row = 0; row < rownum; row++) {
+		char *sys = PQgetvalue(res, row, 0);
+		char *dset = PQgetvalue(res, row, 1);
+		struct pgsql_series *e = NULL;
+		unsigned int h = 0;
+
+		/* data sets may have opened theirs already */
+		e = pgsql_series_find(me, sys, dset, &h);
+		if (e == NULL) e = pgsql_series_add(me, sys, dset, h);
+		e->id = atoi(PQgetvalue(res, row, 2));
+		if (!PQgetisnull(res, row, 3)) {
+			e->utime = (time_t)atof(PQgetvalue(res, row, 3));
+		}
+		e->last = e->utime;
+		e->synced = e->utime;
+	}
+	nv_unlock(me->slock);
+	nv_log(NVLOG_DEBUG, "%s: loaded %i series", s->name, rownum);
+
+cleanup:
+	PQclear(res);
+	return stat;
+}
+
+/* the last update time of a series, or 0 if it has none */
+time_t pgsql_series_utime(struct nv_stor *s, struct pgsql_series *e) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	time_t utime = 0;
+
+	nv_lock(me->slock);
+	utime = e->utime;
+	nv_unlock(me->slock);
+	return utime;
+}
+
+/* set the update time of a series; pgsql_series_sync() writes it out */
+int pgsql_series_set_utime(struct nv_stor *s, struct pgsql_series *e,
+						   time_t utime) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	nv_lock(me->slock);
+	e->utime = utime;
+	e->dirty = 1;
+	nv_unlock(me->slock);
+	return 0;
+}
+
+/*
+ * Which of the 'num' sample times should be written?  A sample at the
+ * newest time stored for the series is one sent again (as the rrd sensor
+ * does with the last sample of each run), so it is counted and dropped
+ * here rather than sent to the server; a series starts from its stored
+ * update time.  Anything else sets take[i], older samples included: if
+ * the server has those already, the upsert skips them.  Returns the
+ * number taken.
+ */
+int pgsql_series_take(struct nv_stor *s, struct pgsql_series *e,
+					  const time_t *time, int num, char *take) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	int taken = 0;
+	int i;
+
+	nv_lock(me->slock);
+	for (i = 0; i < num; i++) {
+		take[i] = time[i] != e->last;
+		if (take[i]) taken++;
+	}
+	me->skipped += num - taken;
+	nv_unlock(me->slock);
+	return taken;
+}
+
+/*
+ * Note the newest time of each series among rows that have just been
+ * committed; rows spooled or dropped along the way never count.
+ */
+void pgsql_series_stored(struct nv_stor *s, struct pgsql_row *rows,
+						 int num) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_series *e = NULL;
+	int i;
+
+	nv_lock(me->slock);
+	for (i = 0; i < num; i++) {
+		e = rows[i].series;
+		if (e != NULL && rows[i].time > e->last) e->last = rows[i].time;
+	}
+	nv_unlock(me->slock);
+}
+
+/*
+ * Write out the buffered rows and then every changed update time, the
+ * latter with one upsert.  The changed times are collected before the
+ * rows go, so we never store a time ahead of the data it covers.  A
+ * series that lost rows since (dropped, with no room in a spool) is not
+ * written at all: its update time goes back to the last one stored, so
+ * the sensor sends the lost data again.
+ */
+#define SQL_SYNC_UTIMES		"INSERT INTO nv_dsts ( system, dataset, utime ) " \
+							"SELECT u.sys, u.dset, to_timestamp(u.t) " \
+							"FROM unnest($1::varchar[], $2::varchar[], " \
+							"            $3::int8[]) AS u(sys, dset, t) " \
+							"ON CONFLICT ( system, dataset ) " \
+							"DO UPDATE SET utime = EXCLUDED.utime;"
+int pgsql_series_sync(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_series *e = NULL;
+	struct pgsql_series **sent = NULL;
+	struct pgsql_conn *c = NULL;
+	PGresult *res = NULL;
+	const char *values[3];
+	char *buf[3] = { NULL, NULL, NULL };
+	int len[3] = { 0, 0, 0 };
+	int size[3] = { 0, 0, 0 };
+	time_t *times = NULL;
+	char t[32];
+	int flushed = 0;
+	int lost = 0;
+	int num = 0;
+	int stat = 0;
+	int i, n;
+
+	/* with the server down the rows go to the spool, and the times wait
+	 * for it to come back */
+	if (me->spool != NULL && pgsql_pool_down(s)) return pgsql_flush(s);
+
+	/* collect the changed times */
+	nv_lock(me->slock);
+	for (i = 0; i < PGSQL_SERIES_HASH; i++) {
+		for (e = me->series[i]; e; e = e->next) {
+			if (!e->dirty) continue;
+			if ((num & 255) == 0) {
+				sent = nv_realloc(struct pgsql_series *, sent, num + 256);
+				times = nv_realloc(time_t, times, num + 256);
+			}
+			sent[num] = e;
+			times[num] = e->utime;
+			e->dirty = 0;
+			num++;
+		}
+	}
+	nv_unlock(me->slock);
+
+	/* and wait for the I/O thread to be done with them */
+	pgsql_flush(s);
+	flushed = pgsql_io_wait(s);
+	if (num == 0) goto cleanup;
+
+	/* the times of series that kept all their rows, as array literals */
+	nv_lock(me->slock);
+	for (i = 0, n = 0; i < num; i++) {
+		e = sent[i];
+		if (e->lost) {
+			e->lost = 0;
+			e->utime = e->synced;
+			lost++;
+			continue;
+		}
+		sent[n] = e;
+		times[n] = times[i];
+		snprintf(t, sizeof(t), "%ld", (long)times[n]);
+		pgsql_array_add(&buf[0], &len[0], &size[0], e->sys, 1);
+		pgsql_array_add(&buf[1], &len[1], &size[1], e->dset, 1);
+		pgsql_array_add(&buf[2], &len[2], &size[2], t, 0);
+		n++;
+	}
+	nv_unlock(me->slock);
+	if (lost > 0) {
+		nv_log(NVLOG_WARN, "%s: %i series lost rows, keeping their last "
+			   "stored update times", s->name, lost);
+	}
+	num = n;
+	if (num == 0) goto cleanup;
+
+	for (i = 0; i < 3; i++) {
+		pgsql_array_add(&buf[i], &len[i], &size[i], NULL, 0);
+		values[i] = buf[i];
+	}
+retry:
+	c = pgsql_pool_get(s);
+	if (c == NULL) {
+		stat = -1;
+		goto failed;
+	}
+	res = PQexecParams(c->conn, SQL_SYNC_UTIMES, 3, NULL, values, NULL,
+					   NULL, 0);
+	pgsql_pool_conncheck(s, c, retry);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		stat = -1;
+	}
+	PQclear(res);
+	pgsql_pool_release(s, c);
+	if (stat == 0) {
+		nv_lock(me->slock);
+		for (i = 0; i < num; i++) sent[i]->synced = times[i];
+		nv_unlock(me->slock);
+		goto cleanup;
+	}
+
+failed:
+	/* try again next time; the cache has the newest times anyway */
+	nv_log(NVLOG_ERROR, "%s: %i update times not written", s->name, num);
+	nv_lock(me->slock);
+	for (i = 0; i < num; i++) sent[i]->dirty = 1;
+	nv_unlock(me->slock);
+
+cleanup:
+	for (i = 0; i < 3; i++) nv_free(buf[i]);
+	nv_free(sent);
+	nv_free(times);
+	return (stat == 0 && flushed == 0) ? 0 : -1;
+}
+
+/*
+ * Note the series of rows that were dropped, so that pgsql_series_sync()
+ * does not write update times past them.
+ */
+void pgsql_series_lost(struct nv_stor *s, struct pgsql_row *rows, int num) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	int i;
+
+	nv_lock(me->slock);
+	for (i = 0; i < num; i++) {
+		if (rows[i].series != NULL) rows[i].series->lost = 1;
+	}
+	nv_unlock(me->slock);
+}
+
+/*
+ * Append a value to a PostgreSQL array literal being built in 'buf', or
+ * close the array if 'v' is NULL.  Quoted values have '"' and '\'
+ * escaped.
+ */
+int pgsql_array_add(char **buf, int *len, int *size, const char *v,
+					int quote) {
+	int need = v ? 2 * strlen(v) + 4 : 3;
+
+	if (*len + need >= *size) {
+		*size = 2 * (*size + need) + 64;
+		*buf = nv_realloc(char, *buf, *size);
+	}
+	if (*len == 0) (*buf)[(*len)++] = '{';
+	if (v == NULL) {
+		(*buf)[(*len)++] = '}';
+		(*buf)[*len] = '\0';
+		return 0;
+	}
+	if ((*buf)[*len-1] != '{') (*buf)[(*len)++] = ',';
+	if (quote) (*buf)[(*len)++] = '"';
+	for (; *v; v++) {
+		if (quote && (*v == '"' || *v == '\\')) (*buf)[(*len)++] = '\\';
+		(*buf)[(*len)++] = *v;
+	}
+	if (quote) (*buf)[(*len)++] = '"';
+	return 0;
+}
+
+/* does a table (or a column of it, if column is not "") exist? */
+int pgsql_series_exists(struct nv_stor *s, struct pgsql_conn *c,
+						char *table, char *column) {
+	struct pgsql_params p;
+	Oid types[] = { VARCHAROID, VARCHAROID };
+	PGresult *res = NULL;
+	int found = 0;
+
+	pgsql_params_init(&p);
+	pgsql_param_text(&p, table);
+	pgsql_param_text(&p, column);
+	res = PQexecParams(c->conn, SQL_TABLE_EXISTS, 2, types, p.values,
+					   p.lengths, p.formats, 0);
+	if (PQresultStatus(res) == PGRES_TUPLES_OK) {
+		found = PQntuples(res) > 0;
+	} else {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+	}
+	PQclear(res);
+	return found;
+}
+
+/* run a statement that returns no rows */
+int pgsql_series_exec(struct nv_stor *s, struct pgsql_conn *c, char *sql) {
+	PGresult *res = NULL;
+	int stat = 0;
+
+	res = PQexec(c->conn, sql);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		nv_log(NVLOG_ERROR, "%s: libpq: %s", s->name,
+			   PQresultErrorMessage(res));
+		stat = -1;
+	}
+	PQclear(res);
+	return stat;
+}
+
+/* add a series to the cache, in hash bucket 'h'; call with slock held */
+struct pgsql_series *pgsql_series_add(struct pgsql_data *me,
+									  const char *sys, const char *dset,
+									  unsigned int h) {
+	struct pgsql_series *e = NULL;
+
+	e = nv_calloc(struct pgsql_series, 1);
+	e->sys = strdup(sys);
+	e->dset = strdup(dset);
+	e->id = -1;
+	e->next = me->series[h];
+	me->series[h] = e;
+	return e;
+}
+
+/* find a cached series; also returns its hash bucket in 'h' */
+struct pgsql_series *pgsql_series_find(struct pgsql_data *me,
+									   const char *sys, const char *dset,
+									   unsigned int *h) {
+	struct pgsql_series *e = NULL;
+
+	*h = pgsql_series_hash(sys, dset);
+	for (e = me->series[*h]; e; e = e->next) {
+		if (strcmp(e->dset, dset) == 0 && strcmp(e->sys, sys) == 0) break;
+	}
+	return e;
+}
+
+unsigned int pgsql_series_hash(const char *sys, const char *dset) {
+	unsigned int h = 2166136261u;
+
+	for (; *sys; sys++) h = (h ^ (unsigned char)*sys) * 16777619u;
+	h = (h ^ '/') * 16777619u;
+	for (; *dset; dset++) h = (h ^ (unsigned char)*dset) * 16777619u;
+	return h % PGSQL_SERIES_HASH;
+}
+
+/* vim: set ts=4 sw=4: */
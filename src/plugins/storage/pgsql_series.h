@@ -0,0 +1,71 @@
+/***************************************************************************
+*   Copyright (C) 2005 by Robert Timothy Stewart                          *
+*   tims@cc.gatech.edu                                                    *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU General Public License as published by  *
+*   the Free Software Foundation; either version 2 of the License, or     *
+*   (at your option) any later version.                                   *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU General Public License     *
+*   along with this program; if not, write to the                         *
+*   Free Software Foundation, Inc.,                                       *
+*   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+***************************************************************************/
+
+#ifndef _PLUGINS_PGSQL_SERIES_H_
+#define _PLUGINS_PGSQL_SERIES_H_
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include "pgsql.h"
+
+/*
+ * We keep every series we know in memory, with its update time, so
+ * update times are answered locally and written back in batches.  In the
+ * "ids" schema every (system, data set) pair also gets an integer series
+ * id from nv_dsts, and data rows carry only that id; the cache means
+ * names never have to go to the server once a series is known.  Each
+ * entry is also the handle the core passes us for its data set.
+ */
+#define PGSQL_SERIES_HASH	1024
+
+struct pgsql_series {
+	char *					sys;
+	char *					dset;
+	int						id;     /* -1 until known, or in "names" */
+	time_t					utime;  /* last update time, 0 for none */
+	int						dirty;  /* utime not written back yet */
+	time_t					synced; /* utime as last written back */
+	int						lost;   /* rows dropped since the last sync */
+	time_t					last;   /* newest sample time stored */
+	struct pgsql_series *	next;
+};
+
+int pgsql_series_init(struct nv_stor *s);
+void pgsql_series_free(struct nv_stor *s);
+void *pgsql_series_open(struct nv_stor *s, char *dset, char *sys);
+int pgsql_series_get_id(struct nv_stor *s, struct pgsql_series *e);
+int pgsql_series_id(struct nv_stor *s, const char *sys, const char *dset);
+int pgsql_param_series(struct nv_stor *s, struct pgsql_params *p,
+					   struct pgsql_series *e);
+time_t pgsql_series_utime(struct nv_stor *s, struct pgsql_series *e);
+int pgsql_series_set_utime(struct nv_stor *s, struct pgsql_series *e,
+						   time_t utime);
+int pgsql_series_sync(struct nv_stor *s);
+int pgsql_series_take(struct nv_stor *s, struct pgsql_series *e,
+					  const time_t *time, int num, char *take);
+void pgsql_series_stored(struct nv_stor *s, struct pgsql_row *rows,
+						 int num);
+void pgsql_series_lost(struct nv_stor *s, struct pgsql_row *rows, int num);
+int pgsql_array_add(char **buf, int *len, int *size, const char *v,
+					int quote);
+
+#endif
+
+/* vim: set ts=4 sw=4: */
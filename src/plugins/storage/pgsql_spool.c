@@ -0,0 +1,432 @@
+/***************************************************************************
+*   Copyright (C) 2005 by Robert Timothy Stewart                          *
+*   tims@cc.gatech.edu                                                    *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU General Public License as published by  *
+*   the Free Software Foundation; either version 2 of the License, or     *
+*   (at your option) any later version.                                   *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU General Public License     *
+*   along with this program; if not, write to the                         *
+*   Free Software Foundation, Inc.,                                       *
+*   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+***************************************************************************/
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include <libpq-fe.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pgsql.h"
+#include "pgsql_spool.h"
+#include "pgsql_io.h"
+
+static int pgsql_spool_open(struct nv_stor *s);
+static void pgsql_spool_seal(struct nv_stor *s);
+static int pgsql_spool_load(struct nv_stor *s, unsigned long seg,
+							char **map, size_t *len,
+							struct pgsql_row **rows);
+static void pgsql_spool_path(struct nv_stor *s, unsigned long seg,
+							 char *buf, size_t len);
+static size_t pgsql_spool_size(struct pgsql_row *r);
+static uint32_t pgsql_spool_crc(const unsigned char *p, size_t len);
+
+/* bytes of a record before the part its checksum covers */
+#define PGSQL_SPOOL_REC_HEAD	offsetof(struct pgsql_spool_rec, time)
+
+/*
+ * Find the segments left over from the last run and count the rows in
+ * them.  New rows always go to a new segment.
+ */
+int pgsql_spool_init(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_row *rows = NULL;
+	struct dirent *de = NULL;
+	DIR *dir = NULL;
+	char *map = NULL;
+	char prefix[NAME_LEN];
+	size_t len = 0;
+	unsigned long seg = 0;
+	int found = 0;
+	int plen = 0;
+	int end = 0;
+	int num = 0;
+
+	me->splock = nv_calloc(pthread_mutex_t, 1);
+	pthread_mutex_init(me->splock, NULL);
+
+	if (mkdir(me->spool, 0700) != 0 && errno != EEXIST) {
+		nv_perror(NVLOG_ERROR, me->spool, errno);
+		return -1;
+	}
+	dir = opendir(me->spool);
+	if (dir == NULL) {
+		nv_perror(NVLOG_ERROR, me->spool, errno);
+		return -1;
+	}
+	plen = snprintf(prefix, sizeof(prefix), "%s.", s->name);
+	while ((de = readdir(dir)) != NULL) {
+		if (strncmp(de->d_name, prefix, plen) != 0) continue;
+		end = 0;
+		if (sscanf(de->d_name + plen, "%lu.spool%n", &seg, &end) != 1 ||
+			end == 0 || de->d_name[plen + end] != '\0') continue;
+		if (!found || seg < me->spool_first) me->spool_first = seg;
+		if (!found || seg >= me->spool_next) me->spool_next = seg + 1;
+		found = 1;
+	}
+	closedir(dir);
+
+	for (seg = me->spool_first; seg < me->spool_next; seg++) {
+		num = pgsql_spool_load(s, seg, &map, &len, &rows);
+		if (num > 0) me->spool_rows += num;
+		if (map != NULL) munmap(map, len);
+		nv_free(rows);
+	}
+	if (me->spool_rows > 0) {
+		nv_log(NVLOG_INFO, "%s: %lu rows waiting in spool %s", s->name,
+			   me->spool_rows, me->spool);
+	}
+	return 0;
+}
+
+/* close the spool; what is still in it waits for the next run */
+void pgsql_spool_free(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	if (me->splock == NULL) return;
+
+	nv_lock(me->splock);
+	pgsql_spool_seal(s);
+	nv_unlock(me->splock);
+	if (me->spool_rows > 0) {
+		nv_log(NVLOG_WARN, "%s: %lu rows left in spool %s", s->name,
+			   me->spool_rows, me->spool);
+	}
+	nv_log(NVLOG_INFO, "%s: %lu rows spooled, %lu rows replayed", s->name,
+		   me->spooled, me->replayed);
+	if (me->spool_bad > 0) {
+		nv_log(NVLOG_ERROR, "%s: %lu unreadable spool segments set aside",
+			   s->name, me->spool_bad);
+	}
+	pthread_mutex_destroy(me->splock);
+	nv_free(me->splock);
+}
+
+/*
+ * Append rows to the spool and sync them to disk.  Returns the number of
+ * rows that did not fit (the spool is full, or a segment could not be
+ * made).
+ */
+int pgsql_spool_rows(struct nv_stor *s, struct pgsql_row *rows, int num) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_spool_rec *rec = NULL;
+	size_t need = 0;
+	char *p = NULL;
+	int i;
+
+	nv_lock(me->splock);
+	if (me->spool_rows == 0) {
+		nv_log(NVLOG_WARN, "%s: server unavailable, spooling rows to %s",
+			   s->name, me->spool);
+	}
+	for (i = 0; i < num; i++) {
+		need = pgsql_spool_size(&rows[i]);
+		if (me->spool_map == NULL || me->spool_off + need > PGSQL_SPOOL_SEG) {
+			if (0 > pgsql_spool_open(s)) break;
+		}
+
+		/* the length goes in last: until then the record ends the
+		 * segment */
+		rec = (struct pgsql_spool_rec *)(me->spool_map + me->spool_off);
+		memset(rec, 0, need);
+		rec->time = rows[i].time;
+		rec->value = rows[i].value;
+		rec->id = rows[i].id;
+		p = (char *)(rec + 1);
+		strcpy(p, rows[i].sys);
+		strcpy(p + strlen(p) + 1, rows[i].dset);
+		rec->sum = pgsql_spool_crc((unsigned char *)&rec->time,
+								   need - PGSQL_SPOOL_REC_HEAD);
+		rec->len = need - PGSQL_SPOOL_REC_HEAD;
+		me->spool_off += need;
+	}
+	if (me->spool_map != NULL &&
+		msync(me->spool_map, me->spool_off, MS_SYNC) != 0) {
+		nv_perror(NVLOG_ERROR, "msync()", errno);
+	}
+	me->spool_rows += i;
+	me->spooled += i;
+	nv_unlock(me->splock);
+
+	return num - i;
+}
+
+/*
+ * Replay the oldest segments, PGSQL_SPOOL_BATCH rows at a time, removing
+ * each once all of it is in.  The first batch that fails stops the
+ * replay and its segment is tried again from the start next time.
+ * Returns the number of rows replayed, or -1 on error.
+ */
+int pgsql_spool_replay(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_row *rows = NULL;
+	char path[BUF_LEN];
+	char *map = NULL;
+	size_t len = 0;
+	unsigned long seg = 0;
+	int stored = 0;
+	int done = 0;
+	int num = 0;
+	int stat = 0;
+	int i, n, part;
+
+	for (n = 0; n < PGSQL_SPOOL_REPLAY && stat == 0; n++) {
+		/* take the oldest segment, closing it if rows still go there */
+		nv_lock(me->splock);
+		if (me->spool_first == me->spool_next) {
+			nv_unlock(me->splock);
+			break;
+		}
+		if (me->spool_first == me->spool_next - 1) pgsql_spool_seal(s);
+		seg = me->spool_first;
+		nv_unlock(me->splock);
+
+		num = pgsql_spool_load(s, seg, &map, &len, &rows);
+		if (0 > num) stat = -1;
+		for (i = 0; i < num && stat == 0; i += part) {
+			part = num - i < PGSQL_SPOOL_BATCH ? num - i : PGSQL_SPOOL_BATCH;
+			stat = pgsql_write_rows(s, rows + i, part, &stored);
+			if (stat == 0) {
+				me->replayed += part;
+				nv_lock(me->slock);
+				me->written += stored;
+				me->skipped += part - stored;
+				nv_unlock(me->slock);
+			}
+		}
+		if (map != NULL) munmap(map, len);
+		nv_free(rows);
+		if (stat != 0) break;
+
+		pgsql_spool_path(s, seg, path, sizeof(path));
+		if (unlink(path) != 0 && errno != ENOENT) {
+			nv_perror(NVLOG_ERROR, path, errno);
+		}
+		nv_lock(me->splock);
+		me->spool_first++;
+		me->spool_rows -= (unsigned long)num < me->spool_rows ?
+			(unsigned long)num : me->spool_rows;
+		nv_unlock(me->splock);
+		done += num;
+	}
+
+	if (done > 0) {
+		nv_log(NVLOG_INFO, "%s: replayed %i spooled rows, %lu waiting",
+			   s->name, done, me->spool_rows);
+	}
+	return stat == 0 ? done : -1;
+}
+
+/*
+ * Start a new segment, closing the current one.  The space is allocated
+ * up front, so a full disk fails here rather than with SIGBUS when a
+ * mapped page is written.  Call with splock held.
+ */
+int pgsql_spool_open(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_spool_head *head = NULL;
+	char path[BUF_LEN];
+	int fd = -1;
+	int ret = 0;
+
+	pgsql_spool_seal(s);
+	if (me->spool_next - me->spool_first >= (unsigned long)me->spool_max) {
+		nv_log(NVLOG_DEBUG, "%s: spool has %i segments, full", s->name,
+			   me->spool_max);
+		return -1;
+	}
+
+	pgsql_spool_path(s, me->spool_next, path, sizeof(path));
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		nv_perror(NVLOG_ERROR, path, errno);
+		return -1;
+	}
+	ret = posix_fallocate(fd, 0, PGSQL_SPOOL_SEG);
+	if (ret != 0) {
+		nv_perror(NVLOG_ERROR, path, ret);
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	me->spool_map = mmap(NULL, PGSQL_SPOOL_SEG, PROT_READ | PROT_WRITE,
+						 MAP_SHARED, fd, 0);
+	close(fd);
+	if (me->spool_map == MAP_FAILED) {
+		nv_perror(NVLOG_ERROR, "mmap()", errno);
+		me->spool_map = NULL;
+		unlink(path);
+		return -1;
+	}
+
+	head = (struct pgsql_spool_head *)me->spool_map;
+	head->magic = PGSQL_SPOOL_MAGIC;
+	head->version = PGSQL_SPOOL_VERSION;
+	me->spool_off = sizeof(*head);
+	me->spool_next++;
+	return 0;
+}
+
+/* sync and unmap the segment being appended to; call with splock held */
+void pgsql_spool_seal(struct nv_stor *s) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	if (me->spool_map == NULL) return;
+
+	if (msync(me->spool_map, me->spool_off, MS_SYNC) != 0) {
+		nv_perror(NVLOG_ERROR, "msync()", errno);
+	}
+	munmap(me->spool_map, PGSQL_SPOOL_SEG);
+	me->spool_map = NULL;
+	me->spool_off = 0;
+}
+
+/*
+ * Map a segment and list its rows; their names point into the mapping.
+ * Reading stops at the first record whose checksum does not match.  A
+ * missing segment has no rows, and neither has one with a bad header,
+ * which is renamed to <segment>.bad.  Returns the number of rows, or -1.
+ */
+int pgsql_spool_load(struct nv_stor *s, unsigned long seg, char **map,
+					 size_t *len, struct pgsql_row **rows) {
+	struct pgsql_spool_head *head = NULL;
+	struct pgsql_spool_rec *rec = NULL;
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+	struct pgsql_row *r = NULL;
+	struct stat st;
+	char path[BUF_LEN];
+	char bad[BUF_LEN + 4];
+	size_t off = 0;
+	int size = 0;
+	int num = 0;
+	int fd = -1;
+
+	*map = NULL;
+	*len = 0;
+	*rows = NULL;
+
+	pgsql_spool_path(s, seg, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+		nv_perror(NVLOG_ERROR, path, errno);
+		return -1;
+	}
+	if (fstat(fd, &st) != 0) {
+		nv_perror(NVLOG_ERROR, path, errno);
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < (off_t)sizeof(*head)) {
+		close(fd);
+		return 0;
+	}
+	*len = st.st_size;
+	*map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (*map == MAP_FAILED) {
+		nv_perror(NVLOG_ERROR, "mmap()", errno);
+		*map = NULL;
+		return -1;
+	}
+
+	/* not ours, or from another version: move it out of the way so the
+	 * caller does not unlink it, and keep the rows for a person to judge */
+	head = (struct pgsql_spool_head *)*map;
+	if (head->magic != PGSQL_SPOOL_MAGIC ||
+		head->version != PGSQL_SPOOL_VERSION) {
+		snprintf(bad, sizeof(bad), "%s.bad", path);
+		if (rename(path, bad) != 0) {
+			nv_perror(NVLOG_ERROR, bad, errno);
+			return -1;
+		}
+		me->spool_bad++;
+		nv_log(NVLOG_ERROR, "%s: %s is not a spool segment, moved to %s",
+			   s->name, path, bad);
+		return 0;
+	}
+
+	off = sizeof(*head);
+	while (off + sizeof(*rec) <= *len) {
+		rec = (struct pgsql_spool_rec *)(*map + off);
+		if (rec->len == 0) break;
+		if (rec->len > *len - off - PGSQL_SPOOL_REC_HEAD ||
+			rec->len < sizeof(*rec) - PGSQL_SPOOL_REC_HEAD + 2 ||
+			rec->sum != pgsql_spool_crc((unsigned char *)&rec->time,
+										rec->len)) {
+			nv_log(NVLOG_WARN, "%s: bad record at offset %lu of %s, "
+				   "skipping the rest", s->name, (unsigned long)off, path);
+			break;
+		}
+
+		if (num == size) {
+			size = size ? 2 * size : 1024;
+			*rows = nv_realloc(struct pgsql_row, *rows, size);
+		}
+		r = &(*rows)[num++];
+		r->sys = (char *)(rec + 1);
+		r->dset = r->sys + strlen(r->sys) + 1;
+		r->id = rec->id;
+		r->series = NULL;
+		r->time = (time_t)rec->time;
+		r->value = rec->value;
+		off += PGSQL_SPOOL_REC_HEAD + rec->len;
+	}
+	return num;
+}
+
+void pgsql_spool_path(struct nv_stor *s, unsigned long seg, char *buf,
+					  size_t len) {
+	struct pgsql_data *me = (struct pgsql_data *)s->data;
+
+	snprintf(buf, len, "%s/%s.%08lu.spool", me->spool, s->name, seg);
+}
+
+/* the size of a row's record, padded so the next one stays aligned */
+size_t pgsql_spool_size(struct pgsql_row *r) {
+	size_t size = sizeof(struct pgsql_spool_rec);
+
+	size += strlen(r->sys) + strlen(r->dset) + 2;
+	return (size + 7) & ~(size_t)7;
+}
+
+/* CRC-32 (IEEE 802.3), bit at a time; records are short */
+uint32_t pgsql_spool_crc(const unsigned char *p, size_t len) {
+	uint32_t crc = 0xffffffff;
+	int k;
+
+	while (len--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+/* vim: set ts=4 sw=4: */
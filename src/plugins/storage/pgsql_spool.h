@@ -0,0 +1,69 @@
+/***************************************************************************
+*   Copyright (C) 2005 by Robert Timothy Stewart                          *
+*   tims@cc.gatech.edu                                                    *
+*                                                                         *
+*   This program is free software; you can redistribute it and/or modify  *
+*   it under the terms of the GNU General Public License as published by  *
+*   the Free Software Foundation; either version 2 of the License, or     *
+*   (at your option) any later version.                                   *
+*                                                                         *
+*   This program is distributed in the hope that it will be useful,       *
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+*   GNU General Public License for more details.                          *
+*                                                                         *
+*   You should have received a copy of the GNU General Public License     *
+*   along with this program; if not, write to the                         *
+*   Free Software Foundation, Inc.,                                       *
+*   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+***************************************************************************/
+
+
+#ifndef _PLUGINS_PGSQL_SPOOL_H_
+#define _PLUGINS_PGSQL_SPOOL_H_
+
+#include <netvizd.h>
+#include <nvconfig.h>
+#include <stdint.h>
+#include "pgsql.h"
+
+/*
+ * While the server cannot be reached, batches go to a spool on local disk
+ * instead of being dropped, and are replayed from the heartbeat once the
+ * pool has a working connection again.  The spool is a numbered series of
+ * fixed-size segment files, <dir>/<instance>.<number>.spool, each mapped
+ * and appended to in turn.  Every record carries a CRC-32, so a record
+ * torn by a crash ends its segment instead of being replayed as garbage.
+ * Replay can repeat rows that already went in; the batch upsert skips
+ * them.
+ */
+#define PGSQL_SPOOL_SEG		(4 * 1024 * 1024)	/* bytes per segment */
+#define PGSQL_SPOOL_MAX		256		/* default megabytes on disk */
+#define PGSQL_SPOOL_BATCH	10000	/* rows per replayed batch */
+#define PGSQL_SPOOL_REPLAY	4		/* most segments replayed per beat */
+#define PGSQL_SPOOL_MAGIC	0x4e565350	/* "NVSP" */
+#define PGSQL_SPOOL_VERSION	1
+
+struct pgsql_spool_head {
+	uint32_t				magic;
+	uint32_t				version;
+};
+
+struct pgsql_spool_rec {
+	uint32_t				len;    /* bytes after 'sum', 0 past the end */
+	uint32_t				sum;    /* CRC-32 of those bytes */
+	int64_t					time;
+	double					value;
+	int32_t					id;     /* series id, or -1 */
+	uint32_t				pad;
+	/* system and data set follow, NUL-terminated, padded to 8 bytes */
+};
+
+int pgsql_spool_init(struct nv_stor *s);
+void pgsql_spool_free(struct nv_stor *s);
+int pgsql_spool_rows(struct nv_stor *s, struct pgsql_row *rows, int num);
+int pgsql_spool_replay(struct nv_stor *s);
+
+#endif
+
+/* vim: set ts=4 sw=4: */
@@ -45,7 +45,7 @@ void *sens_thread(void *arg) {
 
 //	last = time(NULL);
 	last = 0;
-	for (;;) {
+	while (!s->quit) {
 		/* call beatfunc if necessary */
 		if (s->beat > 0 && s->beatfunc != NULL) {
 			now = time(NULL);
@@ -80,6 +80,58 @@ int sens_submit_ts_data(struct nv_sens *s, int time, int value) {
 	return 0;
 }
 
+/*
+ * The same for a run of samples: each data set gets them as one batch.
+ * Returns -1 if any data set could not take them.
+ */
+int sens_submit_ts_batch(struct nv_sens *s, time_t *time, double *value,
+						 int num) {
+	nv_node n;
+	int stat = 0;
+
+	list_for_each(n, s->dsets) {
+		struct nv_dsts *d = node_data(struct nv_dsts, n);
+		if (0 > stor_submit_ts_batch(d, time, value, num)) stat = -1;
+	}
+
+	return stat;
+}
+
+/*
+ * Collect samples for a data set, submitting them every 'size' samples
+ * and on sens_batch_flush().  Whether any submit failed is kept in
+ * b->stat and returned by sens_batch_flush().
+ */
+void sens_batch_init(struct nv_ts_batch *b, struct nv_dsts *d, int size) {
+	b->d = d;
+	b->size = size > 0 ? size : SENS_BATCH;
+	b->time = nv_malloc(time_t, b->size);
+	b->value = nv_malloc(double, b->size);
+	b->num = 0;
+	b->stat = 0;
+}
+
+int sens_batch_add(struct nv_ts_batch *b, time_t time, double value) {
+	b->time[b->num] = time;
+	b->value[b->num] = value;
+	b->num++;
+	if (b->num == b->size) sens_batch_flush(b);
+	return b->stat;
+}
 
+int sens_batch_flush(struct nv_ts_batch *b) {
+	if (b->num > 0) {
+		if (0 > stor_submit_ts_batch(b->d, b->time, b->value, b->num)) {
+			b->stat = -1;
+		}
+		b->num = 0;
+	}
+	return b->stat;
+}
+
+void sens_batch_free(struct nv_ts_batch *b) {
+	nv_free(b->time);
+	nv_free(b->value);
+}
 
 /* vim: set ts=4 sw=4: */
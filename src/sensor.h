@@ -23,8 +23,30 @@
 
 #include <netvizd.h>
 
+struct nv_dsts;
+
+/*
+ * Samples for one data set, collected by a sensor and handed to storage a
+ * batch at a time (see stor_submit_ts_batch()).
+ */
+#define SENS_BATCH	1024
+struct nv_ts_batch {
+	struct nv_dsts *	d;
+	time_t *			time;
+	double *			value;
+	int					size;
+	int					num;
+	int					stat;       /* -1 once a submit has failed */
+};
+
 void *sens_thread(void *arg);
 int sens_submit_ts_data(struct nv_sens *s, int time, int value);
+int sens_submit_ts_batch(struct nv_sens *s, time_t *time, double *value,
+						 int num);
+void sens_batch_init(struct nv_ts_batch *b, struct nv_dsts *d, int size);
+int sens_batch_add(struct nv_ts_batch *b, time_t time, double value);
+int sens_batch_flush(struct nv_ts_batch *b);
+void sens_batch_free(struct nv_ts_batch *b);
 
 #endif
 
@@ -25,12 +25,25 @@
 #include <netvizd.h>
 #include <nvconfig.h>
 #include <storage.h>
+#include <time.h>
+#include <sys/stat.h>
+
+static int stor_queue_put(struct nv_stor_q *q, struct nv_dsts *d,
+						  time_t *time, double *value, int num, int utime);
+static int stor_queue_spool(struct nv_stor_q *q, struct nv_stor_qent *e);
+static int stor_queue_unspool(struct nv_stor *s, struct nv_stor_qent *e,
+							  int max);
+static int stor_queue_trim(struct nv_stor_q *q);
+static void stor_queue_wait(struct nv_stor_q *q);
+static void stor_queue_report(struct nv_stor *s);
+static int stor_put_ts_batch(struct nv_dsts *d, time_t *time,
+							 double *value, int num);
 
 /*
  * The entry point for a storage heartbeat thread.  This will only be started
  * if the storage instance has indicated that it periodically needs to be
- * called.  The storage instance can do anything it wishes here, including
- * blocking.
+ * called, or has an ingest queue for us to drain.  The storage instance can
+ * do anything it wishes here, including blocking.
  */
 void *stor_thread(void *arg) {
 	struct nv_stor *s = (struct nv_stor *)arg;
@@ -43,46 +56,126 @@ void *stor_thread(void *arg) {
 	stat = nv_calloc(int, 1);
 
 	last = time(NULL);
-	for (;;) {
+	while (!s->quit) {
 		/* call beatfunc if necessary */
 		if (s->beat > 0 && s->beatfunc != NULL) {
 			now = time(NULL);
 			if (now >= last+s->beat) {
 				last = now;
 				*stat = s->beatfunc(s);
+				if (*stat != 0 && s->queue != NULL) {
+					nv_log(NVLOG_ERROR, "%s: heartbeat failed, still "
+						   "draining the queue", s->name);
+				}
 			}
-			if (*stat != 0) break;
+
+			/* sensors may be waiting on the queue for room, so it has to
+			 * keep moving; with no queue we can stop */
+			if (*stat != 0 && s->queue == NULL) break;
 		}
 
-		/* give up the processor for a bit */
-		usleep(THREAD_SLEEP);
+		/* hand queued samples to the plugin, or give up the processor for
+		 * a bit (or until some come in) if there are none */
+		if (s->queue == NULL) {
+			usleep(THREAD_SLEEP);
+		} else if (0 == stor_queue_drain(s, 1)) {
+			stor_queue_wait(s->queue);
+		}
 	}
 
 	nv_log(NVLOG_DEBUG, "%s: storage heartbeat thread stopping", s->name);
 	return (void *)stat;
 }
 
+/*
+ * Introduce every data set to its storage instance, once the instances are
+ * up.  The handle each one hands back goes with every later call for that
+ * data set, so plugins never have to look a series up by name.  Returns 0,
+ * or -1 if any instance could not open a series.
+ */
+int stor_open_series() {
+	nv_node i = NULL;
+	int stat = 0;
+
+	list_for_each(i, &nv_dsts_list) {
+		struct nv_dsts *d = node_data(struct nv_dsts, i);
+
+		if (d->stor == NULL) continue;
+		d->series = d->stor->plug->open_series(d->stor, d->name,
+											   d->sys->name);
+		if (d->series == NULL) {
+			nv_log(NVLOG_ERROR, "%s: could not open series %s/%s",
+				   d->stor->name, d->sys->name, d->name);
+			stat = -1;
+		}
+	}
+	return stat;
+}
+
 /*
  * Here we submit a time-series data element to be stored in the given
- * storage plugin.
+ * storage plugin, by way of its ingest queue if it has one.
  */
 int stor_submit_ts_data(struct nv_dsts *d, time_t time, double value) {
-	return d->stor->plug->stor_ts_data(d->stor, d->name, d->sys->name, time,
-									   value);
+	if (d->stor->queue != NULL) {
+		return stor_queue_put(d->stor->queue, d, &time, &value, 1, 0);
+	}
+	return d->stor->plug->stor_ts_data(d->stor, d->series, time, value);
+}
+
+/*
+ * Submit a run of samples for one data set.  Returns 0, or -1 if any
+ * sample could not be queued (or, without a queue, stored).
+ */
+int stor_submit_ts_batch(struct nv_dsts *d, time_t *time, double *value,
+						 int num) {
+	if (num <= 0) return 0;
+	if (d->stor->queue != NULL) {
+		return stor_queue_put(d->stor->queue, d, time, value, num, 0);
+	}
+	return stor_put_ts_batch(d, time, value, num);
+}
+
+/*
+ * Hand a run of samples for one data set to the plugin.  Plugins that take
+ * batches get it in one call; for the others we hand the samples over one
+ * at a time.  Returns 0, or -1 if any sample could not be stored.
+ */
+int stor_put_ts_batch(struct nv_dsts *d, time_t *time, double *value,
+					  int num) {
+	int stat = 0;
+	int i;
+
+	if (d->stor->plug->stor_ts_data_batch != NULL) {
+		return d->stor->plug->stor_ts_data_batch(d->stor, d->series, time,
+												 value, num);
+	}
+
+	for (i = 0; i < num; i++) {
+		if (0 > d->stor->plug->stor_ts_data(d->stor, d->series, time[i],
+											value[i])) {
+			stat = -1;
+		}
+	}
+	return stat;
 }
 
 /*
- * Let a sensor plugin store the last-updated time in a storage plugin.
+ * Let a sensor plugin store the last-updated time in a storage plugin.  It
+ * is queued behind the samples it covers, so it never gets there first.
  */
 int stor_submit_ts_utime(struct nv_dsts *d, time_t time) {
-	return d->stor->plug->stor_ts_utime(d->stor, d->name, d->sys->name, time);
+	if (d->stor->queue != NULL) {
+		return stor_queue_put(d->stor->queue, d, &time, NULL, 1, 1);
+	}
+	return d->stor->plug->stor_ts_utime(d->stor, d->series, time);
 }
 
 /*
  * Let a sensor plugin retreive the last-updated time.
  */
 time_t stor_get_ts_utime(struct nv_dsts *d) {
-	return d->stor->plug->get_ts_utime(d->stor, d->name, d->sys->name);
+	return d->stor->plug->get_ts_utime(d->stor, d->series);
 }
 
 /*
@@ -90,8 +183,554 @@ time_t stor_get_ts_utime(struct nv_dsts *d) {
  */
 nv_list *stor_get_ts_data(struct nv_dsts *d, time_t start, time_t end,
 						  int res) {
-	return d->stor->plug->get_ts_data(d->stor, d->name, d->sys->name, start,
-									  end, res);
+	return d->stor->plug->get_ts_data(d->stor, d->series, start, end,
+									  res);
+}
+
+/*
+ * Read the samples in a range into the caller's buffer (see storage.h).
+ * A plugin with a cursor is read a block at a time through a raw one,
+ * which leaves out unknown values.  Plugins without one, or whose cursor
+ * will not open just then (it may have nothing free to read with), are
+ * read through their list instead.  Returns 0 on success.
+ */
+int stor_get_ts_buf(struct nv_dsts *d, time_t start, time_t end,
+					struct nv_ts_buf *b) {
+	struct nv_stor_p *p = d->stor->plug;
+	struct nv_ts_block *blk = NULL;
+	nv_list *result = NULL;
+	void *h = NULL;
+	int stat = 0;
+	int ret = 0;
+	int i;
+
+	b->num = 0;
+	if (p->ts_open != NULL) {
+		h = p->ts_open(d->stor, d->series, start, end, 0, d->cf);
+	}
+	if (h != NULL) {
+		blk = nv_calloc(struct nv_ts_block, 1);
+		while (stat == 0 && (ret = p->ts_next_block(d->stor, h, blk)) > 0) {
+			for (i = 0; i < blk->num && stat == 0; i++) {
+				b->time[b->num] = blk->time[i];
+				b->value[b->num] = blk->value[i];
+				b->num++;
+				if (b->num == b->size) {
+					stat = b->flush(b);
+					b->num = 0;
+				}
+			}
+		}
+		p->ts_close(d->stor, h);
+		nv_free(blk);
+		if (ret < 0) stat = -1;
+		if (stat == 0 && b->num > 0) stat = b->flush(b);
+		b->num = 0;
+		return stat;
+	}
+
+	result = stor_get_ts_data(d, start, end, 0);
+	while (result->next != NULL && result->next != result) {
+		nv_node i = result->next;
+		struct nv_ts_data *r = node_data(struct nv_ts_data, i);
+
+		if (stat == 0) {
+			b->time[b->num] = r->time;
+			b->value[b->num] = r->value;
+			b->num++;
+			if (b->num == b->size) {
+				stat = b->flush(b);
+				b->num = 0;
+			}
+		}
+		list_del(i);
+		nv_free(r);
+	}
+	if (stat == 0 && b->num > 0) stat = b->flush(b);
+	b->num = 0;
+	nv_free(result);
+
+	return stat;
+}
+
+/* fold a buffer of samples into the aggregation in b->arg */
+static int stor_agg_flush(struct nv_ts_buf *b) {
+	nv_agg_add((struct nv_agg *)b->arg, b->time, b->value, b->num);
+	return 0;
+}
+
+/*
+ * Pull data from storage consolidated into res-minute buckets (see
+ * aggregate.c): the raw samples are read with stor_get_ts_buf() and
+ * folded in here, a buffer at a time.  Plugins that can do the bucketing
+ * themselves do it for reads through stor_ts_open().  Returns 0 on
+ * success, with 'a' initialized either way.
+ */
+#define STOR_AGG_CHUNK	1024
+int stor_get_ts_agg(struct nv_dsts *d, time_t start, time_t end, int res,
+					struct nv_agg *a) {
+	time_t t[STOR_AGG_CHUNK];
+	double v[STOR_AGG_CHUNK];
+	struct nv_ts_buf b;
+
+	nv_agg_init(a, res);
+	b.time = t;
+	b.value = v;
+	b.size = STOR_AGG_CHUNK;
+	b.flush = stor_agg_flush;
+	b.arg = a;
+	return stor_get_ts_buf(d, start, end, &b);
+}
+
+/*
+ * An open range read.  Plugins with a cursor of their own hand back a
+ * handle for it; for the rest the whole result is read up front and
+ * handed out a block at a time.
+ */
+struct nv_ts_cursor {
+	struct nv_dsts *	d;
+	void *				state;		/* the plugin's handle, if it has one */
+	struct nv_agg		agg;		/* otherwise, the result */
+	int					pos;		/* next bucket of agg to return */
+};
+
+/*
+ * Open a read of a range at the given resolution (as stor_get_ts_agg()),
+ * to be pulled with stor_ts_next_block() and finished with stor_ts_close().
+ * With a plugin that supports it, the reader only ever holds a block, so
+ * the first samples are ready before the rest are read and memory does
+ * not grow with the range.  Returns NULL on error.
+ */
+struct nv_ts_cursor *stor_ts_open(struct nv_dsts *d, time_t start,
+								  time_t end, int res) {
+	struct nv_ts_cursor *cur = NULL;
+
+	cur = nv_calloc(struct nv_ts_cursor, 1);
+	cur->d = d;
+
+	if (d->stor->plug->ts_open != NULL) {
+		cur->state = d->stor->plug->ts_open(d->stor, d->series, start, end,
+											res, d->cf);
+		if (cur->state == NULL) goto error;
+		return cur;
+	}
+
+	if (0 > stor_get_ts_agg(d, start, end, res, &cur->agg)) goto error;
+	return cur;
+
+error:
+	nv_agg_free(&cur->agg);
+	nv_free(cur);
+	return NULL;
+}
+
+/*
+ * Fill 'b' with the next block of the read.  Returns the number of
+ * entries, 0 once the range is exhausted, or -1 on error.
+ */
+int stor_ts_next_block(struct nv_ts_cursor *cur, struct nv_ts_block *b) {
+	struct nv_agg *a = &cur->agg;
+
+	b->num = 0;
+	if (cur->state != NULL) {
+		return cur->d->stor->plug->ts_next_block(cur->d->stor, cur->state,
+												 b);
+	}
+
+	for (; cur->pos < a->num && b->num < NV_TS_BLOCK; cur->pos++, b->num++) {
+		b->time[b->num] = a->time[cur->pos];
+		b->value[b->num] = nv_agg_value(a, cur->pos, cur->d->cf);
+		b->min[b->num] = a->min[cur->pos];
+		b->max[b->num] = a->max[cur->pos];
+	}
+	return b->num;
+}
+
+/* finish a read, whether or not it was exhausted */
+void stor_ts_close(struct nv_ts_cursor *cur) {
+	if (cur == NULL) return;
+	if (cur->state != NULL) {
+		cur->d->stor->plug->ts_close(cur->d->stor, cur->state);
+	}
+	nv_agg_free(&cur->agg);
+	nv_free(cur);
+}
+
+/*
+ * Set up a storage instance's ingest queue from the core's own keys in its
+ * configuration, which are taken out before the plugin sees the rest:
+ * "queue" (the ring size in samples, 0 to have sensors call the plugin
+ * directly), "queue_policy" (block, drop_oldest or spool) and
+ * "queue_spool" (the file for the spool policy).  A spool left over from
+ * a previous run is read back before anything new.  Returns 0 on success.
+ */
+int stor_queue_init(struct nv_stor *s) {
+	struct nv_stor_q *q = NULL;
+	nv_node i = NULL;
+	nv_node next = NULL;
+	enum nv_q_policy policy = q_policy_block;
+	char spool[NAME_LEN] = "";
+	int size = STOR_QUEUE;
+	long len = 0;
+
+	for (i = s->conf->next; i != s->conf && i != NULL; i = next) {
+		struct nv_conf *c = node_data(struct nv_conf, i);
+
+		next = i->next;
+		if (strncmp(c->key, "queue", NAME_LEN) == 0) {
+			size = atoi(c->value);
+		} else if (strncmp(c->key, "queue_policy", NAME_LEN) == 0) {
+			if (strncmp(c->value, "block", NAME_LEN) == 0) {
+				policy = q_policy_block;
+			} else if (strncmp(c->value, "drop_oldest", NAME_LEN) == 0) {
+				policy = q_policy_drop_oldest;
+			} else if (strncmp(c->value, "spool", NAME_LEN) == 0) {
+				policy = q_policy_spool;
+			} else {
+				nv_log(NVLOG_ERROR, "%s: unknown queue policy \"%s\"",
+					   s->name, c->value);
+				return -1;
+			}
+		} else if (strncmp(c->key, "queue_spool", NAME_LEN) == 0) {
+			name_copy(spool, c->value);
+		} else {
+			continue;
+		}
+		list_del(i);
+		nv_free(c);
+	}
+
+	if (size <= 0) return 0;
+	if (policy == q_policy_spool && spool[0] == '\0') {
+		nv_log(NVLOG_ERROR, "%s: queue_spool not specified for the spool "
+			   "queue policy", s->name);
+		return -1;
+	}
+
+	q = nv_calloc(struct nv_stor_q, 1);
+	q->ring = nv_calloc(struct nv_stor_qent, size);
+	q->size = size;
+	q->policy = policy;
+	q->lock = nv_calloc(pthread_mutex_t, 1);
+	q->room = nv_calloc(pthread_cond_t, 1);
+	q->ready = nv_calloc(pthread_cond_t, 1);
+	q->dlock = nv_calloc(pthread_mutex_t, 1);
+	pthread_mutex_init(q->lock, NULL);
+	pthread_cond_init(q->room, NULL);
+	pthread_cond_init(q->ready, NULL);
+	pthread_mutex_init(q->dlock, NULL);
+	s->queue = q;
+
+	if (policy != q_policy_spool) return 0;
+	name_copy(q->spool, spool);
+	q->sout = fopen(q->spool, "a");
+	if (q->sout == NULL) {
+		nv_perror(NVLOG_ERROR, q->spool, errno);
+		return -1;
+	}
+	q->sin = fopen(q->spool, "r");
+	if (q->sin == NULL) {
+		nv_perror(NVLOG_ERROR, q->spool, errno);
+		return -1;
+	}
+	fseek(q->sout, 0, SEEK_END);
+	len = ftell(q->sout);
+	if (len > 0) {
+		nv_log(NVLOG_INFO, "%s: reading back %ld bytes of spooled samples",
+			   s->name, len);
+		q->spooling = 1;
+	}
+	return 0;
+}
+
+/*
+ * Queue 'num' samples (or one update time, with no values) for a data
+ * set.  When the ring is full, what happens depends on the policy.
+ * Returns 0, or -1 if any could not be queued.
+ */
+int stor_queue_put(struct nv_stor_q *q, struct nv_dsts *d, time_t *time,
+				   double *value, int num, int utime) {
+	struct nv_stor_qent *e = NULL;
+	struct nv_stor_qent se;
+	int stat = 0;
+	int i;
+
+	nv_lock(q->lock);
+	for (i = 0; i < num; i++) {
+		/* make room, unless we are (or start) spooling */
+		while (!q->spooling && q->num == q->size) {
+			switch (q->policy) {
+				case q_policy_drop_oldest:
+					q->head = (q->head + 1) % q->size;
+					q->num--;
+					q->dropped++;
+					break;
+
+				case q_policy_spool:
+					q->spooling = 1;
+					break;
+
+				case q_policy_block:
+				default:
+					q->waits++;
+					nv_wait(q->room, q->lock);
+					break;
+			}
+		}
+
+		/* the spool holds the newest entries until it is read back */
+		e = q->spooling ? &se : &q->ring[(q->head + q->num) % q->size];
+		e->d = d;
+		e->time = time[i];
+		e->value = value != NULL ? value[i] : 0.0;
+		e->utime = utime;
+		if (q->spooling) {
+			if (0 > stor_queue_spool(q, e)) stat = -1;
+			continue;
+		}
+		q->num++;
+		q->added++;
+		if (q->num > q->peak) q->peak = q->num;
+	}
+	if (q->spooling) fflush(q->sout);
+	nv_signal(q->ready);
+	nv_unlock(q->lock);
+
+	return stat;
+}
+
+/*
+ * Hand up to STOR_Q_BATCH queued entries to the plugin: from the ring, or
+ * once that is empty (and if 'spool' is set) from the spool file.  Runs of
+ * samples for one data set go over as one batch.  Returns the number of
+ * entries taken.
+ */
+int stor_queue_drain(struct nv_stor *s, int spool) {
+	struct nv_stor_q *q = s->queue;
+	struct nv_stor_qent e[STOR_Q_BATCH];
+	time_t t[STOR_Q_BATCH];
+	double v[STOR_Q_BATCH];
+	int unspool = 0;
+	int num = 0;
+	int i = 0;
+	int j = 0;
+	int n = 0;
+
+	nv_lock(q->dlock);
+	if (q->quit) goto cleanup;
+
+	nv_lock(q->lock);
+	for (num = 0; num < STOR_Q_BATCH && q->num > 0; num++) {
+		e[num] = q->ring[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->num--;
+	}
+	if (num > 0) {
+		nv_broadcast(q->room);
+	} else if (spool && q->spooling) {
+		unspool = 1;
+	}
+	q->taken += num;
+	nv_unlock(q->lock);
+	if (unspool) num = stor_queue_unspool(s, e, STOR_Q_BATCH);
+
+	for (i = 0; i < num; i = j) {
+		if (e[i].utime) {
+			e[i].d->stor->plug->stor_ts_utime(s, e[i].d->series, e[i].time);
+			j = i + 1;
+			continue;
+		}
+		for (j = i, n = 0; j < num && e[j].d == e[i].d && !e[j].utime;
+			 j++, n++) {
+			t[n] = e[j].time;
+			v[n] = e[j].value;
+		}
+		stor_put_ts_batch(e[i].d, t, v, n);
+	}
+	stor_queue_report(s);
+
+cleanup:
+	nv_unlock(q->dlock);
+	return num;
+}
+
+/*
+ * Before the plugin shuts down, hand it everything left in the ring and
+ * stop draining.  Whatever is still spooled stays on disk for next time,
+ * less what has been read back already.
+ */
+void stor_queue_flush(struct nv_stor *s) {
+	struct nv_stor_q *q = s->queue;
+
+	if (q == NULL) return;
+	while (0 < stor_queue_drain(s, 0));
+
+	nv_lock(q->dlock);
+	q->quit = 1;
+	nv_unlock(q->dlock);
+
+	nv_lock(q->lock);
+	nv_log(NVLOG_INFO, "%s: %lu samples queued, %lu dropped, %lu spooled, "
+		   "%lu waits for room, peak depth %i of %i", s->name, q->added,
+		   q->dropped, q->spooled, q->waits, q->peak, q->size);
+	if (q->spooling) stor_queue_trim(q);
+	nv_unlock(q->lock);
+}
+
+/* cut the part of the spool already read back off the front of the file */
+int stor_queue_trim(struct nv_stor_q *q) {
+	char name[NAME_LEN + 8];
+	char buf[BUF_LEN];
+	FILE *out = NULL;
+	size_t n = 0;
+
+	fflush(q->sout);
+	if (ftell(q->sin) <= 0) return 0;
+
+	snprintf(name, sizeof(name), "%s.tmp", q->spool);
+	out = fopen(name, "w");
+	if (out == NULL) goto error;
+	while ((n = fread(buf, 1, sizeof(buf), q->sin)) > 0) {
+		if (fwrite(buf, 1, n, out) != n) goto error;
+	}
+	if (0 != fclose(out)) {
+		out = NULL;
+		goto error;
+	}
+	if (0 > rename(name, q->spool)) goto error;
+	return 0;
+
+error:
+	nv_perror(NVLOG_ERROR, name, errno);
+	if (out != NULL) fclose(out);
+	unlink(name);
+	return -1;
+}
+
+/* sleep until something is queued, or for THREAD_SLEEP at most */
+void stor_queue_wait(struct nv_stor_q *q) {
+	struct timespec timeout;
+
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	timeout.tv_nsec += THREAD_SLEEP * 1000L;
+	if (timeout.tv_nsec >= 1000000000L) {
+		timeout.tv_sec++;
+		timeout.tv_nsec -= 1000000000L;
+	}
+
+	nv_lock(q->lock);
+	if (q->num == 0 && !q->spooling) {
+		nv_timedwait(q->ready, q->lock, &timeout) {
+			;;
+		}
+	}
+	nv_unlock(q->lock);
+}
+
+/* append an entry to the spool file; call with the lock held */
+int stor_queue_spool(struct nv_stor_q *q, struct nv_stor_qent *e) {
+	if (0 > fprintf(q->sout, "%c\t%ld\t%.17g\t%s\t%s\n", e->utime ? 'u' : 'd',
+					(long)e->time, e->value, e->d->sys->name, e->d->name)) {
+		nv_perror(NVLOG_ERROR, q->spool, errno);
+		q->dropped++;
+		return -1;
+	}
+	q->spooled++;
+	return 0;
+}
+
+/*
+ * Read back up to 'max' spooled entries; call with dlock held, but not the
+ * lock, so sensors can keep queueing while the file is read.  Once the
+ * file has all been read it is emptied, and new entries go to the ring
+ * again.  Entries for data sets this instance no longer keeps are dropped.
+ */
+int stor_queue_unspool(struct nv_stor *s, struct nv_stor_qent *e, int max) {
+	struct nv_stor_q *q = s->queue;
+	struct nv_dsts *d = NULL;
+	char line[BUF_LEN];
+	char *f[5];
+	char *brk = NULL;
+	unsigned long dropped = 0;
+	struct stat st;
+	size_t len = 0;
+	int done = 0;
+	int num = 0;
+	int n = 0;
+
+	nv_lock(q->lock);
+	fflush(q->sout);
+	nv_unlock(q->lock);
+
+	while (num < max) {
+		if (fgets(line, sizeof(line), q->sin) == NULL) {
+			done = 1;
+			break;
+		}
+
+		/* a sensor may be part way through writing the last line */
+		len = strlen(line);
+		if (line[len-1] != '\n') {
+			fseek(q->sin, -(long)len, SEEK_CUR);
+			break;
+		}
+
+		/* kind, time, value, system, data set */
+		line[len-1] = '\0';
+		for (n = 0; n < 5; n++) {
+			f[n] = strtok_r(n == 0 ? line : NULL, "\t", &brk);
+			if (f[n] == NULL) break;
+		}
+		d = n == 5 ? nv_dsts_find(f[3], strlen(f[3]), f[4], strlen(f[4])) :
+			NULL;
+		if (d == NULL || d->stor != s) {
+			dropped++;
+			continue;
+		}
+
+		e[num].d = d;
+		e[num].utime = f[0][0] == 'u';
+		e[num].time = (time_t)strtol(f[1], NULL, 10);
+		e[num].value = strtod(f[2], NULL);
+		num++;
+	}
+
+	nv_lock(q->lock);
+	q->dropped += dropped;
+	q->taken += num;
+	clearerr(q->sin);
+	if (done) {
+		/* all read back, unless more was spooled meanwhile; start over */
+		fflush(q->sout);
+		if (fstat(fileno(q->sout), &st) == 0 &&
+			ftell(q->sin) >= st.st_size) {
+			if (0 > ftruncate(fileno(q->sout), 0)) {
+				nv_perror(NVLOG_ERROR, q->spool, errno);
+			}
+			rewind(q->sin);
+			q->spooling = 0;
+		}
+	}
+	nv_unlock(q->lock);
+	return num;
+}
+
+/* warn about dropped samples, at most once every STOR_Q_REPORT seconds */
+#define STOR_Q_REPORT	60
+void stor_queue_report(struct nv_stor *s) {
+	struct nv_stor_q *q = s->queue;
+	unsigned long dropped = 0;
+	time_t now = time(NULL);
+
+	nv_lock(q->lock);
+	dropped = q->dropped;
+	nv_unlock(q->lock);
+	if (dropped == q->reported || now < q->rtime + STOR_Q_REPORT) return;
+
+	nv_log(NVLOG_WARN, "%s: ingest queue overflowed, %lu samples dropped",
+		   s->name, dropped - q->reported);
+	q->reported = dropped;
+	q->rtime = now;
 }
 
 /* vim: set ts=4 sw=4: */
@@ -22,6 +22,8 @@
 #define _STORAGE_H_
 
 #include <netvizd.h>
+#include <pthread.h>
+#include <aggregate.h>
 
 /* data type for returned bulk data */
 struct nv_ts_data {
@@ -31,12 +33,115 @@ struct nv_ts_data {
 	double		max;
 };
 
+/*
+ * A caller-supplied buffer that storage fills with samples, in time order.
+ * Whenever it is full, and once at the end, storage calls flush, which
+ * must consume all 'num' samples; storage then starts again from the top.
+ * A non-zero return from flush stops the read.
+ */
+struct nv_ts_buf {
+	time_t *	time;
+	double *	value;
+	int			size;
+	int			num;
+	int			(*flush)(struct nv_ts_buf *);
+	void *		arg;
+};
+
+/*
+ * A block of samples read through a cursor, one array per field.  Each
+ * entry is a bucket at the requested resolution: its start, its value by
+ * the data set's consolidation function, and its minimum and maximum.  A
+ * raw read (resolution 0) gives the samples themselves, with min and max
+ * equal to the value.
+ */
+#define NV_TS_BLOCK	1024
+struct nv_ts_block {
+	int			num;
+	time_t		time[NV_TS_BLOCK];
+	double		value[NV_TS_BLOCK];
+	double		min[NV_TS_BLOCK];
+	double		max[NV_TS_BLOCK];
+};
+
+/* an open range read; see stor_ts_open() */
+struct nv_ts_cursor;
+
+/*
+ * What a sensor gets when a storage instance's ingest queue is full.
+ */
+enum nv_q_policy {
+	q_policy_block = 0,		/* wait for the storage thread to make room */
+	q_policy_drop_oldest,	/* the oldest queued sample is dropped */
+	q_policy_spool			/* the overflow goes to a file, in order */
+};
+
+/* a queued sample, or update time if 'utime' is set */
+struct nv_stor_qent {
+	struct nv_dsts *	d;
+	time_t				time;
+	double				value;
+	int					utime;
+};
+
+/*
+ * The ingest queue of a storage instance: a bounded ring that any number
+ * of sensor threads put samples into, and that the instance's storage
+ * thread takes them out of, a batch at a time, to hand to the plugin.  A
+ * slow backend then only holds up its own thread until the ring fills.
+ */
+#define STOR_QUEUE		65536		/* default ring size, in samples */
+#define STOR_Q_BATCH	1024		/* most entries taken at once */
+struct nv_stor_q {
+	struct nv_stor_qent *	ring;
+	int					size;
+	int					head;		/* oldest entry */
+	int					num;		/* entries in the ring */
+	enum nv_q_policy	policy;
+	pthread_mutex_t *	lock;		/* protects all of the above */
+	pthread_cond_t *	room;		/* entries were taken */
+	pthread_cond_t *	ready;		/* entries were added */
+	pthread_mutex_t *	dlock;		/* one drain at a time */
+	int					quit;		/* stop draining, see stor_queue_flush() */
+
+	/* spool policy: once the ring overflows, everything goes to the file
+	 * until the storage thread has read it all back */
+	char				spool[NAME_LEN];
+	FILE *				sout;
+	FILE *				sin;
+	int					spooling;
+
+	/* counters */
+	unsigned long		added;
+	unsigned long		taken;
+	unsigned long		dropped;
+	unsigned long		spooled;
+	unsigned long		waits;		/* times a sensor waited for room */
+	int					peak;		/* deepest the ring has been */
+	unsigned long		reported;	/* drops logged so far */
+	time_t				rtime;		/* when they were logged */
+};
+
 void *stor_thread(void *arg);
+int stor_open_series();
+int stor_queue_init(struct nv_stor *s);
+int stor_queue_drain(struct nv_stor *s, int spool);
+void stor_queue_flush(struct nv_stor *s);
 int stor_submit_ts_data(struct nv_dsts *d, time_t time, double value);
+int stor_submit_ts_batch(struct nv_dsts *d, time_t *time, double *value,
+						 int num);
 int stor_submit_ts_utime(struct nv_dsts *d, time_t time);
 time_t stor_get_ts_utime(struct nv_dsts *d);
 nv_list *stor_get_ts_data(struct nv_dsts *d, time_t start, time_t end,
 						  int res);
+int stor_get_ts_buf(struct nv_dsts *d, time_t start, time_t end,
+					struct nv_ts_buf *b);
+int stor_get_ts_agg(struct nv_dsts *d, time_t start, time_t end, int res,
+					struct nv_agg *a);
+struct nv_ts_cursor *stor_ts_open(struct nv_dsts *d, time_t start,
+								  time_t end, int res);
+int stor_ts_next_block(struct nv_ts_cursor *cur, struct nv_ts_block *b);
+void stor_ts_close(struct nv_ts_cursor *cur);
 
 #endif
 